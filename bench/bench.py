@@ -0,0 +1,114 @@
+#
+# Compile throughput of the backends on synthetic programs (bench/gen.py).
+#
+# usage: python bench/bench.py [-b backend] [-w workload] [-O level]
+#                              [-r repeat] [-o results.json] [-C old.json]
+#
+# Every backend compiles every workload repeat times; the fastest run is
+# kept.  For each pair the results file has the tokens and lines per
+# second, the peak RSS of the compiler (measured by bench-run, from
+# bench/run.c) and the bytes it wrote.  With -C
+# the results are compared with an older results file, so that a slower
+# lexer, sym_find or emitter shows up as a drop in one of the columns.
+#
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from gen import Program
+
+BACKENDS = ['dummy', 'zpu', 'x86', 'x86_64']
+
+# name: gen.py options; each one stresses a part of the compiler
+WORKLOADS = {
+	'mixed': dict(funcs=500, globals=500),                           # a bit of everything
+	'funcs': dict(funcs=2000, globals=10, depth=4, comment=0, strings=0), # prologues, calls
+	'globals': dict(funcs=200, globals=3500),                        # sym_find on long chains
+	'exprs': dict(funcs=100, globals=50, depth=120),                 # deep nesting, spills
+	'comments': dict(funcs=200, globals=50, comment=200),            # the scanners
+	'strings': dict(funcs=200, globals=50, strings=40),              # string literals
+}
+
+# the tokens readtok() sees: comments are skipped, strings are one token
+TOKEN = re.compile(r'"(?:\\.|[^"\\])*"|[A-Za-z_]\w*|\d\w*|<<|>>|==|!=|\S')
+COMMENT = re.compile(r'/\*.*?\*/|//[^\n]*', re.S)
+
+def count_tokens(src):
+	return len(TOKEN.findall(COMMENT.sub(' ', src)))
+
+# compile path once, returning (seconds, peak RSS in KB, bytes written)
+def run(cucu, opt, path):
+	with open(path, 'rb') as f, tempfile.TemporaryFile() as out:
+		p = subprocess.Popen(['./bench-run', cucu, '-O%d' % opt], stdin=f, stdout=out,
+				stderr=subprocess.PIPE)
+		err = p.communicate()[1].decode().split('\n')
+		if p.returncode != 0:
+			raise RuntimeError('%s failed on %s: %s' % (cucu, path, '\n'.join(err)))
+		secs, rss = err[-2].split()
+		return float(secs), int(rss), out.tell()
+
+def compare(results, old):
+	before = {(r['backend'], r['workload']): r for r in old['results']}
+	print()
+	print('%-8s %-10s %10s %10s %10s' % ('backend', 'workload', 'tokens/s', 'rss', 'bytes'))
+	for r in results:
+		o = before.get((r['backend'], r['workload']))
+		if o is None:
+			continue
+		delta = lambda k: '%+9.1f%%' % ((r[k] - o[k]) * 100.0 / o[k] if o[k] else 0)
+		print('%-8s %-10s %10s %10s %10s' % (r['backend'], r['workload'],
+			delta('tokens_per_sec'), delta('peak_rss_kb'), delta('emitted_bytes')))
+
+def main():
+	p = argparse.ArgumentParser(description='Benchmark compile throughput.')
+	p.add_argument('-b', action='append', choices=BACKENDS, help='backend (default: all)')
+	p.add_argument('-w', action='append', choices=sorted(WORKLOADS), help='workload (default: all)')
+	p.add_argument('-O', type=int, default=2, help='optimization level')
+	p.add_argument('-r', type=int, default=3, help='runs per backend and workload')
+	p.add_argument('-o', default='bench-results.json', help='results file')
+	p.add_argument('-C', help='results file to compare with')
+	a = p.parse_args()
+
+	results = []
+	tmp = tempfile.mkdtemp()
+	print('%-8s %-10s %8s %8s %12s %12s %10s %10s' % ('backend', 'workload', 'lines',
+		'tokens', 'tokens/s', 'lines/s', 'rss KB', 'bytes'))
+	for w in a.w or list(WORKLOADS):
+		src = Program(**WORKLOADS[w]).generate()
+		path = os.path.join(tmp, w + '.c')
+		with open(path, 'w') as f:
+			f.write(src)
+		lines = src.count('\n')
+		tokens = count_tokens(src)
+		for b in a.b or BACKENDS:
+			runs = [run('./cucu-' + b, a.O, path) for _ in range(a.r)]
+			secs = min(r[0] for r in runs)
+			r = {
+				'backend': b, 'workload': w, 'opt': a.O,
+				'source_bytes': len(src), 'lines': lines, 'tokens': tokens,
+				'seconds': secs,
+				'tokens_per_sec': tokens / secs, 'lines_per_sec': lines / secs,
+				'peak_rss_kb': max(r[1] for r in runs),
+				'emitted_bytes': runs[0][2],
+			}
+			results.append(r)
+			print('%-8s %-10s %8d %8d %12.0f %12.0f %10d %10d' % (b, w, lines, tokens,
+				r['tokens_per_sec'], r['lines_per_sec'], r['peak_rss_kb'], r['emitted_bytes']))
+		os.unlink(path)
+	os.rmdir(tmp)
+
+	with open(a.o, 'w') as f:
+		json.dump({'repeat': a.r, 'results': results}, f, indent=1)
+		f.write('\n')
+	print('results written to %s' % a.o)
+	if a.C:
+		with open(a.C) as f:
+			compare(results, json.load(f))
+
+if __name__ == '__main__':
+	main()
@@ -0,0 +1,123 @@
+#
+# Synthetic programs for the compile benchmark.
+#
+# usage: python bench/gen.py [-f funcs] [-g globals] [-d depth] [-c comment]
+#                            [-s strings] [-S seed] > prog.c
+#
+# The program has the given number of globals and functions and a main
+# calling all of them.  Each function body mixes locals, assignments, ifs
+# and whiles whose expressions nest up to depth parentheses, as many
+# string literals as asked and a block comment of that many lines before
+# it.  The same options and seed always give the same program.
+#
+import argparse
+import random
+
+WORDS = ['alpha', 'beta', 'gamma', 'delta', 'value', 'index', 'count', 'total',
+	'left', 'right', 'next', 'prev', 'state', 'flag', 'size', 'limit']
+OPS = ['+', '-', '&', '|', '^', '*', '<<', '>>', '<', '==', '!=']
+
+class Program:
+	def __init__(self, funcs=100, globals=100, depth=8, comment=4, strings=2, seed=1):
+		self.funcs = funcs
+		self.globals = globals
+		self.depth = depth
+		self.comment = comment
+		self.strings = strings
+		self.r = random.Random(seed)
+		self.lines = []
+
+	def name(self, prefix, i):
+		return '%s_%s_%d' % (prefix, self.r.choice(WORDS), i)
+
+	def leaf(self, names):
+		if names and self.r.random() < 0.7:
+			return self.r.choice(names)
+		if self.r.random() < 0.5:
+			return '0x%x' % self.r.randint(0, 0xfff)
+		return str(self.r.randint(0, 999))
+
+	# an expression nested depth parentheses deep
+	def expr(self, names, depth):
+		e = self.leaf(names)
+		for _ in range(depth):
+			op = self.r.choice(OPS)
+			if op in ('<<', '>>'):
+				e = '(%s %s %d)' % (e, op, self.r.randint(1, 7))
+			elif self.r.random() < 0.5:
+				e = '(%s %s %s)' % (e, op, self.leaf(names))
+			else:
+				e = '(%s %s %s)' % (self.leaf(names), op, e)
+		return e
+
+	def string(self):
+		words = [self.r.choice(WORDS) for _ in range(self.r.randint(2, 12))]
+		return '"%s\\x0a"' % ' '.join(words)
+
+	def comment_block(self, what):
+		if self.comment == 0:
+			return
+		self.lines.append('/*')
+		self.lines.append(' * %s' % what)
+		for _ in range(self.comment - 1):
+			self.lines.append(' * ' + ' '.join(self.r.choice(WORDS) for _ in range(10)))
+		self.lines.append(' */')
+
+	def function(self, name, globs):
+		self.comment_block(name)
+		self.lines.append('int %s(int a, int b) {' % name)
+		names = ['a', 'b'] + self.r.sample(globs, min(4, len(globs)))
+		nlocals = self.r.randint(2, 5)
+		for i in range(nlocals):
+			v = 'v%d' % i
+			self.lines.append('  int %s = %s;' % (v, self.expr(names, 1)))
+			names.append(v)
+		for i in range(self.strings):
+			self.lines.append('  char *s%d = %s; // literal %d' % (i, self.string(), i))
+		for _ in range(self.r.randint(2, 6)):
+			k = self.r.random()
+			v = self.r.choice(names)
+			if k < 0.2:
+				self.lines.append('  if (%s) {' % self.expr(names, self.depth // 2))
+				self.lines.append('    %s = %s;' % (v, self.expr(names, self.depth)))
+				self.lines.append('  } else {')
+				self.lines.append('    %s = %s;' % (v, self.expr(names, 2)))
+				self.lines.append('  }')
+			elif k < 0.35:
+				self.lines.append('  %s = %s & 0xff;' % (v, v))
+				self.lines.append('  while (%s < %d) {' % (v, self.r.randint(1, 300)))
+				self.lines.append('    %s = %s + 1;' % (v, v))
+				self.lines.append('  }')
+			else:
+				self.lines.append('  %s = %s;' % (v, self.expr(names, self.depth)))
+		self.lines.append('  return %s;' % self.expr(names, self.depth))
+		self.lines.append('}')
+		self.lines.append('')
+
+	def generate(self):
+		globs = [self.name('g', i) for i in range(self.globals)]
+		funcs = [self.name('f', i) for i in range(self.funcs)]
+		self.comment_block('globals')
+		for g in globs:
+			self.lines.append('int %s;' % g)
+		self.lines.append('')
+		for f in funcs:
+			self.function(f, globs)
+		self.lines.append('int main() {')
+		self.lines.append('  int r = 0;')
+		for i, f in enumerate(funcs):
+			self.lines.append('  r = r + %s(r, %d);' % (f, i))
+		self.lines.append('  return r & 0x7f;')
+		self.lines.append('}')
+		return '\n'.join(self.lines) + '\n'
+
+if __name__ == '__main__':
+	p = argparse.ArgumentParser(description='Generate a synthetic cucu program.')
+	p.add_argument('-f', type=int, default=100, help='number of functions')
+	p.add_argument('-g', type=int, default=100, help='number of globals')
+	p.add_argument('-d', type=int, default=8, help='expression nesting depth')
+	p.add_argument('-c', type=int, default=4, help='lines of comment before each function')
+	p.add_argument('-s', type=int, default=2, help='string literals per function')
+	p.add_argument('-S', type=int, default=1, help='random seed')
+	a = p.parse_args()
+	print(Program(a.f, a.g, a.d, a.c, a.s, a.S).generate(), end='')
@@ -0,0 +1,43 @@
+// Runs a command and reports its wall time and peak RSS.
+//
+// usage: bench-run command [args...]
+//
+// Prints "seconds maxrss_kb" to stderr once the command exited, and exits
+// with its status.  The kernel counts the memory a process had before it
+// called exec in its peak RSS, so the compilers are started from this small
+// process rather than from the benchmark script.
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+int main(int argc, char *argv[]) {
+  struct timespec t0, t1;
+  struct rusage ru;
+  int status;
+  pid_t pid;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s command [args...]\n", argv[0]);
+    return 2;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  pid = fork();
+  if (pid == 0) {
+    execvp(argv[1], argv + 1);
+    perror(argv[1]);
+    _exit(127);
+  }
+  if (pid < 0 || wait4(pid, &status, 0, &ru) < 0) {
+    perror("bench-run");
+    return 2;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  fprintf(stderr, "%.6f %ld\n", (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+      ru.ru_maxrss);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
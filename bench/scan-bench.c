@@ -0,0 +1,112 @@
+// Microbenchmark for the lexer block scanners in scan.c.
+//
+// usage: scan-bench [file.c] [repeat]
+//
+// Splits the corpus into spaces, comments, names and other chars the same
+// way readtok() does, once per scanner implementation, and reports the
+// throughput of each.  Without a file a synthetic corpus of comment banners,
+// indented code and long names is used.
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+
+#include "../scan.c"
+
+static char *corpus(char *path, size_t *len) {
+  size_t n = 0, sz = 1 << 20;
+  char *s = malloc(sz);
+  if (path != NULL) {
+    FILE *f = fopen(path, "rb");
+    size_t k;
+    if (f == NULL) {
+      fprintf(stderr, "Cannot open %s\n", path);
+      exit(1);
+    }
+    while ((k = fread(s + n, 1, sz - n - 1, f)) > 0) {
+      n += k;
+      if (sz - n < 2) {
+        s = realloc(s, sz *= 2);
+      }
+    }
+    fclose(f);
+  } else {
+    int i;
+    sz = 8 << 20;
+    s = realloc(s, sz);
+    for (i = 0; n + 512 < sz; i++) {
+      n += sprintf(s + n,
+          "/*****************************************************************\n"
+          " * function number %d, generated for the scanner benchmark        *\n"
+          " *****************************************************************/\n"
+          "int some_rather_long_function_name_%d(int first_argument) {\n"
+          "        int a_local_variable_with_a_long_name = first_argument;\n"
+          "        // add a constant to the argument\n"
+          "        return a_local_variable_with_a_long_name + %d;\n"
+          "}\n\n", i, i, i);
+    }
+  }
+  s[n] = '\0';
+  *len = n;
+  return s;
+}
+
+/* tokenize like readtok(), returning a checksum of the token boundaries */
+static unsigned long split(char *p) {
+  unsigned long sum = 0;
+  for (;;) {
+    p = scan_space(p);
+    if (p[0] == '/' && p[1] == '*') {
+      p = scan_comment(p + 2);
+      if (*p == '\0') break;
+      p += 2;
+    } else if (p[0] == '/' && p[1] == '/') {
+      p = strchr(p, '\n');
+      if (p == NULL) break;
+    } else if (cclass[(unsigned char) *p] & C_NAME) {
+      p = scan_name(p);
+    } else if (*p == '\0') {
+      break;
+    } else {
+      p++;
+    }
+    sum = sum * 31 + (uintptr_t) p;
+  }
+  return sum;
+}
+
+int main(int argc, char *argv[]) {
+  static char *names[] = {"scalar", "sse2", "avx2"};
+  size_t len;
+  char *src = corpus(argc > 1 ? argv[1] : NULL, &len);
+  int reps = argc > 2 ? atoi(argv[2]) : 20;
+  unsigned long ref = 0;
+  int level;
+
+  printf("corpus: %zu bytes, %d runs\n", len, reps);
+  for (level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+    struct timespec t0, t1;
+    unsigned long sum = 0;
+    double sec;
+    int i;
+    if (scan_init(level) != level) {
+      printf("%-7s not supported\n", names[level]);
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < reps; i++) {
+      sum = split(src);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (level == SCAN_SCALAR) {
+      ref = sum;
+    }
+    printf("%-7s %8.1f MB/s%s\n", names[level], len * (double) reps / sec / 1e6,
+           sum == ref ? "" : "  MISMATCH");
+  }
+  return 0;
+}
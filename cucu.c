@@ -1,222 +1,984 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <setjmp.h>
+#include <time.h>
+#include <pthread.h>
 
-#define MAXTOKSZ 256
+#include "cucu.h"
 
-/* print fatal error message and exit */
+//
+// CONTEXT
+//
+// Everything a compilation changes is kept in a struct cucu_ctx, so that
+// one process can compile any number of units (see cucu_compile()), on as
+// many threads as it has contexts.  The code reaches the fields of the
+// thread's current context through the macros below, by their names.
+// Backends keep their state in thread-local variables, which gen_reset()
+// clears for each unit.
+#define MAXTOKSZ   256
+#define STRHASHSZ  4096  /* number of hash buckets, must be a power of 2 */
+#define SYMHASHSZ  4096  /* number of hash buckets, must be a power of 2 */
+#define MAXSCOPES  256
+#define VNHASHSZ   1024  /* must be a power of 2 */
+
+struct cucu_ctx {
+  /* strings */
+  struct str *strhash[STRHASHSZ];
+  char *strchunks;            /* arena chunks, linked through their first word */
+  char *strarena;             /* free space in the current chunk */
+  size_t strfree;
+  /* symbols */
+  int sympos;
+  int stack_pos;
+  struct sym *symhash[SYMHASHSZ]; /* bucket heads, innermost declaration first */
+  int scope[MAXSCOPES];           /* sympos at the entry of each open scope */
+  int scopepos;
+  /* lexer */
+  char *srcp;                 /* scanner position inside the input */
+  char *srcend;               /* end of the input, a NUL follows */
+  char tok[MAXTOKSZ];         /* current token */
+  int tokkind;                /* kind of the current token (T_xxx or the char itself) */
+  char *tokname;              /* interned current token if it is a name, NULL otherwise */
+  int tokpos;                 /* length of the current token */
+  int linenum;
+  /* parser */
+  int genPreamble;
+  int numPreambleVars;
+  int numGlobalVars;
+  int lastIsReturn;
+  int flagScanGlobalVars;
+  struct sym *currFunction;
+  int brklabel, contlabel;    /* where break and continue go, -1 outside loops */
+  int brkmark, contmark;      /* stack depth they pop back to */
+  int casefirst;              /* first case of the innermost switch, -1 outside */
+  int casescope;              /* symbols declared in the switch from here on */
+  int casemark;               /* stack depth at its cases */
+  int deflabel;               /* default of the innermost switch, -1 if none yet */
+  int ncases;
+  /* backend */
+  int codebase;               /* output offset of code[0] */
+  int codepos;                /* output offset of the end of the code */
+  int codehold;               /* output offset that may still be patched, -1 if none */
+  void (*code_sink)(char *s, size_t len);
+  FILE *out;                  /* assembly and diagnostics */
+  /* intermediate code */
+  int irpos;
+  int nlabels;
+  int nmarks;
+  int njtab;
+  int regsused;               /* registers the current function uses */
+  int peepbar;                /* output offset of the code not final yet */
+  int peeprewrites;           /* number of rewrites applied */
+  int nodepos;
+  int nodebase;               /* nodes below it are held by an enclosing loop */
+  /* optimizer */
+  int blockepoch;             /* current block, tags valid symbol state */
+  int ntouched;
+  int vnhash[VNHASHSZ];
+  int vnepoch[VNHASHSZ];
+  int nivs;
+  /* --stats */
+  struct counters {
+    long tokens;              /* tokens read */
+    long symfinds, symcmps;   /* sym_find() calls and names compared */
+    long symbols;             /* symbols declared */
+    long emits, emitbytes;    /* emit() calls and bytes */
+    long patches;             /* jumps fixed up by gen_patch() */
+    double lex, opt, gen;     /* seconds in readtok(), optimize(), code generation */
+  } counts;
+
+  /* everything from here on is kept from one unit to the next */
+  struct cucu_opts opts;
+  int runjit;                 /* --run: the backend runs the code in memory */
+  jmp_buf onerror;            /* where error() returns to */
+  int guarded;                /* error() returns instead of exiting */
+  FILE *errout;               /* error messages, stderr if NULL */
+  struct sym *syms;           /* MAXSYMBOLS of them */
+  struct node *nodes;         /* MAXNODES of them */
+  char *srcbuf;               /* copy of the source given to cucu_compile() */
+  size_t srcbufsz;
+  char *code;
+  int codesz;                 /* allocated size of code */
+  struct insn *ir;
+  int irsz;
+  struct label *labels;
+  int labelsz;
+  int *marks;                 /* stack depth at each IR_MARK */
+  int marksz;
+  struct swcase *cases;       /* case labels of the open switches */
+  int casesz;
+  int *jtab;                  /* jump tables: length, then the labels */
+  int jtabsz;
+  struct sym **touched;       /* globals seen in the current block */
+  int touchedsz;
+  struct interval *ivs;
+  int ivsz;
+  int *ncalls;                /* calls before each instruction */
+  int *ldepth;                /* loop depth of each instruction */
+  int rasz;
+};
+
+static __thread struct cucu_ctx *ctx; /* the context compiling on this thread */
+
+#define strhash            (ctx->strhash)
+#define strchunks          (ctx->strchunks)
+#define strarena           (ctx->strarena)
+#define strfree            (ctx->strfree)
+#define sympos             (ctx->sympos)
+#define stack_pos          (ctx->stack_pos)
+#define symhash            (ctx->symhash)
+#define scope              (ctx->scope)
+#define scopepos           (ctx->scopepos)
+#define srcp               (ctx->srcp)
+#define srcend             (ctx->srcend)
+#define tok                (ctx->tok)
+#define tokkind            (ctx->tokkind)
+#define tokname            (ctx->tokname)
+#define tokpos             (ctx->tokpos)
+#define linenum            (ctx->linenum)
+#define genPreamble        (ctx->genPreamble)
+#define numPreambleVars    (ctx->numPreambleVars)
+#define numGlobalVars      (ctx->numGlobalVars)
+#define lastIsReturn       (ctx->lastIsReturn)
+#define flagScanGlobalVars (ctx->flagScanGlobalVars)
+#define currFunction       (ctx->currFunction)
+#define brklabel           (ctx->brklabel)
+#define contlabel          (ctx->contlabel)
+#define brkmark            (ctx->brkmark)
+#define contmark           (ctx->contmark)
+#define casefirst          (ctx->casefirst)
+#define casescope          (ctx->casescope)
+#define casemark           (ctx->casemark)
+#define deflabel           (ctx->deflabel)
+#define ncases             (ctx->ncases)
+#define codebase           (ctx->codebase)
+#define codepos            (ctx->codepos)
+#define codehold           (ctx->codehold)
+#define code_sink          (ctx->code_sink)
+#define runjit             (ctx->runjit)
+#define out                (ctx->out)
+#define irpos              (ctx->irpos)
+#define nlabels            (ctx->nlabels)
+#define nmarks             (ctx->nmarks)
+#define njtab              (ctx->njtab)
+#define regsused           (ctx->regsused)
+#define peepbar            (ctx->peepbar)
+#define peeprewrites       (ctx->peeprewrites)
+#define nodepos            (ctx->nodepos)
+#define nodebase           (ctx->nodebase)
+#define blockepoch         (ctx->blockepoch)
+#define ntouched           (ctx->ntouched)
+#define vnhash             (ctx->vnhash)
+#define vnepoch            (ctx->vnepoch)
+#define nivs               (ctx->nivs)
+#define counts             (ctx->counts)
+#define optlevel           (ctx->opts.optimize) /* -O level */
+#define _debug             (ctx->opts.debug)
+#define _trace             (ctx->opts.trace)
+#define _stats             (ctx->opts.stats)
+#define objpath            (ctx->opts.object)   /* -c: object file written by the backend */
+#define syms               (ctx->syms)
+#define srcbuf             (ctx->srcbuf)
+#define srcbufsz           (ctx->srcbufsz)
+#define nodes              (ctx->nodes)
+#define code               (ctx->code)
+#define codesz             (ctx->codesz)
+#define ir                 (ctx->ir)
+#define irsz               (ctx->irsz)
+#define labels             (ctx->labels)
+#define labelsz            (ctx->labelsz)
+#define marks              (ctx->marks)
+#define marksz             (ctx->marksz)
+#define cases              (ctx->cases)
+#define casesz             (ctx->casesz)
+#define jtab               (ctx->jtab)
+#define jtabsz             (ctx->jtabsz)
+#define touched            (ctx->touched)
+#define touchedsz          (ctx->touchedsz)
+#define ivs                (ctx->ivs)
+#define ivsz               (ctx->ivsz)
+#define ncalls             (ctx->ncalls)
+#define ldepth             (ctx->ldepth)
+#define rasz               (ctx->rasz)
+
+/* print fatal error message and give up the unit */
 static void error(const char *fmt, ...) {
   va_list args;
   va_start(args, fmt);
-  vfprintf(stderr, fmt, args);
+  vfprintf((ctx != NULL && ctx->errout != NULL) ? ctx->errout : stderr, fmt, args);
   va_end(args);
+  if (ctx != NULL && ctx->guarded) {
+    longjmp(ctx->onerror, 1);
+  }
   exit(1);
 }
 
+/* diagnostics of the parser, written along with the code with --trace */
+static void trace(const char *fmt, ...) {
+  va_list args;
+  if (!_trace) {
+    return;
+  }
+  va_start(args, fmt);
+  vfprintf(out, fmt, args);
+  va_end(args);
+}
+
+/* wall clock in seconds, for --stats */
+static double stats_clock() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* seconds since *t, which moves to now; 0 without --stats */
+static double stats_lap(double *t) {
+  double now, d;
+  if (!_stats) {
+    return 0;
+  }
+  now = stats_clock();
+  d = now - *t;
+  *t = now;
+  return d;
+}
+
+//
+// TOKENS
+//
+// Single-char tokens are their own character code, 0 is the end of input.
+enum {
+  T_EOF = 0,
+  T_NAME = 256, T_NUMBER, T_STRING, T_CHARLIT,
+  /* keywords */
+  T_INT, T_CHAR, T_VOID, T_IF, T_ELSE, T_WHILE, T_RETURN, T_FOR, T_DO,
+  T_BREAK, T_CONTINUE, T_SWITCH, T_CASE, T_DEFAULT,
+  /* multi-char operators */
+  T_SHL, T_SHR, T_EQ, T_NE, T_LE, T_GE, T_LAND, T_LOR,
+  /* operators only strength reduction makes: arithmetic >> and the high
+     word of a product */
+  T_SAR, T_MULHI
+};
+
+static struct {
+  char *s;
+  int  kind;
+} keywords[] = {
+  {"int", T_INT}, {"char", T_CHAR}, {"void", T_VOID}, {"if", T_IF},
+  {"else", T_ELSE}, {"while", T_WHILE}, {"return", T_RETURN}, {"for", T_FOR},
+  {"do", T_DO}, {"break", T_BREAK}, {"continue", T_CONTINUE}, {"switch", T_SWITCH},
+  {"case", T_CASE}, {"default", T_DEFAULT}, {NULL, 0}
+}, operators[] = {
+  {"<<", T_SHL}, {">>", T_SHR}, {"==", T_EQ}, {"!=", T_NE},
+  {"<=", T_LE}, {">=", T_GE}, {"&&", T_LAND}, {"||", T_LOR}, {NULL, 0}
+};
+
+//
+// STRINGS
+//
+// Identifiers are interned into an arena: every distinct name is stored
+// once and can be compared by pointer.
+#define STRCHUNKSZ 65536 /* arena chunk size */
+struct str {
+  struct str *next;  /* next string in the same hash bucket */
+  unsigned hash;
+  int  kind;         /* token kind: T_NAME or the keyword */
+  char s[];
+};
+
+static unsigned str_hashof(char *s, size_t len) {
+  unsigned h = 2166136261u; /* FNV-1a */
+  while (len--) {
+    h = (h ^ (unsigned char) *s++) * 16777619u;
+  }
+  return h;
+}
+
+/* hash of an interned string, computed once when it was interned */
+static unsigned str_hash(char *s) {
+  return ((struct str *) (s - offsetof(struct str, s)))->hash;
+}
+
+/* token kind of an interned string */
+static int str_kind(char *s) {
+  return ((struct str *) (s - offsetof(struct str, s)))->kind;
+}
+
+/* allocate sz bytes from the arena, they are freed with the unit */
+static void *str_alloc(size_t sz) {
+  void *p;
+  sz = (sz + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  if (sz > strfree) {
+    char *chunk = malloc(STRCHUNKSZ);
+    if (chunk == NULL) {
+      error("Out of memory\n");
+    }
+    *(char **) chunk = strchunks;
+    strchunks = chunk;
+    strarena = chunk + sizeof(char *);
+    strfree = STRCHUNKSZ - sizeof(char *);
+  }
+  p = strarena;
+  strarena += sz;
+  strfree -= sz;
+  return p;
+}
+
+/* return the unique copy of s[0..len) */
+static char *intern(char *s, size_t len) {
+  unsigned h = str_hashof(s, len);
+  struct str **bucket = &strhash[h & (STRHASHSZ - 1)];
+  struct str *p;
+
+  for (p = *bucket; p != NULL; p = p->next) {
+    if (p->hash == h && strncmp(p->s, s, len) == 0 && p->s[len] == '\0') {
+      return p->s;
+    }
+  }
+  p = str_alloc(offsetof(struct str, s) + len + 1);
+  p->hash = h;
+  p->kind = T_NAME;
+  memcpy(p->s, s, len);
+  p->s[len] = '\0';
+  p->next = *bucket;
+  *bucket = p;
+  return p->s;
+}
+
 //
 // SYMBOLS
 //
 #define MAXSYMBOLS 4096
-static struct sym {
+struct sym {
   char type;
   int  addr;
-  char name[MAXTOKSZ];
+  char *name;        /* interned */
   int  nParams;
-} sym[MAXSYMBOLS];
-
-static int sympos = 0;
-int stack_pos = 0;
-
+  int  depth;        /* scope depth the symbol was declared at, -1 once closed */
+  struct sym *next;  /* next symbol in the same hash bucket */
+  /* optimizer state, valid in the basic block tagged by epoch */
+  int  epoch;
+  int  ver;          /* bumped whenever the variable may change */
+  int  known;        /* KNOWN_xxx value the variable holds, 0 if unknown */
+  int  kval;
+  struct sym *ksym;
+  int  kver;
+  int  kill, read;   /* dead store elimination: next store / next read */
+  int  reg;          /* register holding the local, -1 if in memory */
+};
 
 //
 // LEXER
 //
-static FILE *f;            /* input source file */
-static char tok[MAXTOKSZ]; /* current token */
-static int tokpos;         /* offset inside the current token */
-static int nextc;          /* next char to be pushed into token */
-static int linenum = 1;
-static int _debug = 0;
-static char context[MAXTOKSZ];
-static int genPreamble = 0;
-static int numPreambleVars = 0;
-static int numGlobalVars = 0;
-static int lastIsReturn = 0;
-static int flagScanGlobalVars = 1;
-static struct sym *currFunction = NULL;
-
-/* read next char */
-void readchr() {
-  if (tokpos == MAXTOKSZ - 1) {
-    tok[tokpos] = '\0';
-    error("[line %d] Token too long: %s\n", linenum, tok);
-  }
-  tok[tokpos++] = nextc;
-  nextc = fgetc(f);
-  if ('\n'==nextc) {linenum++;}
+#include "scan.c"
+
+#ifndef CUCU_LIB
+/* read the whole input into memory (mapped if possible) */
+static void src_open(char *path) {
+  size_t n = 0, sz = 0;
+  char *text;
+  FILE *in = stdin;
+
+  if (path != NULL) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    long pagesz = sysconf(_SC_PAGESIZE);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      error("Cannot open %s\n", path);
+    }
+    // a mapping is zero-filled up to the page end, which gives us the
+    // terminating NUL for free unless the file fills its last page
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size % pagesz != 0) {
+      text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (text != MAP_FAILED) {
+        close(fd);
+        srcp = text;
+        srcend = text + st.st_size;
+        return;
+      }
+    }
+    close(fd);
+    in = fopen(path, "rb");
+    if (in == NULL) {
+      error("Cannot open %s\n", path);
+    }
+  }
+  text = NULL;
+  for (;;) {
+    if (sz - n < 2) {
+      sz = sz ? sz * 2 : 65536;
+      text = realloc(text, sz);
+      if (text == NULL) {
+        error("Out of memory\n");
+      }
+    }
+    size_t k = fread(text + n, 1, sz - n - 1, in);
+    if (k == 0) {
+      break;
+    }
+    n += k;
+  }
+  if (in != stdin) {
+    fclose(in);
+  }
+  text[n] = '\0';
+  srcp = text;
+  srcend = text + n;
 }
+#endif
 
-/* read single token */
-void readtok() {
+/* move the scanner to p, counting the lines passed */
+static void src_skip(char *p) {
+  char *nl = srcp;
+  while ((nl = memchr(nl, '\n', p - nl)) != NULL) {
+    linenum++;
+    nl++;
+  }
+  srcp = p;
+}
+
+/* kind of the two-char operator p starts with, 0 if none */
+static int op_kind(char *p) {
+  int i;
+  for (i = 0; operators[i].s != NULL; i++) {
+    if (p[0] == operators[i].s[0] && p[1] == operators[i].s[1]) {
+      return operators[i].kind;
+    }
+  }
+  return 0;
+}
+
+/* scan the next token */
+static void lex_token() {
+  char *p;
   for (;;) {
     /* skip spaces */
-    while (isspace(nextc)) {
-      nextc = fgetc(f);
-      if ('\n'==nextc) {linenum++;}
-    }
-    /* try to read a literal token */
-    tokpos = 0;
-    while (isalnum(nextc) || nextc == '_') {
-      readchr();
-    }
-    /* if it's not a literal token */
-    if (tokpos == 0) {
-      while (nextc == '<' || nextc == '=' || nextc == '>' || nextc == '!' || nextc == '&' || nextc == '|') {
-        readchr();
-      }
-    }
-    /* if it's not special chars that looks like an operator */
-    if (tokpos == 0) {
-      /* try strings and chars inside quotes */
-      if (nextc == '\'' || nextc == '"') {
-        char c = nextc;
-        readchr();
-        while (nextc != c) {
-          readchr();
-        }
-        readchr();
-      } else if (nextc == '/') { // skip comments
-        readchr();
-        if (nextc == '*') {      // support comments of the form '/**/'
-          nextc = fgetc(f);
-          if ('\n'==nextc) {linenum++;}
-          while (nextc != '/') {
-            while (nextc != '*') {
-              nextc = fgetc(f);
-              if ('\n'==nextc) {linenum++;}
-            }
-            nextc = fgetc(f);
-            if ('\n'==nextc) {linenum++;}
-          }
-          nextc = fgetc(f);
-          if ('\n'==nextc) {linenum++;}
-          continue;
-        } else if (nextc == '/') { // support comments of the form '//'
-          while (nextc != '\n') {
-            nextc = fgetc(f);
-            if ('\n'==nextc) {linenum++;}
-          }
-          nextc = fgetc(f);
-          if ('\n'==nextc) {linenum++;}
-          continue;
-        }
-      } else if (nextc != EOF) {
-        /* otherwise it looks like a single-char symbol, like '+', '-' etc */
-        readchr();
+    p = scan_space(srcp);
+    src_skip(p);
+    if (p[0] == '/' && p[1] == '*') {        // support comments of the form '/**/'
+      p = scan_comment(p + 2);
+      if (*p == '\0') {
+        error("[line %d] Unterminated comment\n", linenum);
       }
+      src_skip(p + 2);
+      continue;
+    } else if (p[0] == '/' && p[1] == '/') { // support comments of the form '//'
+      p = memchr(p, '\n', srcend - p);
+      src_skip(p ? p : srcend);
+      continue;
     }
     break;
   }
+  if (cclass[(unsigned char) *p] & C_NAME) {
+    /* a literal token */
+    p = scan_name(p);
+  } else if (cclass[(unsigned char) *p] & C_OP) {
+    /* special chars that look like an operator, "a&&!b" is "a", "&&", "!", "b" */
+    p += (op_kind(p) != 0) ? 2 : 1;
+  } else if (*p == '\'' || *p == '"') {
+    /* strings and chars inside quotes */
+    p = memchr(p + 1, *p, srcend - p - 1);
+    if (p == NULL) {
+      error("[line %d] Unterminated string\n", linenum);
+    }
+    p++;
+  } else if (p < srcend) {
+    /* otherwise it looks like a single-char symbol, like '+', '-' etc */
+    p++;
+  }
+  tokpos = p - srcp;
+  if (tokpos >= MAXTOKSZ) {
+    error("[line %d] Token too long: %.*s\n", linenum, MAXTOKSZ, srcp);
+  }
+  memcpy(tok, srcp, tokpos);
+  src_skip(p);
   tok[tokpos] = '\0';
+  tokname = NULL;
+  if (tokpos == 0) {
+    tokkind = T_EOF;
+  } else if (isalpha(tok[0]) || tok[0] == '_') {
+    char *s = intern(tok, tokpos);
+    tokkind = str_kind(s); // keywords are interned with their kind
+    if (tokkind == T_NAME) {
+      tokname = s;
+    }
+  } else if (isdigit(tok[0])) {
+    tokkind = T_NUMBER;
+  } else if (tok[0] == '"') {
+    tokkind = T_STRING;
+  } else if (tok[0] == '\'') {
+    tokkind = T_CHARLIT;
+  } else if (tokpos == 1) {
+    tokkind = tok[0];
+  } else {
+    tokkind = op_kind(tok);
+  }
   if (_debug)  {
-    printf("TOKEN: %s\n",tok);
+    fprintf(out, "TOKEN: %s\n",tok);
   }
 }
 
-/* check if the current token machtes the string */
-int peek(char *s) {
-  return (strcmp(tok, s) == 0);
+/* read single token */
+static void readtok() {
+  double t = 0;
+  counts.tokens++;
+  stats_lap(&t);
+  lex_token();
+  counts.lex += stats_lap(&t);
+}
+
+/* register keywords, so that interning a name also classifies it */
+static void lex_init() {
+  int i;
+  for (i = 0; keywords[i].s != NULL; i++) {
+    char *s = intern(keywords[i].s, strlen(keywords[i].s));
+    ((struct str *) (s - offsetof(struct str, s)))->kind = keywords[i].kind;
+  }
+}
+
+/* printable form of a token kind, for error messages */
+static char *tokstr(int kind) {
+  static __thread char c[2];
+  int i;
+  for (i = 0; keywords[i].s != NULL; i++) {
+    if (keywords[i].kind == kind) return keywords[i].s;
+  }
+  for (i = 0; operators[i].s != NULL; i++) {
+    if (operators[i].kind == kind) return operators[i].s;
+  }
+  c[0] = kind;
+  return c;
+}
+
+/* check if the current token is of the given kind */
+static int peek(int kind) {
+  return (tokkind == kind);
 }
 
-/* read the next token if the current token machtes the string */
-int accept(char *s) {
-  if (peek(s)) {
+/* read the next token if the current token is of the given kind */
+static int accept(int kind) {
+  if (peek(kind)) {
     readtok();
     return 1;
   }
   return 0;
 }
 
-/* throw fatal error if the current token doesn't match the string */
-void expect(int srclinenum, char *s) {
-  if (accept(s) == 0) {
+/* throw fatal error if the current token is not of the given kind */
+static void expect(int srclinenum, int kind) {
+  if (accept(kind) == 0) {
     if (_debug) {
-      error("[line %d ; srcline %d] Error: expected '%s', but found: %s\n", linenum, srclinenum, s, tok);
+      error("[line %d ; srcline %d] Error: expected '%s', but found: %s\n", linenum, srclinenum, tokstr(kind), tok);
     } else {
-      error("[line %d] Error: expected '%s', but found: %s\n", linenum, s, tok);
+      error("[line %d] Error: expected '%s', but found: %s\n", linenum, tokstr(kind), tok);
     }
   }
 }
 
+static unsigned sym_hash(char *name) {
+  return str_hash(name) & (SYMHASHSZ - 1);
+}
+
+// find the innermost visible symbol with the given (interned) name
 static struct sym *sym_find(char *s) {
+  struct sym *symbol;
+
+  counts.symfinds++;
+  for (symbol = symhash[sym_hash(s)]; symbol != NULL; symbol = symbol->next) {
+    counts.symcmps++;
+    if (symbol->name == s) {
+      return symbol;
+    }
+  }
+  return NULL;
+}
+
+// open a new scope (function parameters, block)
+static void scope_push() {
+  if (scopepos == MAXSCOPES) {
+    error("[line %d] Scopes nested too deeply\n",linenum);
+  }
+  scope[scopepos++] = sympos;
+}
+
+// close the innermost scope: its symbols can no longer be found, but
+// their slots stay allocated while the function's code refers to them
+static void scope_pop() {
+  int start = scope[--scopepos];
   int i;
-  struct sym *symbol = NULL;
-  
-  for (i = 0; i < sympos; i++) {
-    if (strcmp(sym[i].name, s) == 0) {
-      symbol = &sym[i];
+  for (i = sympos - 1; i >= start; i--) {
+    struct sym *s = &syms[i];
+    if (s->depth > scopepos) {
+      // unlinked in reverse order, so each one is its bucket head
+      symhash[sym_hash(s->name)] = s->next;
+      s->depth = -1;
     }
   }
-  return symbol;
+  if (scopepos == 0) {
+    sympos = start; // back at file scope, the function is done
+  }
 }
 
-// ctx:  context
-// name: symbol name
+// name: symbol name (interned)
 // type: symbol type
 //       L - local symbol
 //       F - function
 //       G - global
 //       U - undefined
 // addr: symbol address
-static struct sym *sym_declare(char *ctx, char *name, char type, int addr) {
-  char sName[MAXTOKSZ];
-  int  ii;
-
-  strcpy(sName,ctx);
-  strcat(sName,"_");
-  strcat(sName,name);
+static struct sym *sym_declare(char *name, char type, int addr) {
+  unsigned h;
+  struct sym *s;
+  int depth = (scopepos == 2) ? 1 : scopepos; // parameters share the body's scope
 
-  for (ii=0; ii<sympos; ii++) {
-    if (0==strcmp(sym[ii].name,sName)) {
+  if (name == NULL) {
+    error("[line %d] Error: name expected, but found: %s\n",linenum,tok);
+  }
+  h = sym_hash(name);
+  for (s = symhash[h]; s != NULL && s->depth >= depth; s = s->next) {
+    if (s->name == name) {
       error("[line %d] variable redefined '%s'\n",linenum,name);
     }
   }
 
-  strncpy(sym[sympos].name, sName, MAXTOKSZ);
-  sym[sympos].addr = addr;
-  sym[sympos].type = type;
-  sympos++;
-  if (sympos > MAXSYMBOLS) {
+  if (sympos == MAXSYMBOLS) {
     error("[line %d] Too many symbols\n",linenum);
   }
-  return &sym[sympos-1];
+  counts.symbols++;
+  s = &syms[sympos++];
+  s->name = name;
+  s->addr = addr;
+  s->type = type;
+  s->nParams = 0;
+  s->depth = scopepos;
+  s->epoch = 0;
+  s->ver = 0;
+  s->reg = -1;
+  s->next = symhash[h];
+  symhash[h] = s;
+  return s;
 }
 
 /*
  * BACKEND
  */
-#define MAXCODESZ 4096
-static char code[MAXCODESZ];
-static int codepos = 0;
-
+// Generated code is kept in a growable buffer that only holds the part
+// not written out yet: code[0] is at output offset codebase, codepos is
+// the output offset of the end.  Code before codehold can no longer be
+// patched and is flushed to the output once a function is complete, or
+// handed to the backend's code_sink if it consumes the code itself.
+#define CODECHUNKSZ 4096
 static void emit(void *buf, size_t len) {
-  memcpy(code + codepos, buf, len);
+  counts.emits++;
+  counts.emitbytes += len;
+  if (codepos - codebase + len > (size_t) codesz) {
+    while (codepos - codebase + len > (size_t) codesz) {
+      codesz += CODECHUNKSZ;
+    }
+    code = realloc(code, codesz);
+    if (code == NULL) {
+      error("Out of memory\n");
+    }
+  }
+  memcpy(code + codepos - codebase, buf, len);
   codepos += len;
 }
 
+/* pointer to the code at output offset pos, which must not be flushed yet */
+static char *code_at(int pos) {
+  if (pos < codebase || pos > codepos) {
+    error("Code at 0x%04x was already flushed\n", pos);
+  }
+  return code + pos - codebase;
+}
+
+/* write out all the code before the hold mark */
+static void code_flush() {
+  int end = (codehold < 0) ? codepos : codehold;
+  if (end > codebase) {
+    if (code_sink != NULL) {
+      code_sink(code, end - codebase);
+    } else {
+      fwrite(code, 1, end - codebase, out);
+    }
+    memmove(code, code + end - codebase, codepos - end);
+    codebase = end;
+  }
+}
+
 #define TYPE_NUM     0
 #define TYPE_CHARVAR 1
 #define TYPE_INTVAR  2
 
+//
+// INTERMEDIATE CODE
+//
+// A function body is translated into a linear list of instructions before
+// any code is generated.  An instruction computes at most one value, named
+// by its index in the list, from the values of earlier instructions
+// (three-address code in triple form).  Each value is used at most once,
+// so the expressions of a statement still form trees that are lowered in
+// their original evaluation order, onto the stack or into registers.  Jumps,
+// labels and stack bookkeeping are instructions too, which lets the
+// optimizer look across the statements of a basic block.
+#define IR_NOP       0  /* deleted */
+#define IR_CONST     1  /* k */
+#define IR_ADDR      2  /* address of sym */
+#define IR_STR       3  /* address of str[0..k] */
+#define IR_LOADVAR   4  /* sym */
+#define IR_STOREVAR  5  /* sym = a */
+#define IR_LOAD      6  /* *a, k is the TYPE_xxx read */
+#define IR_STORE     7  /* *a = b, k is the TYPE_xxx written */
+#define IR_BIN       8  /* a k b, k is the operator token kind */
+#define IR_CALL      9  /* a(b, b->next, ...) */
+#define IR_COPY     10  /* a */
+#define IR_PUSH     11  /* new local sym, initialized to a if a >= 0 */
+#define IR_JZ       12  /* goto label k if a is zero */
+#define IR_JMP      13  /* goto label k */
+#define IR_LABEL    14  /* label k, a is 1 for loop heads, 2 for switch cases */
+#define IR_RET      15  /* return a if a >= 0, k is the number of frame vars */
+#define IR_MARK     16  /* remember the stack depth as mark k */
+#define IR_RESTORE  17  /* pop back to mark k, sym[a..b) go out of scope */
+#define IR_SETSP    18  /* continue at the stack depth of mark k */
+#define IR_PREAMBLE 19  /* function preamble for k frame vars */
+#define IR_JNZ      20  /* goto label k if a is not zero */
+#define IR_TEST     21  /* goto label k with the value b if a is zero (b = 0) or not (b = 1) */
+#define IR_JOIN     22  /* label k: b != 0, or the value of the IR_TEST a if it jumped */
+#define IR_JTAB     23  /* goto label jtab[k + 1 + a], a < jtab[k] */
+
+static char *irnames[] = {
+  "nop", "const", "addr", "str", "loadvar", "storevar", "load", "store",
+  "bin", "call", "copy", "push", "jz", "jmp", "label", "ret", "mark",
+  "restore", "setsp", "preamble", "jnz", "test", "join", "jtab"
+};
+
+struct insn {
+  int op;
+  int a, b;          /* operands, -1 if unused */
+  int k;
+  int root;          /* evaluated as a statement, not as an operand */
+  struct sym *sym;
+  char *str;
+  int next;          /* next call argument, next jump to the same label */
+  int pos;           /* jumps: code offset to patch */
+  /* optimizer */
+  int ver;           /* loadvar: version of sym read */
+  int vn;            /* first value of the block known to be equal, -1 if none */
+  int chain;         /* next value in the same hash bucket */
+  struct sym *avail; /* variable holding this value... */
+  int availver;      /* ...as long as it has this version */
+  /* register allocation */
+  int user;          /* instruction using the value, -1 if none */
+  int loc;           /* LOC_xxx */
+  int reg;           /* LOC_REG: register number */
+  int spill;         /* LOC_STACK: stack depth once pushed */
+  int live;          /* registers holding other values across this instruction */
+};
+
+struct label {
+  int pos;           /* code offset, -1 until placed */
+  int jumps;         /* jumps waiting to be patched */
+};
+
+struct swcase {
+  int val;
+  int label;
+};
+
+/* where a value is kept by backends lowering into registers */
+#define LOC_NONE  0  /* nowhere, the value is not used */
+#define LOC_REG   1  /* in register reg */
+#define LOC_STACK 2  /* pushed when computed, popped by its user */
+#define LOC_IMM   3  /* an immediate: const, addr or str */
+#define LOC_VAR   4  /* read by its user straight from the variable */
+#define LOC_ALIAS 5  /* the same as value a */
+#define LOC_FLAGS 6  /* a comparison only tested by the jump that follows */
+
+
+/* make sure the array p of *sz elements of elsz bytes can hold n */
+static void *grow(void *p, int *sz, int n, size_t elsz) {
+  if (n > *sz) {
+    while (n > *sz) {
+      *sz = (*sz > 0) ? *sz * 2 : 256;
+    }
+    p = realloc(p, *sz * elsz);
+    if (p == NULL) {
+      error("Out of memory\n");
+    }
+  }
+  return p;
+}
+
+static int ir_emit(int op, int a, int b, int k) {
+  struct insn *i;
+  ir = grow(ir, &irsz, irpos + 1, sizeof(*ir));
+  i = &ir[irpos];
+  memset(i, 0, sizeof(*i));
+  i->op = op;
+  i->a = a;
+  i->b = b;
+  i->k = k;
+  i->next = -1;
+  i->vn = -1;
+  return irpos++;
+}
+
+static int ir_sym(int op, struct sym *s, int a) {
+  int t = ir_emit(op, a, -1, 0);
+  ir[t].sym = s;
+  return t;
+}
+
+static int new_label() {
+  labels = grow(labels, &labelsz, nlabels + 1, sizeof(*labels));
+  labels[nlabels].pos = -1;
+  labels[nlabels].jumps = -1;
+  return nlabels++;
+}
+
+static int new_mark() {
+  marks = grow(marks, &marksz, nmarks + 1, sizeof(*marks));
+  ir_emit(IR_MARK, -1, -1, nmarks);
+  return nmarks++;
+}
+
+static void ir_dump() {
+  int t;
+  for (t = 0; t < irpos; t++) {
+    struct insn *i = &ir[t];
+    if (i->op != IR_NOP) {
+      fprintf(out, "IR: %c%-4d %-8s %4d %4d %6d %s\n", i->root ? '*' : ' ', t, irnames[i->op],
+             i->a, i->b, i->k, i->sym ? i->sym->name : "");
+    }
+  }
+}
+
+/* true if the value t is always 0 or 1 */
+static int ir_bool(int t) {
+  struct insn *i = &ir[t];
+  return i->op == IR_JOIN || (i->op == IR_BIN && (i->k == '<' || i->k == T_LE ||
+                                                 i->k == T_EQ || i->k == T_NE));
+}
+
+/* a peephole rule: code lines to look for and what to put instead;
+   \1..\9 stand for an operand (letters, digits, '_' and '.'), and
+   the replacement must be shorter than the code it replaces */
+struct rewrite {
+  char *match;
+  char *replace;
+};
+
+/* what the backend's operations cost, for strength reduction; an
+   operation it lacks costs 0 */
+struct cost {
+  int add;    /* +, -, logic, comparisons and reading a variable */
+  int shift;  /* << and >> */
+  int sar;    /* T_SAR */
+  int mul;
+  int mulhi;  /* T_MULHI, of 32-bit words */
+  int div;    /* / and % */
+};
+
 #ifndef GEN
 #error "A code generator (backend) must be provided (use -DGEN=...)"
 #else
 #include GEN
 #endif
 
+//
+// PEEPHOLE
+//
+// Straight-line code is rewritten with the backend's gen_peephole[] table
+// once it is complete.  Lowering calls code_barrier() before it records a
+// code offset (jumps, labels), so the offsets never move.
+static int is_operand(char c) {
+  return isalnum((unsigned char) c) || c == '_' || c == '.';
+}
+
+/* length of the code at s matching the rule pattern p, 0 if it doesn't */
+static int peep_match(char *p, char *s, char *end, char *arg[], int arglen[]) {
+  char *start = s;
+  while (*p) {
+    if (*p < 10) {
+      int n = *p++;
+      arg[n] = s;
+      while (s < end && is_operand(*s)) s++;
+      arglen[n] = s - arg[n];
+      if (arglen[n] == 0) {
+        return 0;
+      }
+    } else if (s < end && *s == *p) {
+      s++;
+      p++;
+    } else {
+      return 0;
+    }
+  }
+  return s - start;
+}
+
+static void peephole() {
+  char *arg[10], *p, *s, *w, *end;
+  int arglen[10], len, changed;
+  char buf[256];
+  struct rewrite *r;
+
+  do {
+    changed = 0;
+    s = w = code_at(peepbar);
+    end = code_at(codepos);
+    while (s < end) {
+      for (r = gen_peephole; r->match != NULL; r++) {
+        len = peep_match(r->match, s, end, arg, arglen);
+        if (len > 0 && len < (int) sizeof(buf)) {
+          break;
+        }
+      }
+      if (r->match != NULL) {
+        char *b = buf;
+        for (p = r->replace; *p; p++) {
+          if (*p < 10) {
+            memcpy(b, arg[(int) *p], arglen[(int) *p]);
+            b += arglen[(int) *p];
+          } else {
+            *b++ = *p;
+          }
+        }
+        memmove(w, buf, b - buf);
+        w += b - buf;
+        s += len;
+        peeprewrites++;
+        changed = 1;
+      } else {
+        // keep the line as it is
+        do {
+          *w++ = *s;
+        } while (*s++ != '\n' && s < end);
+      }
+    }
+    codepos = peepbar + (w - code_at(peepbar));
+  } while (changed);
+}
+
+/* the code emitted so far is final: optimize it and stop rewriting there */
+static void code_barrier() {
+  if (optlevel > 0 && codepos > peepbar) {
+    peephole();
+  }
+  peepbar = codepos;
+}
+
 /*
  * PARSER AND COMPILER
  */
@@ -228,12 +990,12 @@ static int expr();
 //   void is skipped (as if nothing was there)
 //   NOTE: void * is not supported
 static int typename() {
-  if (peek("int") || peek("char") ) {
+  if (peek(T_INT) || peek(T_CHAR) ) {
     readtok();
-    while (accept("*"));
+    while (accept('*'));
     return 1;
   }
-  if (peek("void") ) {  // skip 'void' token
+  if (peek(T_VOID) ) {  // skip 'void' token
     readtok();
   }
   return 0;
@@ -261,295 +1023,1902 @@ static int parse_immediate_value() {
   }
 }
 
-static int prim_expr() {
-  int type = TYPE_NUM;
-  if (isdigit(tok[0])) {
-    int n = parse_immediate_value();
-    gen_const(n);
-  } else if (isalpha(tok[0])) {
-    char symName[MAXTOKSZ];
-    struct sym *s;
+//
+// EXPRESSIONS
+//
+// Expressions are parsed into a small tree first.  Constant subtrees are
+// folded and trivial operations simplified before the tree is translated
+// to intermediate code, so only what is left to compute gets generated.
+#define MAXNODES   1024
 
-    strcpy(symName,context);
-    strcat(symName,"_");
-    strcat(symName,tok);
-    s = sym_find(symName);  // find symbol in local context..
-    if (s==NULL) {
-      strcpy(symName,"_");
-      strcat(symName,tok);
-      s = sym_find(symName);  // find symbol in global context..
-      if (s == NULL) {
-        // symbol not found... this is an error...
-        error("[line %d] Undeclared symbol: %s\n", linenum,tok);
-      }
-    }
-    printf("SYM: %s\n",symName);
-    if (s->type == 'L') {
-      // Local Symbol
-      gen_stack_addr(stack_pos - s->addr - 1);
-    } else {
-      // Other Symbols (Global)
-      gen_sym_addr(s);
+#define N_NUM    0  /* val */
+#define N_VAR    1  /* sym, evaluates to the variable address */
+#define N_STR    2  /* str[0..val] */
+#define N_BINOP  3  /* l op r */
+#define N_INDEX  4  /* l[r], evaluates to the char address */
+#define N_CALL   5  /* l(r, r->next, ...) */
+#define N_ASSIGN 6  /* l = r */
+#define N_LOGIC  7  /* l op r, op is T_LAND or T_LOR; r is only evaluated if needed */
+
+struct node {
+  int kind;
+  int op;              /* N_BINOP: operator token kind */
+  int val;
+  int type;            /* TYPE_xxx left in the primary register */
+  struct sym *sym;
+  char *str;
+  struct node *l, *r;
+  struct node *next;   /* next call argument */
+};
+
+static struct node *parse_expr();
+
+static struct node *node(int kind, int type, struct node *l, struct node *r) {
+  struct node *n;
+  if (nodepos == MAXNODES) {
+    error("[line %d] Expression too complex\n", linenum);
+  }
+  n = &nodes[nodepos++];
+  memset(n, 0, sizeof(*n));
+  n->kind = kind;
+  n->type = type;
+  n->l = l;
+  n->r = r;
+  return n;
+}
+
+/* x as a word of the backend holds it */
+static long long wrap(long long x) {
+  int bits = TYPE_NUM_SIZE * 8;
+  if (bits < 64) {
+    x &= (1LL << bits) - 1;
+#ifndef GEN_UNSIGNED
+    if (x >> (bits - 1)) {
+      x -= 1LL << bits;
     }
-    type = TYPE_INTVAR;
-  } else if (accept("(")) {
-    type = expr();
-    expect(__LINE__,")");
-  } else if (tok[0] == '"') {
+#endif
+  }
+  return x;
+}
+
+static struct node *num_node(int val) {
+  struct node *n = node(N_NUM, TYPE_NUM, NULL, NULL);
+  n->val = wrap(val);
+  return n;
+}
+
+static struct node *prim_expr() {
+  struct node *n;
+  if (peek(T_NUMBER)) {
+    n = num_node(parse_immediate_value());
+  } else if (peek(T_NAME)) {
+    struct sym *s = sym_find(tokname);  // innermost scope first, globals last
+    if (s == NULL) {
+      // symbol not found... this is an error...
+      error("[line %d] Undeclared symbol: %s\n", linenum,tok);
+    }
+    trace("SYM: %s\n",tok);
+    n = node(N_VAR, TYPE_INTVAR, NULL, NULL);
+    n->sym = s;
+  } else if (accept('(')) {
+    n = parse_expr();
+    expect(__LINE__,')');
+    return n;
+  } else if (peek(T_STRING)) {
     int i, j;
+    char *str = str_alloc(tokpos + 1); // kept until the function is lowered
     i = 0; j = 1;
     while (tok[j] != '"') {
       if (tok[j] == '\\' && tok[j+1] == 'x') {
         char s[3] = {tok[j+2], tok[j+3], 0};
         uint8_t n = strtol(s, NULL, 16);
-        tok[i++] = n;
+        str[i++] = n;
         j += 4;
       } else {
-        tok[i++] = tok[j++];
+        str[i++] = tok[j++];
       }
     }
-    tok[i] = 0;
+    str[i] = 0;
     if (i % 2 == 0) {
       i++;
-      tok[i] = 0;
+      str[i] = 0;
     }
-    gen_array(tok, i);
-    type = TYPE_NUM;
+    n = node(N_STR, TYPE_NUM, NULL, NULL);
+    n->str = str;
+    n->val = i;
   } else {
     error("[line %d] Unexpected primary expression: %s\n", linenum,tok);
   }
   readtok();
-  return type;
+  return n;
 }
 
-static int binary(int type, int (*f)(), char *buf, size_t len) {
-  if (type != TYPE_NUM) {
-    gen_unref(type);
-  }
-  gen_push();
-  type = f();
-  if (type != TYPE_NUM) {
-    gen_unref(type);
-  }
-  emit(buf, len);
-  stack_pos = stack_pos - 1; /* assume that buffer contains a "pop" */
-  return TYPE_NUM;
+static struct node *binary(int op, struct node *l, struct node *(*f)()) {
+  struct node *n = node(N_BINOP, TYPE_NUM, l, f());
+  n->op = op;
+  return n;
 }
 
-static int postfix_expr() {
-  int type = prim_expr();
+static struct node *postfix_expr() {
+  struct node *n = prim_expr();
 
-  if (type == TYPE_INTVAR && accept("[")) {
-    binary(type, expr, GEN_ADD, GEN_ADDSZ);
-    expect(__LINE__,"]");
-    type = TYPE_CHARVAR;
-  } else if (accept("(")) {
-    int prev_stack_pos = stack_pos;
-    gen_push(); /* store function address */
-    int call_addr = stack_pos - 1;
-    if (accept(")") == 0) {
-      expr();
-      gen_push();
-      while (accept(",")) {
-        expr();
-        gen_push();
+  if (n->type == TYPE_INTVAR && accept('[')) {
+    n = node(N_INDEX, TYPE_CHARVAR, n, parse_expr());
+    n->op = '+';
+    expect(__LINE__,']');
+  } else if (accept('(')) {
+    struct node **arg;
+    n = node(N_CALL, TYPE_NUM, n, NULL);
+    arg = &n->r;
+    if (accept(')') == 0) {
+      *arg = parse_expr();
+      while (accept(',')) {
+        arg = &(*arg)->next;
+        *arg = parse_expr();
       }
-      expect(__LINE__,")");
-    }
-    type = TYPE_NUM;
-    gen_stack_addr(stack_pos - call_addr - 1);
-    gen_unref(TYPE_INTVAR);
-    gen_call();
-    if (currFunction) {
-      gen_call_cleanup(currFunction->nParams);
-    } else {
-        error("[line %d] Error: unexpected function exit\n",linenum);
+      expect(__LINE__,')');
     }
-    /* remove function address and args */
-    gen_pop(stack_pos - prev_stack_pos);
-    stack_pos = prev_stack_pos;
   }
-  return type;
+  return n;
 }
 
-static int add_expr() {
-  int type = postfix_expr();
-  while (peek("+") || peek("-")) {
-    if (accept("+")) {
-      type = binary(type, postfix_expr, GEN_ADD, GEN_ADDSZ);
-    } else if (accept("-")) {
-      type = binary(type, postfix_expr, GEN_SUB, GEN_SUBSZ);
-    }
+// !a is a == 0
+static struct node *unary_expr() {
+  if (accept('!')) {
+    struct node *n = node(N_BINOP, TYPE_NUM, unary_expr(), num_node(0));
+    n->op = T_EQ;
+    return n;
   }
-  return type;
+  return postfix_expr();
 }
 
-static int shift_expr() {
-  int type = add_expr();
-  while (peek("<<") || peek(">>")) {
-    if (accept("<<")) {
-      type = binary(type, add_expr, GEN_SHL, GEN_SHLSZ);
-    } else if (accept(">>")) {
-      type = binary(type, add_expr, GEN_SHR, GEN_SHRSZ);
-    }
+static struct node *add_expr() {
+  struct node *n = unary_expr();
+  while (peek('+') || peek('-')) {
+    int op = tokkind;
+    readtok();
+    n = binary(op, n, unary_expr);
   }
-  return type;
+  return n;
 }
 
-static int rel_expr() {
-  int type = shift_expr();
-  while (peek("<")) {
-    if (accept("<")) {
-      type = binary(type, shift_expr, GEN_LESS, GEN_LESSSZ);
-    }
+static struct node *shift_expr() {
+  struct node *n = add_expr();
+  while (peek(T_SHL) || peek(T_SHR)) {
+    int op = tokkind;
+    readtok();
+    n = binary(op, n, add_expr);
   }
-  return type;
+  return n;
 }
 
-static int eq_expr() {
-  int type = rel_expr();
-  while (peek("==") || peek("!=")) {
-    if (accept("==")) {
-      type = binary(type, rel_expr, GEN_EQ, GEN_EQSZ);
-    } else if (accept("!=")) {
-      type = binary(type, rel_expr, GEN_NEQ, GEN_NEQSZ);
+// a > b and a >= b are turned into b < a and b <= a, so that the backends
+// only know '<' and '<='; which operand is evaluated first is unspecified
+static struct node *rel_expr() {
+  struct node *n = shift_expr();
+  while (peek('<') || peek('>') || peek(T_LE) || peek(T_GE)) {
+    int op = tokkind;
+    readtok();
+    n = binary(op, n, shift_expr);
+    if (op == '>' || op == T_GE) {
+      struct node *l = n->l;
+      n->l = n->r;
+      n->r = l;
+      n->op = (op == '>') ? '<' : T_LE;
     }
   }
-  return type;
+  return n;
 }
 
-static int bitwise_expr() {
-  int type = eq_expr();
-
-  while (peek("|") || peek("&") || peek("^") || peek("/") || peek("*") || peek("%") ) {
-    if (accept("|")) {        // expression '|'
-      type = binary(type, eq_expr, GEN_OR, GEN_ORSZ);
-    } else if (accept("&")) { // expression '&'
-      type = binary(type, eq_expr, GEN_AND, GEN_ANDSZ);
-    } else if (accept("^")) { // expression '^'
-      type = binary(type, eq_expr, GEN_XOR, GEN_XORSZ);
-    } else if (accept("/")) { // expression '/'
-      type = binary(type, eq_expr, GEN_DIV, GEN_DIVSZ);
-    } else if (accept("*")) { // expression '*'
-      type = binary(type, eq_expr, GEN_MUL, GEN_MULSZ);
-    } else if (accept("%")) { // expression '%'
-      type = binary(type, eq_expr, GEN_MOD, GEN_MODSZ);
-    }
+static struct node *eq_expr() {
+  struct node *n = rel_expr();
+  while (peek(T_EQ) || peek(T_NE)) {
+    int op = tokkind;
+    readtok();
+    n = binary(op, n, rel_expr);
   }
-  return type;
+  return n;
 }
 
-static int expr() {
-  int type = bitwise_expr();
-  if (type != TYPE_NUM) {
-    if (accept("=")) {
-      printf("HERE 1=\n");
-      gen_push(); expr(); 
-      if (type == TYPE_INTVAR) {
-        emit(GEN_ASSIGN, GEN_ASSIGNSZ);
-      } else {
-        emit(GEN_ASSIGN8, GEN_ASSIGN8SZ);
-      }
-      stack_pos = stack_pos - 1; // assume ASSIGN contains pop
-      type = TYPE_NUM;
-    } else {
-      gen_unref(type);
-    }
+static struct node *bitwise_expr() {
+  struct node *n = eq_expr();
+
+  // '|', '&', '^', '/', '*' and '%' share the lowest precedence
+  while (peek('|') || peek('&') || peek('^') || peek('/') || peek('*') || peek('%') ) {
+    int op = tokkind;
+    readtok();
+    n = binary(op, n, eq_expr);
   }
-  return type;
+  return n;
 }
 
-static void statement() {
-  lastIsReturn = 0;
-  if (accept("{")) {
-    int prev_stack_pos = stack_pos;
-    while (accept("}") == 0) {
-      statement();
-    }
-    gen_pop(stack_pos-prev_stack_pos);
-    stack_pos = prev_stack_pos;
-    strcpy(context,"");
-    genPreamble = 0;
-    numPreambleVars = 0;
-    return;
+static struct node *land_expr() {
+  struct node *n = bitwise_expr();
+  while (accept(T_LAND)) {
+    n = binary(T_LAND, n, bitwise_expr);
+    n->kind = N_LOGIC;
   }
-  if (typename()) {
-    struct sym *var = sym_declare(context,tok, 'L', stack_pos);
-    printf("GENERATE_VAR %s_%s\n",context,tok);
-    readtok();
-    if (accept("=")) {
-      printf("HERE 2=\n");
-      expr();
-    }
-    numPreambleVars++;
-    // gen_push(); // make room for new local variable
-    var->addr = stack_pos-1;
-    expect(__LINE__,";");
-    return;
+  return n;
+}
+
+static struct node *lor_expr() {
+  struct node *n = land_expr();
+  while (accept(T_LOR)) {
+    n = binary(T_LOR, n, land_expr);
+    n->kind = N_LOGIC;
   }
-  // if we arrive here, we can generate the preamble
-  if (genPreamble) {
-    genPreamble = 0;
-    printf("Generate Preamble (nvars = %d)\n",numPreambleVars);
-    gen_preamble(numPreambleVars);
+  return n;
+}
+
+static struct node *parse_expr() {
+  struct node *n = lor_expr();
+  if (n->type != TYPE_NUM && accept('=')) {
+    trace("HERE 1=\n");
+    n = node(N_ASSIGN, TYPE_NUM, n, parse_expr());
   }
+  return n;
+}
 
-  if (accept("if")) {
-    expect(__LINE__,"(");
-    expr();
-    emit(GEN_JZ, GEN_JZSZ);
-    int p1 = codepos;
-    expect(__LINE__,")");
-    int prev_stack_pos = stack_pos;
-    statement();
-    emit(GEN_JMP, GEN_JMPSZ);
-    int p2 = codepos;
-    gen_patch(code + p1, codepos);
-    if (accept("else")) {
-      stack_pos = prev_stack_pos;
-      statement();
+/* true if evaluating n can change anything but the primary register */
+static int side_effects(struct node *n) {
+  for (; n != NULL; n = n->next) {
+    if (n->kind == N_CALL || n->kind == N_ASSIGN || n->kind == N_STR) {
+      return 1;  // strings are built on the stack by some backends
     }
-    stack_pos = prev_stack_pos;
-    gen_patch(code + p2, codepos);
-    return;
-  }
-  if (accept("while")) {
-    expect(__LINE__,"(");
-    int p1 = codepos;
-    gen_loop_start();
-    expr();
-    emit(GEN_JZ, GEN_JZSZ);
-    int p2 = codepos;
-    expect(__LINE__,")");
-    statement();
-    emit(GEN_JMP, GEN_JMPSZ);
-    gen_patch(code + codepos, p1);
-    gen_patch(code + p2, codepos);
-    return;
-  }
-  if (accept("return")) {
-    if (peek(";") == 0) {
-      expr();
+    if ((n->l && side_effects(n->l)) || (n->r && side_effects(n->r))) {
+      return 1;
     }
-    expect(__LINE__,";");
-    gen_pop(stack_pos); // remove all locals from stack (except return address)
-    lastIsReturn = 1;
-    gen_ret(numPreambleVars);
+  }
+  return 0;
+}
+
+/* evaluate a binary operator on constants in the backend's word size,
+   returns 0 if it can't be folded or the result doesn't fit a constant */
+static int fold_op(int op, int x, int y, int *v) {
+  int bits = TYPE_NUM_SIZE * 8;
+  long long a = wrap(x), b = wrap(y), r;
+  unsigned long long mask = (bits < 64) ? (1ULL << bits) - 1 : ~0ULL;
+  unsigned long long ua = a & mask, ub = b & mask;
+  switch (op) {
+  case '+':   r = ua + ub; break;
+  case '-':   r = ua - ub; break;
+  case '*':   r = ua * ub; break;
+  case '&':   r = a & b; break;
+  case '|':   r = a | b; break;
+  case '^':   r = a ^ b; break;
+  case '<':   r = a < b; break;
+  case T_LE:  r = a <= b; break;
+  case T_EQ:  r = a == b; break;
+  case T_NE:  r = a != b; break;
+  case T_SHL: if (ub >= (unsigned) bits) return 0; r = ua << ub; break;
+  case T_SHR: if (ub >= (unsigned) bits) return 0; r = ua >> ub; break;
+  case '/':   if (b == 0 || (b == -1 && a == wrap(1ULL << (bits - 1)))) return 0; r = a / b; break;
+  case '%':   if (b == 0 || (b == -1 && a == wrap(1ULL << (bits - 1)))) return 0; r = a % b; break;
+  case T_SAR: if (ub >= (unsigned) bits) return 0; r = a >> ub; break;
+  case T_MULHI: if (bits != 32) return 0; r = (a * b) >> 32; break;
+  default:    return 0;
+  }
+  r = wrap(r);
+  if (r < INT_MIN || r > INT_MAX) {
+    return 0;
+  }
+  *v = r;
+  return 1;
+}
+
+/* n != 0, as 0 or 1 */
+static struct node *truth(struct node *n) {
+  if (n->kind == N_NUM) {
+    return num_node(n->val != 0);
+  }
+  if (n->kind == N_LOGIC || (n->kind == N_BINOP && (n->op == '<' || n->op == T_LE ||
+                                                   n->op == T_EQ || n->op == T_NE))) {
+    return n;
+  }
+  n = node(N_BINOP, TYPE_NUM, n, num_node(0));
+  n->op = T_NE;
+  return n;
+}
+
+//
+// Strength reduction: multiplies, divides and remainders by a constant
+// are rewritten with shifts, adds and a multiply by the reciprocal when
+// the backend's gen_cost says that is cheaper.  A variable may be read
+// several times; other operands are evaluated once, as written.
+//
+static struct node *op_node(int op, struct node *l, struct node *r) {
+  struct node *n = node(N_BINOP, TYPE_NUM, l, r);
+  n->op = op;
+  return n;
+}
+
+/* another read of the variable x */
+static struct node *reread(struct node *x) {
+  struct node *n = node(N_VAR, x->type, NULL, NULL);
+  n->sym = x->sym;
+  return n;
+}
+
+/* true if the value of n is never negative */
+static int nonneg(struct node *n) {
+  switch (n->kind) {
+  case N_NUM:
+    return n->val >= 0;
+  case N_INDEX: // chars are unsigned
+  case N_LOGIC:
+    return 1;
+  case N_BINOP:
+    switch (n->op) {
+    case '<': case T_LE: case T_EQ: case T_NE:
+      return 1;
+    case '&':
+      return nonneg(n->l) || nonneg(n->r);
+    case '|': case '^': case '/':
+      return nonneg(n->l) && nonneg(n->r);
+    case '%':
+      return nonneg(n->l);
+    case T_SHR:
+      return n->r->kind == N_NUM && n->r->val > 0 && n->r->val < 32;
+    }
+  }
+  return 0;
+}
+
+/* cost of n on the backend, not counting the subtree x */
+static int cost(struct node *n, struct node *x) {
+  int c;
+  if (n == x || n->kind == N_NUM) {
+    return 0;
+  }
+  if (n->kind != N_BINOP) {
+    return gen_cost.add;
+  }
+  switch (n->op) {
+  case '*':     c = gen_cost.mul; break;
+  case '/':
+  case '%':     c = gen_cost.div; break;
+  case T_MULHI: c = gen_cost.mulhi; break;
+  case T_SAR:   c = gen_cost.sar; break;
+  case T_SHL:
+  case T_SHR:   c = gen_cost.shift; break;
+  default:      c = gen_cost.add; break;
+  }
+  return c + cost(n->l, x) + cost(n->r, x);
+}
+
+static struct node *shl(struct node *x, int k) {
+  return (k > 0) ? op_node(T_SHL, x, num_node(k)) : x;
+}
+
+/* x * c as a sum of shifted x, with the fewest terms (signed digits) */
+static struct node *reduce_mul(struct node *x, int c) {
+  struct node *r;
+  long long v = c;
+  int shift[33], sign[33], n = 0, i, f;
+
+  for (i = 0; v != 0; i++, v /= 2) {
+    if (v & 1) {
+      sign[n] = ((v & 3) == 3) ? -1 : 1;
+      shift[n] = i;
+      v -= sign[n++];
+    }
+  }
+  if (n == 0 || (n > 1 && x->kind != N_VAR)) {
+    return NULL;
+  }
+  for (f = 0; f < n - 1 && sign[f] < 0; f++); // start with a term that is added
+  r = shl(x, shift[f]);
+  if (sign[f] < 0) {
+    r = op_node('-', num_node(0), r);
+  }
+  for (i = 0; i < n; i++) {
+    if (i != f) {
+      r = op_node((sign[i] < 0) ? '-' : '+', r, shl(reread(x), shift[i]));
+    }
+  }
+  return r;
+}
+
+/* the multiplier m and shift s that divide by d >= 2 (Hacker's Delight,
+   10-1): x / d is the high word of x * m, plus x if m < 0, shifted right
+   by s, plus 1 if x is negative */
+static void magic(unsigned d, int *m, int *s) {
+  unsigned t = 0x80000000u, anc = t - 1 - t % d, q1, r1, q2, r2;
+  int p = 31;
+
+  q1 = t / anc; r1 = t - q1 * anc;
+  q2 = t / d;   r2 = t - q2 * d;
+  do {
+    p++;
+    q1 *= 2; r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2; r2 *= 2;
+    if (r2 >= d) {
+      q2++;
+      r2 -= d;
+    }
+  } while (q1 < d - r2 || (q1 == d - r2 && r1 == 0));
+  *m = q2 + 1;
+  *s = p - 32;
+}
+
+/* x / c or x % c (op), rounded towards zero */
+static struct node *reduce_div(int op, struct node *x, int c) {
+  unsigned d = (c < 0) ? -(unsigned) c : (unsigned) c;
+  int bits = TYPE_NUM_SIZE * 8, k, m, s;
+  struct node *q, *t;
+
+  if (d < 2 || c == INT_MIN) {
+    return NULL;
+  }
+  if ((d & (d - 1)) == 0) {
+    for (k = 0; (1u << k) != d; k++);
+    if (nonneg(x)) {
+      q = (op == '%') ? op_node('&', x, num_node(d - 1)) : op_node(T_SHR, x, num_node(k));
+    } else if (gen_cost.sar && x->kind == N_VAR) {
+      // a negative x needs d - 1 added to round towards zero
+      t = (k == 1) ? reread(x) : op_node(T_SAR, reread(x), num_node(bits - 1));
+      t = op_node('+', x, op_node(T_SHR, t, num_node(bits - k)));
+      if (op == '%') {
+        return op_node('-', reread(x), op_node('&', t, num_node(-(int) d)));
+      }
+      q = op_node(T_SAR, t, num_node(k));
+    } else {
+      return NULL;
+    }
+  } else if (gen_cost.mulhi && gen_cost.sar && x->kind == N_VAR) {
+    magic(d, &m, &s);
+    q = op_node(T_MULHI, x, num_node(m));
+    if (m < 0) {
+      q = op_node('+', q, reread(x));
+    }
+    if (s > 0) {
+      q = op_node(T_SAR, q, num_node(s));
+    }
+    q = op_node('+', q, op_node(T_SHR, reread(x), num_node(bits - 1)));
+    if (op == '%') {
+      return op_node('-', reread(x), op_node('*', q, num_node(d)));
+    }
+  } else {
+    return NULL;
+  }
+  if (op == '/' && c < 0) {
+    q = op_node('-', num_node(0), q);
+  }
+  return q;
+}
+
+/* n, a multiply, divide or remainder by a constant, in its cheapest form */
+static struct node *reduce(struct node *n) {
+  int mark = nodepos;
+  struct node *r;
+
+  if (n->op == '*') {
+    r = reduce_mul(n->l, n->r->val);
+  } else {
+    r = reduce_div(n->op, n->l, n->r->val);
+  }
+  if (r == NULL || cost(r, n->l) >= cost(n, n->l)) {
+    nodepos = mark; // drop the nodes of the rewrite
+    return n;
+  }
+  return r;
+}
+
+/* fold constant subtrees and drop operations that don't change a value */
+static struct node *fold(struct node *n) {
+  struct node **arg;
+  int v;
+
+  if (n->l) n->l = fold(n->l);
+  if (n->r && n->kind != N_CALL) n->r = fold(n->r);
+  for (arg = &n->r; n->kind == N_CALL && *arg; arg = &(*arg)->next) {
+    struct node *next = (*arg)->next;
+    *arg = fold(*arg);
+    (*arg)->next = next;
+  }
+  if (n->kind == N_LOGIC) {
+    v = (n->op == T_LOR); // the value if the left side decides
+    if (n->l->kind == N_NUM) {
+      return ((n->l->val != 0) == v) ? num_node(v) : truth(n->r);
+    }
+    if (n->r->kind == N_NUM && (n->r->val != 0) != v) {
+      return truth(n->l);
+    }
+    if (n->r->kind == N_NUM && !side_effects(n->l)) {
+      return num_node(v);
+    }
+    return n;
+  }
+  if (n->kind != N_BINOP) {
+    return n;
+  }
+  if (n->l->kind == N_NUM && n->r->kind == N_NUM) {
+    if (fold_op(n->op, n->l->val, n->r->val, &v)) {
+      return num_node(v);
+    }
+    return n;
+  }
+  if (n->r->kind == N_NUM) {
+    v = n->r->val;
+    if (v == 0 && (n->op == '+' || n->op == '-' || n->op == '|' || n->op == '^' ||
+                   n->op == T_SHL || n->op == T_SHR)) {
+      return n->l;
+    }
+    if (v == 1 && (n->op == '*' || n->op == '/')) {
+      return n->l;
+    }
+    if (v == 0 && (n->op == '&' || n->op == '*') && !side_effects(n->l)) {
+      return num_node(0);
+    }
+  }
+  if (n->l->kind == N_NUM) {
+    v = n->l->val;
+    if (v == 0 && (n->op == '+' || n->op == '|' || n->op == '^')) {
+      return n->r;
+    }
+    if (v == 1 && n->op == '*') {
+      return n->r;
+    }
+    if (v == 0 && (n->op == '&' || n->op == '*' || n->op == T_SHL || n->op == T_SHR) &&
+        !side_effects(n->r)) {
+      return num_node(0);
+    }
+    if (n->op == '*') {
+      struct node *l = n->l; // the constant goes right
+      n->l = n->r;
+      n->r = l;
+    }
+  }
+  if (n->r->kind == N_NUM && (n->op == '*' || n->op == '/' || n->op == '%')) {
+    return reduce(n);
+  }
+  return n;
+}
+
+static int ir_value(struct node *n);
+
+/* address of the char l[r] */
+static int ir_index(struct node *n) {
+  int a = ir_value(n->l);
+  return ir_emit(IR_BIN, a, ir_value(n->r), '+');
+}
+
+/* translate the expression tree n, returns its value */
+static int ir_value(struct node *n) {
+  struct node *arg;
+  int a, l, first = -1, last = -1;
+
+  switch (n->kind) {
+  case N_NUM:
+    return ir_emit(IR_CONST, -1, -1, n->val);
+  case N_VAR:
+    return ir_sym(IR_LOADVAR, n->sym, -1);
+  case N_STR:
+    a = ir_emit(IR_STR, -1, -1, n->val);
+    ir[a].str = n->str;
+    return a;
+  case N_BINOP:
+    a = ir_value(n->l);
+    return ir_emit(IR_BIN, a, ir_value(n->r), n->op);
+  case N_INDEX:
+    return ir_emit(IR_LOAD, ir_index(n), -1, TYPE_CHARVAR);
+  case N_CALL:
+    // the callee is called at its address, not at the value stored there
+    if (n->l->kind == N_VAR) {
+      a = ir_sym(IR_ADDR, n->l->sym, -1);
+    } else if (n->l->kind == N_INDEX) {
+      a = ir_index(n->l);
+    } else {
+      a = ir_value(n->l);
+    }
+    for (arg = n->r; arg != NULL; arg = arg->next) {
+      int v = ir_value(arg);
+      if (last < 0) {
+        first = v;
+      } else {
+        ir[last].next = v;
+      }
+      last = v;
+    }
+    return ir_emit(IR_CALL, a, first, 0);
+  case N_ASSIGN:
+    if (n->l->kind == N_VAR) {
+      return ir_sym(IR_STOREVAR, n->l->sym, ir_value(n->r));
+    }
+    a = ir_index(n->l);
+    return ir_emit(IR_STORE, a, ir_value(n->r), TYPE_CHARVAR);
+  case N_LOGIC:
+    // the right side is skipped if the left one decides
+    l = new_label();
+    a = ir_emit(IR_TEST, ir_value(n->l), n->op == T_LOR, l);
+    return ir_emit(IR_JOIN, a, ir_value(n->r), l);
+  }
+  return -1;
+}
+
+/* translate the condition n into a jump to label l taken if it is not
+   zero (nz) or zero (!nz); && and || only jump, they make no values */
+static void ir_cond(struct node *n, int nz, int l) {
+  if (n->kind == N_NUM) {
+    if ((n->val != 0) == nz) {
+      ir_emit(IR_JMP, -1, -1, l);
+    }
+    return;
+  }
+  if (n->kind == N_LOGIC && (n->op == T_LOR) == nz) {
+    ir_cond(n->l, nz, l); // either side decides
+    ir_cond(n->r, nz, l);
+    return;
+  }
+  if (n->kind == N_LOGIC) {
+    int skip = new_label();
+    ir_cond(n->l, !nz, skip);
+    ir_cond(n->r, nz, l);
+    ir_emit(IR_LABEL, 0, -1, skip);
+    return;
+  }
+  if (n->kind == N_BINOP && n->op == T_EQ && n->r->kind == N_NUM && n->r->val == 0) {
+    ir_cond(n->l, !nz, l); // !a
+    return;
+  }
+  ir_emit(nz ? IR_JNZ : IR_JZ, ir_value(n), -1, l);
+}
+
+/* parse an expression, returns the instruction computing its value */
+static int expr() {
+  nodepos = nodebase;
+  return ir_value(fold(parse_expr()));
+}
+
+/* parse a condition, jumping to label l if it is not zero (nz) or zero (!nz) */
+static void cond(int nz, int l) {
+  nodepos = nodebase;
+  ir_cond(fold(parse_expr()), nz, l);
+}
+
+/* parse an expression translated later, its nodes are kept until the caller
+   lowers nodebase again */
+static struct node *hold_expr() {
+  nodepos = nodebase;
+  struct node *n = fold(parse_expr());
+  nodebase = nodepos;
+  return n;
+}
+
+//
+// OPTIMIZER
+//
+// The passes work on one basic block at a time.  Locals can only be
+// reached through their names, so they never change behind the block's
+// back; globals may be written by calls and by stores through pointers.
+#define KNOWN_CONST 1  /* the variable holds kval */
+#define KNOWN_COPY  2  /* the variable holds the value ksym had at version kver */
+
+static void block_start() {
+  blockepoch++;
+  ntouched = 0;
+}
+
+/* the symbol, with its optimizer state reset if it is from another block */
+static struct sym *var(struct sym *s) {
+  if (s->epoch != blockepoch) {
+    s->epoch = blockepoch;
+    s->known = 0;
+    s->kill = 0;
+    s->read = 0;
+    if (s->type != 'L') {
+      touched = grow(touched, &touchedsz, ntouched + 1, sizeof(*touched));
+      touched[ntouched++] = s;
+    }
+  }
+  return s;
+}
+
+/* the variable gets a new value */
+static void var_kill(struct sym *s) {
+  var(s)->ver++;
+  s->known = 0;
+}
+
+/* a call or a store through a pointer may change any global */
+static void clobber() {
+  int i;
+  for (i = 0; i < ntouched; i++) {
+    var_kill(touched[i]);
+  }
+}
+
+/* the symbols of a closed scope no longer exist */
+static void out_of_scope(int from, int to) {
+  for (; from < to; from++) {
+    var_kill(&syms[from]);
+  }
+}
+
+/* the value an assignment stores */
+static int ir_stored(int t) {
+  while (t >= 0 && (ir[t].op == IR_STOREVAR || ir[t].op == IR_COPY)) {
+    t = ir[t].a;
+  }
+  return t;
+}
+
+/* true if evaluating t can change anything but the primary register */
+static int ir_effects(int t) {
+  switch (ir[t].op) {
+  case IR_CONST:
+  case IR_ADDR:
+  case IR_LOADVAR:
+    return 0;
+  case IR_LOAD:
+  case IR_COPY:
+    return ir_effects(ir[t].a);
+  case IR_BIN:
+    return ir_effects(ir[t].a) || ir_effects(ir[t].b);
+  }
+  return 1;  // calls, stores, and strings built on the stack by some backends
+}
+
+/* delete the value t, which has no side effects, and its operands */
+static void ir_drop(int t) {
+  struct insn *i = &ir[t];
+  if (i->op == IR_LOAD || i->op == IR_COPY || i->op == IR_BIN) {
+    ir_drop(i->a);
+  }
+  if (i->op == IR_BIN) {
+    ir_drop(i->b);
+  }
+  i->op = IR_NOP;
+}
+
+/* replace reads of variables holding a constant or an unchanged copy of
+   another variable */
+static void copy_prop(int from, int to) {
+  int t;
+  block_start();
+  for (t = from; t < to; t++) {
+    struct insn *i = &ir[t];
+    struct sym *s = i->sym;
+    int v;
+    switch (i->op) {
+    case IR_LOADVAR:
+      var(s);
+      if (s->known == KNOWN_CONST) {
+        i->op = IR_CONST;
+        i->k = s->kval;
+        i->sym = NULL;
+      } else if (s->known == KNOWN_COPY && var(s->ksym)->ver == s->kver) {
+        i->sym = s->ksym;
+      }
+      break;
+    case IR_STOREVAR:
+    case IR_PUSH:
+      v = ir_stored(i->a);
+      var_kill(s);
+      if (v >= 0 && ir[v].op == IR_CONST) {
+        s->known = KNOWN_CONST;
+        s->kval = ir[v].k;
+      } else if (v >= 0 && ir[v].op == IR_LOADVAR && ir[v].sym != s) {
+        s->known = KNOWN_COPY;
+        s->ksym = var(ir[v].sym);
+        s->kver = s->ksym->ver;
+      }
+      break;
+    case IR_STORE:
+    case IR_CALL:
+      clobber();
+      break;
+    case IR_RESTORE:
+      out_of_scope(i->a, i->b);
+      break;
+    }
+  }
+}
+
+/* value number of t: the first value of the block that is the same,
+   -1 if it reads memory or has side effects */
+static int vn_find(int t) {
+  struct insn *i = &ir[t];
+  int a = -1, b = -1, r;
+  unsigned h;
+
+  if (i->op == IR_BIN) {
+    a = ir[i->a].vn;
+    b = ir[i->b].vn;
+    if (a < 0 || b < 0) {
+      return -1;
+    }
+  } else if (i->op != IR_CONST && i->op != IR_LOADVAR && i->op != IR_ADDR) {
+    return -1;
+  }
+  h = ((((unsigned) i->op * 31 + i->k) * 31 + a) * 31 + b) * 31 + i->ver;
+  h = (h ^ (unsigned) ((uintptr_t) i->sym >> 4)) & (VNHASHSZ - 1);
+  if (vnepoch[h] != blockepoch) {
+    vnepoch[h] = blockepoch;
+    vnhash[h] = -1;
+  }
+  for (r = vnhash[h]; r >= 0; r = ir[r].chain) {
+    struct insn *j = &ir[r];
+    if (j->op == i->op && j->k == i->k && j->sym == i->sym && j->ver == i->ver &&
+        (i->op != IR_BIN || (ir[j->a].vn == a && ir[j->b].vn == b))) {
+      return r;
+    }
+  }
+  i->chain = vnhash[h];
+  vnhash[h] = t;
+  return t;
+}
+
+/* common subexpression elimination: an expression that was stored in a
+   variable which still holds it is read from the variable instead */
+static void cse(int from, int to) {
+  int t;
+  block_start();
+  for (t = from; t < to; t++) {
+    struct insn *i = &ir[t];
+    struct insn *r;
+    int v;
+    switch (i->op) {
+    case IR_LOADVAR:
+      i->ver = var(i->sym)->ver;
+      i->vn = vn_find(t);
+      break;
+    case IR_CONST:
+    case IR_ADDR:
+      i->vn = vn_find(t);
+      break;
+    case IR_BIN:
+      i->vn = vn_find(t);
+      if (i->vn < 0 || i->vn == t) {
+        break;
+      }
+      r = &ir[i->vn];
+      if (r->avail != NULL && var(r->avail)->ver == r->availver) {
+        ir_drop(i->a);
+        ir_drop(i->b);
+        i->op = IR_LOADVAR;
+        i->sym = r->avail;
+        i->ver = r->availver;
+        i->k = 0;
+        i->a = i->b = -1;
+        i->vn = vn_find(t);
+      }
+      break;
+    case IR_STOREVAR:
+    case IR_PUSH:
+      v = ir_stored(i->a);
+      var_kill(i->sym);
+      if (v >= 0 && ir[v].op == IR_BIN && ir[v].vn >= 0) {
+        r = &ir[ir[v].vn];
+        r->avail = i->sym;
+        r->availver = i->sym->ver;
+      }
+      break;
+    case IR_STORE:
+    case IR_CALL:
+      clobber();
+      break;
+    case IR_RESTORE:
+      out_of_scope(i->a, i->b);
+      break;
+    }
+  }
+}
+
+/* true if a store to s now would be overwritten or lost before a read;
+   lkill and gread are the last steps all locals died and all globals
+   may have been read */
+static int dead(struct sym *s, int lkill, int gread) {
+  int kill = s->kill, read = s->read;
+  if (s->type == 'L') {
+    kill = (lkill > kill) ? lkill : kill;
+  } else {
+    read = (gread > read) ? gread : read;
+  }
+  return kill > read;
+}
+
+/* dead store elimination: stores to variables that are stored again or
+   go out of scope before they are read are dropped, walking the block
+   backwards so the next access to a variable is always known; statements
+   computing a value without side effects go as well */
+static void dead_stores(int from, int to) {
+  int t, j, step = 0, lkill = 0, gread = 0;
+  block_start();
+  for (t = to - 1; t >= from; t--) {
+    struct insn *i = &ir[t];
+    step++;
+    if (i->root && !ir_effects(t)) {
+      ir_drop(t);
+      continue;
+    }
+    switch (i->op) {
+    case IR_LOADVAR:
+      var(i->sym)->read = step;
+      break;
+    case IR_LOAD:
+    case IR_CALL:
+      gread = step;
+      break;
+    case IR_RET:
+      lkill = step;
+      break;
+    case IR_RESTORE:
+      for (j = i->a; j < i->b; j++) {
+        var(&syms[j])->kill = step;
+      }
+      break;
+    case IR_STOREVAR:
+    case IR_PUSH:
+      if (dead(var(i->sym), lkill, gread)) {
+        if (i->op == IR_PUSH) {
+          if (i->a >= 0 && !ir_effects(i->a)) {
+            ir_drop(i->a);
+            i->a = -1; // the slot is still needed, its value is not
+          }
+        } else if (i->root && !ir_effects(i->a)) {
+          ir_drop(i->a);
+          i->op = IR_NOP;
+        } else {
+          i->op = IR_COPY;
+        }
+      }
+      i->sym->kill = step;
+      break;
+    }
+  }
+}
+
+static struct pass {
+  char *name;
+  int  level;                     /* lowest -O level running the pass */
+  void (*run)(int from, int to);  /* run on the basic block ir[from..to) */
+} passes[] = {
+  {"copy-prop", 1, copy_prop},
+  {"cse",       2, cse},
+  {"dse",       1, dead_stores},
+  {NULL, 0, NULL}
+};
+
+/* end of the basic block starting at from */
+static int block_end(int from) {
+  int t;
+  for (t = from; t < irpos; t++) {
+    if ((ir[t].op == IR_LABEL || ir[t].op == IR_JOIN) && t > from) {
+      return t;
+    }
+    if (ir[t].op == IR_JZ || ir[t].op == IR_JNZ || ir[t].op == IR_TEST ||
+        ir[t].op == IR_JMP || ir[t].op == IR_JTAB || ir[t].op == IR_RET) {
+      return t + 1;
+    }
+  }
+  return irpos;
+}
+
+static void optimize() {
+  struct pass *p;
+  int from, to;
+  for (p = passes; p->name != NULL; p++) {
+    if (optlevel >= p->level) {
+      for (from = 0; from < irpos; from = to) {
+        to = block_end(from);
+        p->run(from, to);
+      }
+    }
+  }
+}
+
+#ifdef GEN_NREGS
+//
+// REGISTER ALLOCATION
+//
+// Backends that define GEN_NREGS lower functions themselves at -O1 and up
+// (at all levels if they also define GEN_REGS_ONLY: such backends have no
+// stack machine interface, and at -O0 get no registers), with values and
+// locals kept in registers.  Every value and every local gets a live
+// interval, from its definition to its last use (locals: their whole
+// scope).  A linear scan over the intervals by start hands out the
+// free registers; when none is left, the interval least worth one (uses
+// weighted by loop depth) stays in memory.  Spilled values are pushed when
+// computed and popped by their user, which keeps them in stack order since
+// values form trees; spilled locals keep their stack slot.  Intervals
+// across a call only get the GEN_CALLEE_SAVED registers.
+struct interval {
+  int start, end;    /* instructions defining the value and using it last */
+  int weight;
+  int calls;         /* a call happens inside the interval */
+  int t;             /* the value, or -1 for... */
+  struct sym *s;     /* ...a local */
+  int reg;
+};
+
+static void set_user(int t, int user) {
+  if (t >= 0) {
+    ir[t].user = user;
+  }
+}
+
+/* how much keeping a use at t in a register is worth */
+static int use_weight(int t) {
+  return 1 << (3 * (ldepth[t] < 5 ? ldepth[t] : 5));
+}
+
+/* true if s may be written after from and before to */
+static int var_written(struct sym *s, int from, int to) {
+  for (from++; from < to; from++) {
+    struct insn *i = &ir[from];
+    if ((i->op == IR_STOREVAR || i->op == IR_PUSH) && i->sym == s) {
+      return 1;
+    }
+    if (s->type != 'L' && (i->op == IR_CALL || i->op == IR_STORE)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static struct interval *new_interval(int start, int end, int t, struct sym *s) {
+  struct interval *v;
+  ivs = grow(ivs, &ivsz, nivs + 1, sizeof(*ivs));
+  v = &ivs[nivs++];
+  v->start = start;
+  v->end = end;
+  v->weight = 0;
+  v->t = t;
+  v->s = s;
+  v->reg = -1;
+  return v;
+}
+
+static int interval_cmp(const void *a, const void *b) {
+  const struct interval *x = a, *y = b;
+  return (x->start != y->start) ? x->start - y->start : x->end - y->end;
+}
+
+/* assign registers 0..nregs-1 */
+static void regalloc(int nregs) {
+  struct sym *first = currFunction + 1, *s;
+  int active[GEN_NREGS];
+  int t, j, r;
+
+  ncalls = grow(ncalls, &rasz, irpos + 1, sizeof(int));
+  ldepth = realloc(ldepth, rasz * sizeof(int));
+  if (ldepth == NULL) {
+    error("Out of memory\n");
+  }
+  memset(ldepth, 0, (irpos + 1) * sizeof(int));
+  ncalls[0] = 0;
+  for (t = 0; t < irpos; t++) {
+    struct insn *i = &ir[t];
+    i->user = -1;
+    i->loc = LOC_NONE;
+    i->reg = -1;
+    i->live = 0;
+    ncalls[t + 1] = ncalls[t] + (i->op == IR_CALL);
+  }
+  // users; call arguments are pushed
+  for (t = 0; t < irpos; t++) {
+    struct insn *i = &ir[t];
+    switch (i->op) {
+    case IR_BIN:
+    case IR_STORE:
+    case IR_JOIN:
+      set_user(i->b, t);
+      // fall through
+    case IR_LOAD:
+    case IR_COPY:
+    case IR_STOREVAR:
+    case IR_JZ:
+    case IR_JNZ:
+    case IR_TEST:
+    case IR_JTAB:
+    case IR_RET:
+    case IR_PUSH:
+      set_user(i->a, t);
+      break;
+    case IR_CALL:
+      set_user(i->a, t);
+      for (j = i->b; j >= 0; j = ir[j].next) {
+        set_user(j, t);
+        ir[j].loc = LOC_STACK;
+      }
+      break;
+    case IR_LABEL:
+      if (i->a == 1) {
+        labels[i->k].pos = t;
+      }
+      break;
+    }
+    if ((i->op == IR_JMP || i->op == IR_JZ || i->op == IR_JNZ) && labels[i->k].pos >= 0) {
+      // a loop, up to its last jump back; jumps is free without ir_lower()
+      struct label *l = &labels[i->k];
+      ldepth[l->jumps >= 0 ? l->jumps + 1 : l->pos]++;
+      ldepth[t + 1]--;
+      l->jumps = t;
+    }
+  }
+  for (t = 1; t < irpos; t++) {
+    ldepth[t] += ldepth[t - 1];
+  }
+  // a copy passes its user on to its operand
+  for (t = irpos - 1; t >= 0; t--) {
+    struct insn *i = &ir[t];
+    if (i->op == IR_COPY) {
+      ir[i->a].user = i->user;
+      if (i->loc == LOC_STACK) {
+        ir[i->a].loc = LOC_STACK;
+      }
+      i->loc = LOC_ALIAS;
+    }
+  }
+
+  // locals first, so that ivs[s - first] is the interval of s
+  nivs = 0;
+  for (s = first; s < syms + sympos; s++) {
+    new_interval(s->addr < 0 ? 0 : irpos, irpos, -1, s); // params are live on entry
+  }
+  for (t = 0; t < irpos; t++) {
+    struct insn *i = &ir[t];
+    struct interval *v;
+    switch (i->op) {
+    case IR_CONST:
+    case IR_ADDR:
+    case IR_STR:
+      if (i->loc == LOC_NONE) {
+        i->loc = LOC_IMM;
+      }
+      continue;
+    case IR_LOADVAR:
+      if (i->sym->type == 'L') {
+        ivs[i->sym - first].weight += use_weight(t);
+      }
+      if (i->loc == LOC_NONE && i->user >= 0 && !var_written(i->sym, t, i->user)) {
+        i->loc = LOC_VAR;
+      }
+      break;
+    case IR_PUSH:
+      ivs[i->sym - first].start = t;
+      // fall through
+    case IR_STOREVAR:
+      if (i->sym->type == 'L') {
+        ivs[i->sym - first].weight += use_weight(t);
+      }
+      break;
+    case IR_RESTORE:
+      for (j = i->a; j < i->b; j++) {
+        ivs[j - (first - syms)].end = t;
+      }
+      continue;
+    case IR_LOAD:
+    case IR_BIN:
+    case IR_CALL:
+    case IR_STORE:
+    case IR_JOIN:
+      break;
+    default:
+      continue;
+    }
+    if (i->user == t + 1 && (ir[t + 1].op == IR_RET || ir[t + 1].op == IR_JOIN ||
+                             ir[t + 1].op == IR_JTAB)) {
+      continue; // used from the primary register
+    }
+#ifdef GEN_FLAGS
+    if (i->user == t + 1 && i->op == IR_BIN && ir_bool(t) &&
+        (ir[t + 1].op == IR_JZ || ir[t + 1].op == IR_JNZ || ir[t + 1].op == IR_TEST)) {
+      i->loc = LOC_FLAGS; // the jump tests the flags of the comparison
+      continue;
+    }
+#endif
+    if (i->loc == LOC_NONE && i->user >= 0) {
+      v = new_interval(t, i->user, t, NULL);
+      v->weight = 2 * use_weight(t); // a spilled value costs a push and a pop
+    }
+  }
+
+  // linear scan
+  for (j = 0; j < nivs; j++) {
+    struct interval *v = &ivs[j];
+    v->calls = ncalls[v->end] - ncalls[v->start + 1] > 0;
+    if (v->weight == 0) {
+      v->start = v->end = irpos; // unused local
+    }
+  }
+  qsort(ivs, nivs, sizeof(*ivs), interval_cmp);
+  for (r = 0; r < nregs; r++) {
+    active[r] = -1;
+  }
+  regsused = 0;
+  for (j = 0; j < nivs && ivs[j].start < irpos; j++) {
+    struct interval *v = &ivs[j];
+    int allowed = (v->calls ? GEN_CALLEE_SAVED : ~0) & ((1 << nregs) - 1);
+    int victim = -1;
+    for (r = 0; r < nregs; r++) {
+      if (active[r] >= 0 && ivs[active[r]].end <= v->start) {
+        active[r] = -1;
+      }
+    }
+    // scratch registers first, the preserved ones are kept for calls
+    for (r = 0; r < nregs && v->reg < 0; r++) {
+      if (active[r] < 0 && (allowed & ~GEN_CALLEE_SAVED & (1 << r))) {
+        v->reg = r;
+      }
+    }
+    for (r = 0; r < nregs && v->reg < 0; r++) {
+      if (active[r] < 0 && (allowed & (1 << r))) {
+        v->reg = r;
+      }
+    }
+    if (v->reg < 0) {
+      for (r = 0; r < nregs; r++) {
+        if ((allowed & (1 << r)) &&
+            (victim < 0 || ivs[active[r]].weight < ivs[active[victim]].weight)) {
+          victim = r;
+        }
+      }
+      if (victim < 0 || ivs[active[victim]].weight >= v->weight) {
+        continue; // v stays in memory
+      }
+      ivs[active[victim]].reg = -1;
+      v->reg = victim;
+    }
+    active[v->reg] = j;
+  }
+
+  for (j = 0; j < nivs; j++) {
+    struct interval *v = &ivs[j];
+    if (v->s != NULL) {
+      v->s->reg = v->reg;
+    }
+  }
+  for (j = 0; j < nivs; j++) {
+    struct interval *v = &ivs[j];
+    if (v->s == NULL) {
+      struct insn *u = &ir[v->end];
+      // a value stored right away into a local is computed in its register
+      if (v->reg >= 0 && v->end == v->t + 1 && u->op == IR_STOREVAR && u->user < 0 &&
+          u->sym->reg >= 0) {
+        v->reg = u->sym->reg;
+      }
+      ir[v->t].loc = (v->reg >= 0) ? LOC_REG : LOC_STACK;
+      ir[v->t].reg = v->reg;
+    }
+    if (v->reg >= 0) {
+      regsused |= 1 << v->reg;
+      for (t = v->start + 1; t < v->end; t++) {
+        ir[t].live |= 1 << v->reg;
+      }
+    }
+  }
+}
+#endif
+
+#ifndef GEN_REGS_ONLY
+//
+// LOWERING
+//
+// Instructions are handed to the backend through the gen_xxx interface.
+// A value is generated when its user needs it: operands are computed into
+// the primary register and pushed, exactly like the parser used to do.
+static void gen_binop(int op) {
+  switch (op) {
+  case '+':   emit(GEN_ADD, GEN_ADDSZ); break;
+  case '-':   emit(GEN_SUB, GEN_SUBSZ); break;
+  case T_SHL: emit(GEN_SHL, GEN_SHLSZ); break;
+  case T_SHR: emit(GEN_SHR, GEN_SHRSZ); break;
+  case '<':   emit(GEN_LESS, GEN_LESSSZ); break;
+  case T_LE:  emit(GEN_LE, GEN_LESZ); break;
+  case T_EQ:  emit(GEN_EQ, GEN_EQSZ); break;
+  case T_NE:  emit(GEN_NEQ, GEN_NEQSZ); break;
+  case '|':   emit(GEN_OR, GEN_ORSZ); break;
+  case '&':   emit(GEN_AND, GEN_ANDSZ); break;
+  case '^':   emit(GEN_XOR, GEN_XORSZ); break;
+  case '/':   emit(GEN_DIV, GEN_DIVSZ); break;
+  case '*':   emit(GEN_MUL, GEN_MULSZ); break;
+  case '%':   emit(GEN_MOD, GEN_MODSZ); break;
+#ifdef GEN_SAR
+  case T_SAR: emit(GEN_SAR, GEN_SARSZ); break;
+#endif
+#ifdef GEN_MULHI
+  case T_MULHI: emit(GEN_MULHI, GEN_MULHISZ); break;
+#endif
+  }
+  stack_pos = stack_pos - 1; /* assume that buffer contains a "pop" */
+}
+
+static void gen_var_addr(struct sym *s) {
+  if (s->type == 'L') {
+    // Local Symbol
+    gen_stack_addr(stack_pos - s->addr - 1);
+  } else {
+    // Other Symbols (Global)
+    gen_sym_addr(s);
+  }
+}
+
+static void ir_jump(int t) {
+  struct label *l = &labels[ir[t].k];
+  ir[t].pos = codepos;
+  if (l->pos >= 0) {
+    counts.patches++;
+    gen_patch(codepos, l->pos); // backwards, the label is known
+  } else {
+    ir[t].next = l->jumps;
+    l->jumps = t;
+  }
+}
+
+/* place label k here */
+static void ir_label(int k) {
+  int j;
+  code_barrier();
+  labels[k].pos = codepos;
+  for (j = labels[k].jumps; j >= 0; j = ir[j].next) {
+    counts.patches++;
+    gen_patch(ir[j].pos, labels[k].pos);
+  }
+}
+
+#ifdef GEN_JTAB
+/* jump through the table at jtab[k] to the entry the primary register
+   selects; the cases it jumps to all come before it */
+static void ir_jtab(int k) {
+  int j;
+  code_barrier();
+  gen_jtab(jtab[k]);
+  for (j = 1; j <= jtab[k]; j++) {
+    emit(GEN_JTAB, GEN_JTABSZ);
+    counts.patches++;
+    gen_patch(codepos, labels[jtab[k + j]].pos);
+  }
+}
+#endif
+
+/* generate the value t into the primary register */
+static void ir_gen(int t) {
+  struct insn *i = &ir[t];
+  int arg;
+
+  switch (i->op) {
+  case IR_CONST:
+    gen_const(i->k);
+    break;
+  case IR_ADDR:
+    gen_var_addr(i->sym);
+    break;
+  case IR_STR:
+    gen_array(i->str, i->k);
+    break;
+  case IR_LOADVAR:
+    gen_var_addr(i->sym);
+    gen_unref(TYPE_INTVAR);
+    break;
+  case IR_LOAD:
+    ir_gen(i->a);
+    gen_unref(i->k);
+    break;
+  case IR_STOREVAR:
+  case IR_STORE:
+    if (i->op == IR_STOREVAR) {
+      gen_var_addr(i->sym);
+    } else {
+      ir_gen(i->a);
+    }
+    gen_push();
+    ir_gen(i->op == IR_STOREVAR ? i->a : i->b);
+    if (i->op == IR_STOREVAR || i->k == TYPE_INTVAR) {
+      emit(GEN_ASSIGN, GEN_ASSIGNSZ);
+    } else {
+      emit(GEN_ASSIGN8, GEN_ASSIGN8SZ);
+    }
+    stack_pos = stack_pos - 1; // assume ASSIGN contains pop
+    break;
+  case IR_BIN:
+    ir_gen(i->a);
+    gen_push();
+    ir_gen(i->b);
+    gen_binop(i->k);
+    break;
+  case IR_CALL: {
+    int prev_stack_pos = stack_pos;
+    ir_gen(i->a);
+    gen_push(); /* store function address */
+    int call_addr = stack_pos - 1;
+    for (arg = i->b; arg >= 0; arg = ir[arg].next) {
+      ir_gen(arg);
+      gen_push();
+    }
+    gen_stack_addr(stack_pos - call_addr - 1);
+    gen_unref(TYPE_INTVAR);
+    gen_call();
+    if (currFunction) {
+      gen_call_cleanup(currFunction->nParams);
+    } else {
+        error("[line %d] Error: unexpected function exit\n",linenum);
+    }
+    /* remove function address and args */
+    gen_pop(stack_pos - prev_stack_pos);
+    stack_pos = prev_stack_pos;
+    break;
+  }
+  case IR_COPY:
+    ir_gen(i->a);
+    break;
+  case IR_TEST:
+    // the primary register holds the value of the IR_JOIN when jumping
+    ir_gen(i->a);
+    if (i->b && !ir_bool(i->a)) {
+      gen_push();
+      gen_const(0);
+      gen_binop(T_NE);
+    }
+    code_barrier();
+    if (i->b) {
+      emit(GEN_JNZ, GEN_JNZSZ);
+    } else {
+      emit(GEN_JZ, GEN_JZSZ);
+    }
+    ir_jump(t);
+    break;
+  case IR_JOIN:
+    ir_gen(i->a);
+    ir_gen(i->b);
+    if (!ir_bool(i->b)) {
+      gen_push();
+      gen_const(0);
+      gen_binop(T_NE);
+    }
+    ir_label(i->k);
+    break;
+  }
+}
+
+/* generate a jump taken if the value t is not zero (nz) or zero (!nz); a
+   comparison is not made into 0 or 1 first if the backend can jump on it */
+static void ir_gen_jump(int t, int nz) {
+#ifdef GEN_CMP
+  struct insn *i = &ir[t];
+  if (i->op == IR_BIN && ir_bool(t)) {
+    ir_gen(i->a);
+    gen_push();
+    ir_gen(i->b);
+    emit(GEN_CMP, GEN_CMPSZ);
+    stack_pos = stack_pos - 1; // GEN_CMP pops
+    code_barrier();
+    switch (i->k) {
+    case '<':  if (nz) emit(GEN_JLT, GEN_JLTSZ); else emit(GEN_JGE, GEN_JGESZ); break;
+    case T_LE: if (nz) emit(GEN_JLE, GEN_JLESZ); else emit(GEN_JGT, GEN_JGTSZ); break;
+    case T_EQ: if (nz) emit(GEN_JEQ, GEN_JEQSZ); else emit(GEN_JNE, GEN_JNESZ); break;
+    case T_NE: if (nz) emit(GEN_JNE, GEN_JNESZ); else emit(GEN_JEQ, GEN_JEQSZ); break;
+    }
+    return;
+  }
+#endif
+  ir_gen(t);
+  code_barrier();
+  if (nz) {
+    emit(GEN_JNZ, GEN_JNZSZ);
+  } else {
+    emit(GEN_JZ, GEN_JZSZ);
+  }
+}
+
+/* generate the code of the current function */
+static void ir_lower() {
+  int t;
+  peepbar = codepos;
+  for (t = 0; t < irpos; t++) {
+    struct insn *i = &ir[t];
+    switch (i->op) {
+    case IR_PUSH:
+      if (i->a >= 0) {
+        ir_gen(i->a);
+      }
+      gen_push(); // make room for new local variable
+      i->sym->addr = stack_pos - 1;
+      break;
+    case IR_JZ:
+    case IR_JNZ:
+      ir_gen_jump(i->a, i->op == IR_JNZ);
+      ir_jump(t);
+      break;
+    case IR_JMP:
+      code_barrier();
+      emit(GEN_JMP, GEN_JMPSZ);
+      ir_jump(t);
+      break;
+    case IR_LABEL:
+      ir_label(i->k);
+      if (i->a) {
+        gen_loop_start(); // jumped to from below
+      }
+      break;
+#ifdef GEN_JTAB
+    case IR_JTAB:
+      ir_gen(i->a);
+      ir_jtab(i->k);
+      break;
+#endif
+    case IR_RET:
+      if (i->a >= 0) {
+        ir_gen(i->a);
+      }
+      gen_pop(stack_pos); // remove all locals from stack (except return address)
+      gen_ret(i->k);
+      break;
+    case IR_MARK:
+      marks[i->k] = stack_pos;
+      break;
+    case IR_RESTORE:
+      gen_pop(stack_pos - marks[i->k]);
+      stack_pos = marks[i->k];
+      break;
+    case IR_SETSP:
+      stack_pos = marks[i->k];
+      break;
+    case IR_PREAMBLE:
+      gen_preamble(i->k);
+      break;
+    default:
+      if (i->root) {
+        ir_gen(t);
+      }
+    }
+  }
+  code_barrier();
+}
+#endif
+
+/* generate the code of the current function, in registers if the backend
+   has them */
+static void lower() {
+#ifdef GEN_NREGS
+#ifdef GEN_REGS_ONLY
+  int nregs = (optlevel > 0) ? GEN_NREGS : 0; // -O0 keeps everything in memory
+#else
+  int nregs = (optlevel > 0) ? GEN_NREGS : -1;
+#endif
+  if (nregs >= 0) {
+    regalloc(nregs);
+    peepbar = codepos;
+    gen_function();
+    code_barrier();
+    return;
+  }
+#endif
+#ifndef GEN_REGS_ONLY
+  ir_lower();
+#endif
+}
+
+static void statement();
+
+/* the statement of a loop, break goes to label brk and continue to cont */
+static void loop_body(int brk, int cont) {
+  int b = brklabel, c = contlabel, bm = brkmark, cm = contmark, m = new_mark();
+  brklabel = brk;
+  contlabel = cont;
+  brkmark = contmark = m;
+  statement();
+  lastIsReturn = 0; // the loop may still end
+  brklabel = b;
+  contlabel = c;
+  brkmark = bm;
+  contmark = cm;
+  ir_emit(IR_SETSP, -1, -1, m); // the statement may end with a return
+}
+
+/* a loop tested at the bottom, step runs at its end if not NULL; entered
+   through the test unless the condition n is missing or always true */
+static void rotated_loop(struct node *n, struct node *step) {
+  int body = new_label(), test = new_label(), end = new_label();
+  int next = step ? new_label() : test;
+  if (n && (n->kind != N_NUM || n->val == 0)) {
+    ir_emit(IR_JMP, -1, -1, test);
+  }
+  ir_emit(IR_LABEL, 1, -1, body);
+  loop_body(end, next);
+  if (step) {
+    int t;
+    ir_emit(IR_LABEL, 0, -1, next);
+    t = ir_value(step); // may move ir
+    ir[t].root = 1;
+  }
+  ir_emit(IR_LABEL, 0, -1, test);
+  if (n) {
+    ir_cond(n, 1, body);
+  } else {
+    ir_emit(IR_JMP, -1, -1, body);
+  }
+  ir_emit(IR_LABEL, 0, -1, end);
+}
+
+#define JTAB_MINCASES 4  /* fewer cases are compared one by one */
+#define JTAB_MAXSPAN  3  /* entries per case a jump table may have at most */
+
+static int case_cmp(const void *p, const void *q) {
+  const struct swcase *x = p, *y = q;
+  return (x->val > y->val) - (x->val < y->val);
+}
+
+/* jump to the case of cases[lo..hi), sorted, that the switch value in var
+   selects, or to deflabel; the value is known to be in [min, max] */
+static void ir_switch(struct sym *var, int lo, int hi, int min, int max) {
+  int n = hi - lo, j;
+  if (n == 0) {
+    ir_emit(IR_JMP, -1, -1, deflabel);
+    return;
+  }
+#ifdef GEN_JTAB
+  unsigned span = (unsigned) cases[hi - 1].val - (unsigned) cases[lo].val;
+  if (n >= JTAB_MINCASES && span / JTAB_MAXSPAN < (unsigned) n) {
+    int k = njtab, v = ir_sym(IR_LOADVAR, var, -1);
+    if (cases[lo].val > min) {
+      ir_emit(IR_JNZ, ir_emit(IR_BIN, v, ir_emit(IR_CONST, -1, -1, cases[lo].val), '<'), -1,
+              deflabel);
+      v = ir_sym(IR_LOADVAR, var, -1);
+    }
+    if (cases[hi - 1].val < max) {
+      ir_emit(IR_JZ, ir_emit(IR_BIN, v, ir_emit(IR_CONST, -1, -1, cases[hi - 1].val), T_LE), -1,
+              deflabel);
+      v = ir_sym(IR_LOADVAR, var, -1);
+    }
+    if (cases[lo].val != 0) {
+      v = ir_emit(IR_BIN, v, ir_emit(IR_CONST, -1, -1, cases[lo].val), '-');
+    }
+    njtab += span + 2;
+    jtab = grow(jtab, &jtabsz, njtab, sizeof(int));
+    jtab[k] = span + 1;
+    for (j = 1; j <= (int) span + 1; j++) {
+      jtab[k + j] = deflabel;
+    }
+    for (j = lo; j < hi; j++) {
+      jtab[k + 1 + (cases[j].val - cases[lo].val)] = cases[j].label;
+    }
+    ir_emit(IR_JTAB, v, -1, k);
+    return;
+  }
+#endif
+  if (n < JTAB_MINCASES) {
+    for (j = lo; j < hi; j++) {
+      int v = ir_sym(IR_LOADVAR, var, -1);
+      v = ir_emit(IR_BIN, v, ir_emit(IR_CONST, -1, -1, cases[j].val), T_EQ);
+      ir_emit(IR_JNZ, v, -1, cases[j].label);
+    }
+    ir_emit(IR_JMP, -1, -1, deflabel);
+    return;
+  }
+  // binary search
+  int mid = lo + n / 2, upper = new_label();
+  int v = ir_sym(IR_LOADVAR, var, -1);
+  ir_emit(IR_JZ, ir_emit(IR_BIN, v, ir_emit(IR_CONST, -1, -1, cases[mid].val), '<'), -1, upper);
+  ir_switch(var, lo, mid, min, cases[mid].val - 1);
+  ir_emit(IR_LABEL, 0, -1, upper);
+  ir_switch(var, mid, hi, cases[mid].val, max);
+}
+
+/* break or continue: pop back to mark m and go to label l */
+static void jump_out(int l, int m) {
+  int here = new_mark();
+  if (l < 0) {
+    error("[line %d] Error: %s outside a loop\n", linenum, tok);
+  }
+  readtok();
+  expect(__LINE__,';');
+  ir_emit(IR_RESTORE, sympos, sympos, m);
+  ir_emit(IR_JMP, -1, -1, l);
+  ir_emit(IR_SETSP, -1, -1, here);
+}
+
+static void statement() {
+  lastIsReturn = 0;
+  if (accept('{')) {
+    int m = new_mark();
+    int start = sympos;
+    scope_push();
+    while (accept('}') == 0) {
+      statement();
+    }
+    ir_emit(IR_RESTORE, start, sympos, m);
+    scope_pop();
+    genPreamble = 0;
+    numPreambleVars = 0;
+    return;
+  }
+  if (typename()) {
+    struct sym *var = sym_declare(tokname, 'L', 0);
+    int v = -1;
+    trace("GENERATE_VAR %s\n",tok);
+    readtok();
+    if (accept('=')) {
+      trace("HERE 2=\n");
+      v = expr();
+    }
+    numPreambleVars++;
+    ir_sym(IR_PUSH, var, v);
+    expect(__LINE__,';');
+    return;
+  }
+  // if we arrive here, we can generate the preamble
+  if (genPreamble) {
+    genPreamble = 0;
+    trace("Generate Preamble (nvars = %d)\n",numPreambleVars);
+    ir_emit(IR_PREAMBLE, -1, -1, numPreambleVars);
+  }
+
+  if (accept(T_IF)) {
+    int l1 = new_label(), l2 = new_label();
+    expect(__LINE__,'(');
+    cond(0, l1);
+    expect(__LINE__,')');
+    int m = new_mark();
+    statement();
+    ir_emit(IR_JMP, -1, -1, l2);
+    ir_emit(IR_LABEL, 0, -1, l1);
+    if (accept(T_ELSE)) {
+      ir_emit(IR_SETSP, -1, -1, m);
+      statement();
+    }
+    ir_emit(IR_SETSP, -1, -1, m);
+    ir_emit(IR_LABEL, 0, -1, l2);
+    return;
+  }
+  if (accept(T_WHILE)) {
+    int base = nodebase;
+    expect(__LINE__,'(');
+    struct node *n = hold_expr();
+    expect(__LINE__,')');
+    rotated_loop(n, NULL);
+    nodebase = base;
+    return;
+  }
+  if (accept(T_FOR)) {
+    int base = nodebase;
+    struct node *n = NULL, *step = NULL;
+    expect(__LINE__,'(');
+    if (accept(';') == 0) {
+      int t = expr(); // may move ir
+      ir[t].root = 1;
+      expect(__LINE__,';');
+    }
+    if (peek(';') == 0) {
+      n = hold_expr();
+    }
+    expect(__LINE__,';');
+    if (peek(')') == 0) {
+      step = hold_expr();
+    }
+    expect(__LINE__,')');
+    rotated_loop(n, step);
+    nodebase = base;
+    return;
+  }
+  if (accept(T_DO)) {
+    int body = new_label(), test = new_label(), end = new_label();
+    ir_emit(IR_LABEL, 1, -1, body);
+    loop_body(end, test);
+    expect(__LINE__,T_WHILE);
+    expect(__LINE__,'(');
+    ir_emit(IR_LABEL, 0, -1, test);
+    cond(1, body);
+    expect(__LINE__,')');
+    expect(__LINE__,';');
+    ir_emit(IR_LABEL, 0, -1, end);
+    return;
+  }
+  if (accept(T_SWITCH)) {
+    int m = new_mark(), start = sympos, j;
+    int b = brklabel, bm = brkmark, first = casefirst, cs = casescope, cm = casemark;
+    int def = deflabel;
+    int dispatch = new_label(), end = new_label();
+    expect(__LINE__,'(');
+    scope_push();
+    struct sym *var = sym_declare(intern("switch", 6), 'L', 0); // the value, hidden
+    ir_sym(IR_PUSH, var, expr());
+    expect(__LINE__,')');
+    ir_emit(IR_JMP, -1, -1, dispatch);
+    brklabel = end;
+    brkmark = casemark = new_mark();
+    casefirst = ncases;
+    casescope = sympos;
+    deflabel = -1;
+    statement();
+    lastIsReturn = 0;
+    ir_emit(IR_SETSP, -1, -1, casemark);
+    if (deflabel < 0) {
+      deflabel = new_label();
+      ir_emit(IR_LABEL, 2, -1, deflabel);
+    }
+    ir_emit(IR_JMP, -1, -1, end);
+    ir_emit(IR_SETSP, -1, -1, casemark);
+    ir_emit(IR_LABEL, 0, -1, dispatch);
+    qsort(cases + casefirst, ncases - casefirst, sizeof(*cases), case_cmp);
+    for (j = casefirst + 1; j < ncases; j++) {
+      if (cases[j].val == cases[j - 1].val) {
+        error("[line %d] Error: duplicate case value %d\n", linenum, cases[j].val);
+      }
+    }
+    ir_switch(var, casefirst, ncases, INT_MIN, INT_MAX);
+    ir_emit(IR_LABEL, 0, -1, end);
+    ir_emit(IR_RESTORE, start, sympos, m);
+    scope_pop();
+    ncases = casefirst;
+    brklabel = b;
+    brkmark = bm;
+    casefirst = first;
+    casescope = cs;
+    casemark = cm;
+    deflabel = def;
+    return;
+  }
+  if (peek(T_CASE) || peek(T_DEFAULT)) {
+    struct sym *s;
+    int l = new_label();
+    if (casefirst < 0) {
+      error("[line %d] Error: %s outside a switch\n", linenum, tok);
+    }
+    for (s = syms + casescope; s < syms + sympos; s++) {
+      if (s->depth >= 0) {
+        error("[line %d] Error: %s in the scope of '%s'\n", linenum, tok, s->name);
+      }
+    }
+    if (accept(T_DEFAULT)) {
+      if (deflabel >= 0) {
+        error("[line %d] Error: second default\n", linenum);
+      }
+      deflabel = l;
+    } else {
+      readtok();
+      nodepos = nodebase;
+      struct node *n = fold(parse_expr());
+      if (n->kind != N_NUM) {
+        error("[line %d] Error: case value is not a constant\n", linenum);
+      }
+      cases = grow(cases, &casesz, ncases + 1, sizeof(*cases));
+      cases[ncases].val = n->val;
+      cases[ncases++].label = l;
+    }
+    expect(__LINE__,':');
+    ir_emit(IR_SETSP, -1, -1, casemark);
+    ir_emit(IR_LABEL, 2, -1, l);
+    statement();
+    return;
+  }
+  if (peek(T_BREAK)) {
+    jump_out(brklabel, brkmark);
+    return;
+  }
+  if (peek(T_CONTINUE)) {
+    jump_out(contlabel, contmark);
+    return;
+  }
+  if (accept(T_RETURN)) {
+    int v = -1;
+    if (peek(';') == 0) {
+      v = expr();
+    }
+    expect(__LINE__,';');
+    lastIsReturn = 1;
+    ir_emit(IR_RET, v, -1, numPreambleVars);
     return;
   }
   // we should process an expression...
-  expr();
-  expect(__LINE__,";");
+  int e = expr(); // may move ir
+  ir[e].root = 1;
+  expect(__LINE__,';');
 }
 
 static void compile() {
-  while (tok[0] != 0) { // until EOF
+  while (peek(T_EOF) == 0) {
     if (typename() == 0) {
       error("[line %d] Error: type name expected\n",linenum);
     }
-    struct sym *var = sym_declare(context,tok, 'U', 0);
+    struct sym *var = sym_declare(tokname, 'U', 0);
     readtok();
-    if (accept(";")) {
+    if (accept(';')) {
       if (1==flagScanGlobalVars) {
         var->type = 'G';
         numGlobalVars++;
@@ -563,80 +2932,436 @@ static void compile() {
       gen_start(numGlobalVars);
       flagScanGlobalVars = 0;
     }
-    expect(__LINE__,"(");
+    expect(__LINE__,'(');
+    scope_push(); // parameters
     int argc = 0;
     for (;;) {
       argc++;
       if (typename() == 0) {
         break;
       }
-      printf("GEN_PARM_VAR %s_%s\n",var->name,tok);
-      sym_declare(var->name,tok, 'L', -argc-1);
+      trace("GEN_PARM_VAR %s_%s\n",var->name,tok);
+      sym_declare(tokname, 'L', -argc-1);
       readtok();
-      if (peek(")")) {
+      if (peek(')')) {
         break;
       }
-      expect(__LINE__,",");
+      expect(__LINE__,',');
     }
-    expect(__LINE__,")");
-    if (accept(";") == 0) {
-      if (strcmp(context,"")!=0 ) {
-        error("");
-      }
+    expect(__LINE__,')');
+    if (accept(';') == 0) {
       stack_pos = 0;
       var->addr = codepos;
       var->type = 'F';
       var->nParams = argc;
       gen_sym(var);
-      printf("FUNCTION: %s with %d params\n",var->name, argc);
-      strcpy(context,var->name);
+      trace("FUNCTION: %s with %d params\n",var->name, argc);
       genPreamble = 1;
       numPreambleVars = 0;
       currFunction = var;
+      irpos = nlabels = nmarks = njtab = nodebase = ncases = 0;
+      brklabel = contlabel = casefirst = -1;
       statement(); // function body
       if (!lastIsReturn) {
-        gen_ret(numPreambleVars);   // issue a ret if user forgets to put 'return'
+        ir_emit(IR_RET, -1, -1, numPreambleVars); // issue a ret if user forgets to put 'return'
       }
+      double t = 0;
+      stats_lap(&t);
+      optimize();
+      counts.opt += stats_lap(&t);
+      if (_debug) {
+        ir_dump();
+      }
+      lower();
+      counts.gen += stats_lap(&t);
     }
+    scope_pop();
+    code_flush(); // all jumps inside the function are patched by now
   }
 }
 
-int main(int argc, char *argv[]) {
-  int ii;
+//
+// LIBRARY
+//
+// cucu_compile() compiles a unit in a context from cucu_new().  Each unit
+// starts from the state a fresh process has; the buffers are kept to save
+// growing them again.
 
-  strcpy(context,"");
-  if (argc>1) {
-    _debug = 1;
-  } else {
-    _debug = 0;
+/* forget the last unit */
+static void unit_reset() {
+  while (strchunks != NULL) {
+    char *next = *(char **) strchunks;
+    free(strchunks);
+    strchunks = next;
   }
-  
-  f = stdin;
-  // prefetch first char and first token
-  nextc = fgetc(f);
-  if ('\n'==nextc) {linenum++;}
+  memset(ctx, 0, offsetof(struct cucu_ctx, opts));
+  linenum = 1;
+  codehold = -1;
+  flagScanGlobalVars = 1;
+  gen_reset();
+}
+
+/* print the --stats report of the unit, total seconds long */
+static void stats_report(double total) {
+  FILE *f = (ctx->errout != NULL) ? ctx->errout : stderr;
+  fprintf(f, "stats:\n");
+  fprintf(f, "  lex       %10.6f s\n", counts.lex);
+  fprintf(f, "  parse     %10.6f s\n", total - counts.lex - counts.opt - counts.gen);
+  fprintf(f, "  optimize  %10.6f s\n", counts.opt);
+  fprintf(f, "  codegen   %10.6f s\n", counts.gen);
+  fprintf(f, "  total     %10.6f s\n", total);
+  fprintf(f, "  tokens    %10ld\n", counts.tokens);
+  fprintf(f, "  sym_find  %10ld calls, %ld compares\n", counts.symfinds, counts.symcmps);
+  fprintf(f, "  symbols   %10ld\n", counts.symbols);
+  fprintf(f, "  emit      %10ld calls, %ld bytes\n", counts.emits, counts.emitbytes);
+  fprintf(f, "  gen_patch %10ld fixups\n", counts.patches);
+}
+
+/* compile the source at srcp, writing to out; errors longjmp out of here */
+static void unit_run() {
+  double start = 0, t;
+  int ii;
+
+  trace("**********\n");
+  trace("* Output *\n");
+  trace("**********\n");
+  trace("\n");
+
+  stats_lap(&start);
+  lex_init();
+  // prefetch first token
   readtok();
   compile();
-  //_load_immediate(0xffaaba94); printf("\n");
-  //_load_immediate(0x000aba94); printf("\n");
-  //_load_immediate(0xcd0);      printf("\n");
+  t = 0;
+  stats_lap(&t);
+  gen_finish();
+  counts.gen += stats_lap(&t);
 
   if (_debug) {
-    printf("\n");
-    printf("****************\n");
-    printf("* Symbol Table *\n");
-    printf("****************\n");
-    printf("NAME\t\tADDR\t\tTYPE\n");
+    fprintf(out, "\n");
+    fprintf(out, "****************\n");
+    fprintf(out, "* Symbol Table *\n");
+    fprintf(out, "****************\n");
+    fprintf(out, "NAME\t\tADDR\t\tTYPE\n");
     for (ii=0; ii<sympos; ii++) {
-      printf("%s\t\t0x%08x\t\t%c\n",sym[ii].name, sym[ii].addr, sym[ii].type);
+      fprintf(out, "%s\t\t0x%08x\t\t%c\n",syms[ii].name, syms[ii].addr, syms[ii].type);
     }
-    printf("\n");
+    fprintf(out, "\n");
+    fprintf(out, "PEEPHOLE: %d rewrites\n", peeprewrites);
   }
-  printf("**********\n");
-  printf("* Output *\n");
-  printf("**********\n");
-  printf("\n");
-  gen_finish();
-	return 0;
+  if (_stats) {
+    stats_report(stats_lap(&start));
+  }
+}
+
+/* compile the source at srcp, writing to f; -1 if it failed */
+static int unit_compile(FILE *f) {
+  if (setjmp(ctx->onerror)) {
+    ctx->guarded = 0;
+    return -1;
+  }
+  ctx->guarded = 1;
+  out = f;
+  unit_run();
+  ctx->guarded = 0;
+  return 0;
+}
+
+/* the scanners are shared by all the contexts */
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static void scan_setup() {
+  scan_init(SCAN_AVX2);
+}
+
+struct cucu_ctx *cucu_new(const struct cucu_opts *opts) {
+  struct cucu_ctx *c = calloc(1, sizeof(*c));
+  if (c == NULL) {
+    return NULL;
+  }
+  pthread_once(&scan_once, scan_setup);
+  ctx = c;
+  c->opts = *opts;
+  syms = calloc(MAXSYMBOLS, sizeof(struct sym));
+  nodes = calloc(MAXNODES, sizeof(struct node));
+  if (syms == NULL || nodes == NULL) {
+    cucu_free(c);
+    return NULL;
+  }
+  return c;
 }
 
+int cucu_compile(struct cucu_ctx *c, const char *s, size_t len, FILE *f) {
+  ctx = c;
+  unit_reset();
+  if (len >= srcbufsz) {
+    char *p = realloc(srcbuf, len + 1);
+    if (p == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return -1;
+    }
+    srcbuf = p;
+    srcbufsz = len + 1;
+  }
+  memcpy(srcbuf, s, len);
+  srcbuf[len] = '\0';
+  srcp = srcbuf;
+  srcend = srcbuf + len;
+  return unit_compile(f);
+}
+
+void cucu_free(struct cucu_ctx *c) {
+  if (c == NULL) {
+    return;
+  }
+  ctx = c;
+  unit_reset();
+  free(syms);
+  free(nodes);
+  free(srcbuf);
+  free(code);
+  free(ir);
+  free(labels);
+  free(marks);
+  free(cases);
+  free(jtab);
+  free(touched);
+  free(ivs);
+  free(ncalls);
+  free(ldepth);
+  free(c);
+  ctx = NULL;
+}
+
+#ifndef CUCU_LIB
+//
+// DRIVER
+//
+// Several files are compiled by a pool of threads, each with a context of
+// its own.  The output and the errors of a unit are kept in memory until
+// the units before it are written, so they come out in the order of the
+// command line however the threads are scheduled.
+struct unit {
+  char *path;
+  char *output, *errors;
+  size_t outputsz, errorssz;
+  int status;        /* 0 if compiled */
+  int done;
+};
+
+static struct unit *units;
+static int nunits;
+static int nextunit = 0;  /* next unit for a thread to take */
+static pthread_mutex_t unitlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t unitdone = PTHREAD_COND_INITIALIZER;
+
+/* read the file into *buf of *sz bytes, growing it; -1 if it cannot */
+static long read_file(char *path, char **buf, size_t *sz) {
+  FILE *in = fopen(path, "rb");
+  size_t n = 0, k;
+  if (in == NULL) {
+    return -1;
+  }
+  for (;;) {
+    if (n == *sz) {
+      *sz = *sz ? *sz * 2 : 65536;
+      *buf = realloc(*buf, *sz);
+      if (*buf == NULL) {
+        error("Out of memory\n");
+      }
+    }
+    k = fread(*buf + n, 1, *sz - n, in);
+    if (k == 0) {
+      break;
+    }
+    n += k;
+  }
+  fclose(in);
+  return n;
+}
+
+static void *unit_worker(void *arg) {
+  struct cucu_ctx *c = arg;
+  char *text = NULL;
+  size_t textsz = 0;
+  for (;;) {
+    struct unit *u;
+    FILE *f, *e;
+    long n;
+
+    pthread_mutex_lock(&unitlock);
+    u = (nextunit < nunits) ? &units[nextunit++] : NULL;
+    pthread_mutex_unlock(&unitlock);
+    if (u == NULL) {
+      break;
+    }
+    f = open_memstream(&u->output, &u->outputsz);
+    e = open_memstream(&u->errors, &u->errorssz);
+    if (f == NULL || e == NULL) {
+      error("Out of memory\n");
+    }
+    n = read_file(u->path, &text, &textsz);
+    if (n < 0) {
+      fprintf(e, "Cannot open %s\n", u->path);
+      u->status = 1;
+    } else {
+      c->errout = e;
+      u->status = cucu_compile(c, text, n, f) != 0;
+      c->errout = NULL;
+    }
+    fclose(f);
+    fclose(e);
+
+    pthread_mutex_lock(&unitlock);
+    u->done = 1;
+    pthread_cond_broadcast(&unitdone);
+    pthread_mutex_unlock(&unitlock);
+  }
+  free(text);
+  return NULL;
+}
+
+/* compile the files on up to nthreads threads, writing their output to
+   stdout in order; returns 1 if any of them failed */
+static int compile_files(char **paths, int npaths, int nthreads, struct cucu_opts *opts) {
+  pthread_t *threads;
+  struct cucu_ctx **ctxs;
+  int i, status = 0;
+
+  if (nthreads > npaths) {
+    nthreads = npaths;
+  }
+  units = calloc(npaths, sizeof(*units));
+  threads = calloc(nthreads, sizeof(*threads));
+  ctxs = calloc(nthreads, sizeof(*ctxs));
+  if (units == NULL || threads == NULL || ctxs == NULL) {
+    error("Out of memory\n");
+  }
+  for (i = 0; i < npaths; i++) {
+    units[i].path = paths[i];
+  }
+  nunits = npaths;
+  for (i = 0; i < nthreads; i++) {
+    ctxs[i] = cucu_new(opts);
+    if (ctxs[i] == NULL) {
+      error("Out of memory\n");
+    }
+    if (pthread_create(&threads[i], NULL, unit_worker, ctxs[i]) != 0) {
+      error("Cannot start a thread\n");
+    }
+  }
+  for (i = 0; i < npaths; i++) {
+    struct unit *u = &units[i];
+    pthread_mutex_lock(&unitlock);
+    while (!u->done) {
+      pthread_cond_wait(&unitdone, &unitlock);
+    }
+    pthread_mutex_unlock(&unitlock);
+    fwrite(u->output, 1, u->outputsz, stdout);
+    fflush(stdout);
+    if (u->errorssz > 0) {
+      fprintf(stderr, "%s: %.*s", u->path, (int) u->errorssz, u->errors);
+    }
+    free(u->output);
+    free(u->errors);
+    status |= u->status;
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+    cucu_free(ctxs[i]);
+  }
+  free(ctxs);
+  free(threads);
+  free(units);
+  return status;
+}
+
+// usage: cucu [-d] [-O0|-O1|-O2] [-c out.o | --run] [--trace] [--stats] [-j n]
+//             [file.c ...]
+//   -d       print tokens, the intermediate code and the symbol table
+//   -On      optimization level: 0 none (default), 1 copy propagation,
+//            dead store elimination and registers (if the backend has
+//            them), 2 also common subexpressions
+//   -c out.o write an object file instead of assembly (if the backend
+//            can; the zpu backend writes the raw image, the dummy one
+//            its code without the diagnostics)
+//   --run    run main in memory and exit with its result (if the backend
+//            can)
+//   --trace  print the parser's diagnostics (symbols, variables, functions)
+//            along with the code
+//   --stats  print the time spent lexing, parsing, optimizing and
+//            generating code, and counters of the hot paths, to stderr
+//   -j n     compile the files on n threads (default 1); their outputs
+//            follow each other in the order of the files, and the errors
+//            are prefixed with the file name
+//   file.c   source to compile, stdin if omitted or "-"; -c and --run
+//            take a single one
+int main(int argc, char *argv[]) {
+  struct cucu_opts opts = {0, 0, NULL, 0, 0};
+  int ii, run = 0, jobs = 1, npaths = 0;
+  char **paths = calloc(argc, sizeof(char *));
+
+  if (paths == NULL) {
+    error("Out of memory\n");
+  }
+  for (ii = 1; ii < argc; ii++) {
+    if (strcmp(argv[ii], "-d") == 0) {
+      opts.debug = 1;
+    } else if (argv[ii][0] == '-' && argv[ii][1] == 'O' && argv[ii][2] >= '0' &&
+               argv[ii][2] <= '2' && argv[ii][3] == '\0') {
+      opts.optimize = argv[ii][2] - '0';
+    } else if (strcmp(argv[ii], "-c") == 0 && ii + 1 < argc) {
+      opts.object = argv[++ii];
+    } else if (strcmp(argv[ii], "--run") == 0) {
+      run = 1;
+    } else if (strcmp(argv[ii], "--trace") == 0) {
+      opts.trace = 1;
+    } else if (strcmp(argv[ii], "--stats") == 0) {
+      opts.stats = 1;
+    } else if (strcmp(argv[ii], "-j") == 0 && ii + 1 < argc && atoi(argv[ii + 1]) > 0) {
+      jobs = atoi(argv[++ii]);
+    } else if (argv[ii][0] != '-') {
+      paths[npaths++] = argv[ii];
+    } else if (strcmp(argv[ii], "-") != 0) {
+      error("usage: %s [-d] [-O0|-O1|-O2] [-c out.o | --run] [--trace] [--stats] [-j n] "
+            "[file.c ...]\n", argv[0]);
+    }
+  }
+#ifndef GEN_OBJECT
+  if (opts.object != NULL) {
+    error("%s: the backend cannot write object files\n", argv[0]);
+  }
+#endif
+#ifndef GEN_JIT
+  if (run) {
+    error("%s: the backend cannot run code on this machine\n", argv[0]);
+  }
+#endif
+  if (opts.object != NULL && run) {
+    error("%s: -c and --run exclude each other\n", argv[0]);
+  }
+  if (npaths > 1) {
+    if (opts.object != NULL || run) {
+      error("%s: -c and --run take a single file\n", argv[0]);
+    }
+    return compile_files(paths, npaths, jobs, &opts);
+  }
+
+  if (cucu_new(&opts) == NULL) {
+    error("Out of memory\n");
+  }
+  runjit = run;
+  unit_reset();
+  src_open(paths[0]);
+  if (unit_compile(stdout) != 0) {
+    return 1;
+  }
+#ifdef GEN_JIT
+  if (runjit) {
+    fflush(stdout);
+    return gen_run();
+  }
+#endif
+	return 0;
+}
+#endif
@@ -0,0 +1,34 @@
+/*
+ * libcucu: the compiler as a library.
+ *
+ * A context holds everything a compilation changes, so a tool can compile
+ * any number of units in one process: each cucu_compile() starts from a
+ * clean context, as a fresh cucu process would.  The backend is the one
+ * the library was built with (libcucu-<backend>.a).
+ */
+#ifndef CUCU_H
+#define CUCU_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+struct cucu_opts {
+  int optimize;       /* -O level: 0, 1 or 2 */
+  int debug;          /* -d: trace tokens, intermediate code and symbols */
+  const char *object; /* -c: object file to write, if the backend can */
+  int trace;          /* --trace: the parser's diagnostics go along with the code */
+  int stats;          /* --stats: phase times and counters after each unit */
+};
+
+struct cucu_ctx;
+
+/* a new context, NULL if out of memory */
+struct cucu_ctx *cucu_new(const struct cucu_opts *opts);
+
+/* compile src[0..len), writing the assembly (or listing) to out; returns 0,
+   or -1 after printing the error to stderr, where --stats reports go too */
+int cucu_compile(struct cucu_ctx *ctx, const char *src, size_t len, FILE *out);
+
+void cucu_free(struct cucu_ctx *ctx);
+
+#endif
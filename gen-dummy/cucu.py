@@ -1,4 +1,7 @@
+import hashlib
+import os
 import subprocess
+import tempfile
 
 import time
 
@@ -7,24 +10,49 @@ import time
 #
 class CucuVM:
 	CUCU_PATH='./cucu-dummy'
-	def __init__(self, src, debug=False):
+	VM_PATH='./cucu-vm' # the native VM runs the code if it is built
+	cache = {} # compiled code and its decoding by compiler, options and source
+	def __init__(self, src, debug=False, opt=0):
 		self.A = 0
 		self.B = 0
 		self.PC = 0
 		self.SP = 16
 		self.mem = [0 for i in range(0, 16)]
-		self.compile(src.encode('ascii'))
+		self.compile(src.encode('ascii'), opt)
 		self.debug = debug
 		if debug:
 			print(self.code)
+		elif os.path.exists(self.VM_PATH):
+			self.run_native()
+			return
 		while (self.PC < len(self.code)):
 			self.step()
 			if debug:
 				self.dump()
 
-	def compile(self, src):
-		p = subprocess.Popen(self.CUCU_PATH, stdout=subprocess.PIPE, stdin=subprocess.PIPE)
-		self.code = p.communicate(input=src)[0]
+	def compile(self, src, opt=0):
+		# the tests compile the same snippets again and again
+		key = hashlib.sha1(('%s -O%d\n' % (self.CUCU_PATH, opt)).encode('ascii') + src).digest()
+		if key not in CucuVM.cache:
+			# the code goes to a file
+			with tempfile.NamedTemporaryFile() as f:
+				p = subprocess.Popen([self.CUCU_PATH, '-O%d' % opt, '-c', f.name],
+						stdout=subprocess.DEVNULL, stdin=subprocess.PIPE)
+				p.communicate(input=src)
+				code = f.read()
+			CucuVM.cache[key] = (code, self.decode(code))
+		self.code, self.prog = CucuVM.cache[key]
+
+	def run_native(self):
+		p = subprocess.Popen([self.VM_PATH, '-m', str(len(self.mem))], stdout=subprocess.PIPE,
+				stdin=subprocess.PIPE)
+		out = p.communicate(input=self.code)[0].decode('ascii').split('\n')
+		regs = dict(r.split('=') for r in out[0].split())
+		self.A = int(regs['A'], 16)
+		self.B = int(regs['B'], 16)
+		self.PC = int(regs['PC'], 16)
+		self.SP = int(regs['SP'], 16)
+		self.mem = [int(b, 16) for b in out[1].split()[1:]]
 
 	def getint(self, addr):
 		return self.mem[addr] + self.mem[addr+1] * 256
@@ -32,88 +60,117 @@ class CucuVM:
 		self.mem[addr] = n & 0xff
 		self.mem[addr+1] = (n & 0xff00) >> 8
 
+	# the code is decoded once into (handler, operand) pairs, one per line
+	def decode(self, code):
+		prog = []
+		for pc in range(0, len(code), 8):
+			op = code[pc:pc+8].decode('ascii')
+			if op[:7] in self.OPS:
+				prog.append((self.OPS[op[:7]], 0))
+			elif op[:3] in self.ARGOPS:
+				prog.append((self.ARGOPS[op[:3]], int(op[3:], 16)))
+			elif op.startswith(';'):
+				prog.append((CucuVM.op_nop, 0))
+			else:
+				prog.append((CucuVM.op_unknown, op))
+		return prog
+
 	def step(self):
-		op = (self.code[self.PC:self.PC+8]).decode('ascii')
+		handler, arg = self.prog[self.PC >> 3]
 		if (self.debug):
-			print("op", op)
+			print("op", (self.code[self.PC:self.PC+8]).decode('ascii'))
 		self.PC = self.PC + 8
-		if (op.startswith(';')):
-			return
-		elif (op.startswith('ret')):
-			try:
-				addr = self.getint(self.SP)
-				#addr = self.mem[self.SP+1]*256 + self.mem[self.SP]
-				self.SP = self.SP + 2
-				self.PC = addr
-			except IndexError:
-				self.PC = 0xffffff
-		elif (op.startswith('A:=m[A]')):
-			self.A = self.mem[self.A]
-		elif (op.startswith('A:=M[A]')):
-			self.A = self.getint(self.A)
-				#self.A = self.mem[self.A] + self.mem[self.A + 1] * 256
-		elif (op.startswith('m[B]:=A')):
-			self.mem[self.B] = self.A & 0xff
-		elif (op.startswith('M[B]:=A')):
-			self.putint(self.B, self.A)
-			#self.mem[self.B] = self.A & 0xff
-			#self.mem[self.B+1] = (self.A & 0xff00) >> 8
-		elif (op.startswith('push A')):
-			self.SP = self.SP - 2
-			self.putint(self.SP, self.A)
-			#self.mem[self.SP] = self.A & 0xff
-			#self.mem[self.SP+1] = (self.A & 0xff00) >> 8
-		elif (op.startswith('pop B')):
-			self.B = self.getint(self.SP)
-			#self.B = self.mem[self.SP+1]*256 + self.mem[self.SP]
+		handler(self, arg)
+
+	def op_nop(self, arg):
+		pass
+	def op_unknown(self, op):
+		print("UNKNOWN OPERATOR STRING: " + op)
+	def op_ret(self, arg):
+		try:
+			addr = self.getint(self.SP)
 			self.SP = self.SP + 2
-		elif (op.startswith('A:=B+A')):
-			self.A = (self.B + self.A) & 0xffff
-		elif (op.startswith('A:=B-A')):
-			self.A = (self.B - self.A) & 0xffff
-		elif (op.startswith('A:=B&A')):
-			self.A = (self.B & self.A) & 0xffff
-		elif (op.startswith('A:=B<<A')):
-			self.A = (self.B << self.A) & 0xffff
-		elif (op.startswith('A:=B>>A')):
-			self.A = (self.B >> self.A) & 0xffff
-		elif (op.startswith('A:=B|A')):
-			self.A = (self.B | self.A) & 0xffff
-		elif (op.startswith('A:=B<A')):
-			if self.A > self.B:
-				self.A = 1
-			else:
-				self.A = 0
-		elif (op.startswith('A:=B==A')):
-			if self.A == self.B:
-				self.A = 1
-			else:
-				self.A = 0
-		elif (op.startswith('A:=B!=A')):
-			if self.A != self.B:
-				self.A = 1
-			else:
-				self.A = 0
-		elif (op.startswith('pop')):
-			n = int(op[3:], 16)
-			self.SP = self.SP + n*2
-		elif (op.startswith('A:=')): 
-			self.A = int(op[3:], 16)
-		elif (op.startswith('sp@')): 
-			self.A = self.SP + int(op[3:], 16)*2 # TODO
-		elif (op.startswith('jmp')):
-			self.PC = int(op[3:], 16)
-		elif (op.startswith('jmz')):
-			if self.A == 0:
-				self.PC = int(op[3:], 16)
-		elif (op.startswith('call A')):
-			self.SP = self.SP - 2
-			self.putint(self.SP, self.PC)
-			#self.mem[self.SP] = (self.PC & 0xff)
-			#self.mem[self.SP+1] = ((self.PC & 0xff00) >> 8)
-			self.PC = self.A
-		else:
-			print("UNKNOWN OPERATOR STRING: " + op)
+			self.PC = addr
+		except IndexError:
+			self.PC = 0xffffff
+	def op_load8(self, arg):
+		self.A = self.mem[self.A]
+	def op_load(self, arg):
+		self.A = self.getint(self.A)
+	def op_store8(self, arg):
+		self.mem[self.B] = self.A & 0xff
+	def op_store(self, arg):
+		self.putint(self.B, self.A)
+	def op_push(self, arg):
+		self.SP = self.SP - 2
+		self.putint(self.SP, self.A)
+	def op_movb(self, arg):
+		self.B = self.A
+	def op_popb(self, arg):
+		self.B = self.getint(self.SP)
+		self.SP = self.SP + 2
+	def op_add(self, arg):
+		self.A = (self.B + self.A) & 0xffff
+	def op_sub(self, arg):
+		self.A = (self.B - self.A) & 0xffff
+	def op_and(self, arg):
+		self.A = (self.B & self.A) & 0xffff
+	def op_shl(self, arg):
+		self.A = (self.B << self.A) & 0xffff
+	def op_shr(self, arg):
+		self.A = (self.B >> self.A) & 0xffff
+	def op_or(self, arg):
+		self.A = (self.B | self.A) & 0xffff
+	def op_xor(self, arg):
+		self.A = (self.B ^ self.A) & 0xffff
+	def op_mul(self, arg):
+		self.A = (self.B * self.A) & 0xffff
+	def op_div(self, arg):
+		self.A = (self.B // self.A) & 0xffff
+	def op_mod(self, arg):
+		self.A = (self.B % self.A) & 0xffff
+	def op_less(self, arg):
+		self.A = 1 if self.A > self.B else 0
+	def op_le(self, arg):
+		self.A = 1 if self.A >= self.B else 0
+	def op_eq(self, arg):
+		self.A = 1 if self.A == self.B else 0
+	def op_ne(self, arg):
+		self.A = 1 if self.A != self.B else 0
+	def op_call(self, arg):
+		self.SP = self.SP - 2
+		self.putint(self.SP, self.PC)
+		self.PC = self.A
+	def op_lsp(self, n):
+		self.A = self.getint(self.SP + n*2)
+	def op_pop(self, n):
+		self.SP = self.SP + n*2
+	def op_const(self, n):
+		self.A = n
+	def op_spaddr(self, n):
+		self.A = self.SP + n*2
+	def op_jmp(self, addr):
+		self.PC = addr
+	def op_jmz(self, addr):
+		if self.A == 0:
+			self.PC = addr
+	def op_jnz(self, addr):
+		if self.A != 0:
+			self.PC = addr
+
+	OPS = {
+		'ret    ': op_ret, 'A:=m[A]': op_load8, 'A:=M[A]': op_load, 'm[B]:=A': op_store8,
+		'M[B]:=A': op_store, 'push A ': op_push, 'B:=A   ': op_movb, 'pop B  ': op_popb,
+		'A:=B+A ': op_add, 'A:=B-A ': op_sub, 'A:=B&A ': op_and, 'A:=B<<A': op_shl,
+		'A:=B>>A': op_shr, 'A:=B|A ': op_or, 'A:=B^A ': op_xor, 'A:=B*A ': op_mul,
+		'A:=B/A ': op_div, 'A:=B%A ': op_mod, 'A:=B<A ': op_less, 'A:=B==A': op_eq,
+		'A:=B!=A': op_ne, 'A:=B<=A': op_le, 'call A ': op_call,
+	}
+	# lines with a hex operand after the first three characters
+	ARGOPS = {
+		'lsp': op_lsp, 'pop': op_pop, 'A:=': op_const, 'sp@': op_spaddr,
+		'jmp': op_jmp, 'jmz': op_jmz, 'jnz': op_jnz,
+	}
 
 	def dump(self):
 		print("A:%04x  B:%04x   PC:%x  SP:%x" % (self.A, self.B, self.PC, self.SP))
@@ -1,7 +1,8 @@
 #define emits(s) emit(s, strlen(s))
 
 #define TYPE_NUM_SIZE 2
-static int mem_pos = 0;
+#define GEN_UNSIGNED /* words are unsigned, < and <= compare them so */
+static __thread int mem_pos = 0;
 
 #define GEN_ADD   "pop B  \nA:=B+A \n"
 #define GEN_ADDSZ strlen(GEN_ADD)
@@ -18,6 +19,9 @@ static int mem_pos = 0;
 #define GEN_LESS  "pop B  \nA:=B<A \n"
 #define GEN_LESSSZ strlen(GEN_LESS)
 
+#define GEN_LE    "pop B  \nA:=B<=A\n"
+#define GEN_LESZ strlen(GEN_LE)
+
 #define GEN_EQ "pop B  \nA:=B==A\n"
 #define GEN_EQSZ strlen(GEN_EQ)
 #define GEN_NEQ  "pop B  \nA:=B!=A\n"
@@ -27,6 +31,14 @@ static int mem_pos = 0;
 #define GEN_ORSZ strlen(GEN_OR)
 #define GEN_AND  "pop B  \nA:=B&A \n"
 #define GEN_ANDSZ strlen(GEN_AND)
+#define GEN_XOR "pop B  \nA:=B^A \n"
+#define GEN_XORSZ strlen(GEN_XOR)
+#define GEN_DIV "pop B  \nA:=B/A \n"
+#define GEN_DIVSZ strlen(GEN_DIV)
+#define GEN_MUL "pop B  \nA:=B*A \n"
+#define GEN_MULSZ strlen(GEN_MUL)
+#define GEN_MOD "pop B  \nA:=B%A \n"
+#define GEN_MODSZ strlen(GEN_MOD)
 
 #define GEN_ASSIGN "pop B  \nM[B]:=A\n"
 #define GEN_ASSIGNSZ strlen(GEN_ASSIGN)
@@ -38,17 +50,75 @@ static int mem_pos = 0;
 
 #define GEN_JZ "jmz....\n"
 #define GEN_JZSZ strlen(GEN_JZ)
+#define GEN_JNZ "jnz....\n"
+#define GEN_JNZSZ strlen(GEN_JNZ)
+
+/* B:=A keeps a left operand off the stack, lspNNNN loads stack slot NNNN */
+static struct rewrite gen_peephole[] = {
+	{"push A \nA:=\1\npop B  \n", "B:=A   \nA:=\1\n"},
+	{"push A \npop B  \n",         "B:=A   \n"},
+	{"sp@\1\nA:=M[A]\n",           "lsp\1\n"},
+	{NULL, NULL}
+};
+
+/* every operation is one step of the VM, nothing is worth rewriting */
+static struct cost gen_cost = {1, 1, 0, 1, 0, 1};
+
+static __thread int main_jmp = 0;
+
+/* -c writes the code alone, without the compiler's diagnostics */
+#define GEN_OBJECT
+static __thread FILE *objfile = NULL;
+
+static void gen_object(char *s, size_t len) {
+	if (fwrite(s, 1, len, objfile) != len) {
+		error("Error: cannot write %s\n", objpath);
+	}
+}
+
+static void gen_reset() {
+	mem_pos = 0;
+	main_jmp = 0;
+	if (objfile != NULL) {
+		fclose(objfile); /* the last unit failed */
+		objfile = NULL;
+	}
+}
 
 static void gen_start() {
+	if (objpath != NULL) {
+		objfile = fopen(objpath, "wb");
+		if (objfile == NULL) {
+			error("Error: cannot write %s\n", objpath);
+		}
+		code_sink = gen_object;
+	}
+	main_jmp = codepos + 3;
+	codehold = main_jmp; /* keep the entry jump until main is known */
 	emits("jmpCAFE\n");
 }
 
 static void gen_finish() {
-	struct sym *funcmain = sym_find("main");
-	char s[32];
-	sprintf(s, "%04x", funcmain->addr);
-	memcpy(code+3, s, 4);
-	printf("%s", code);
+	struct sym *funcmain = sym_find(intern("main", 4));
+	if (funcmain == NULL || funcmain->type != 'F') {
+		error("Error: could not find main function\n");
+	}
+	code_flush();
+	if (objfile != NULL) {
+		FILE *f = objfile;
+		objfile = NULL;
+		if (fclose(f) != 0) {
+			error("Error: cannot write %s\n", objpath);
+		}
+	}
+}
+
+static void gen_preamble(int n) {
+	(void) n;
+}
+
+static void gen_call_cleanup(int n) {
+	(void) n;
 }
 
 static void gen_ret() {
@@ -58,7 +128,7 @@ static void gen_ret() {
 
 static void gen_const(int n) {
 	char s[32];
-	sprintf(s, "A:=%04x\n", n);
+	sprintf(s, "A:=%04x\n", n & 0xffff); /* keeps the line 8 bytes long */
 	emits(s);
 }
 
@@ -67,6 +137,12 @@ static void gen_sym(struct sym *sym) {
 		sym->addr = mem_pos;
 		mem_pos = mem_pos + TYPE_NUM_SIZE;
 	}
+	if (sym->type == 'F' && sym->name == intern("main", 4)) {
+		char s[32];
+		sprintf(s, "%04x", sym->addr);
+		memcpy(code_at(main_jmp), s, 4);
+		codehold = -1;
+	}
 }
 
 static void gen_loop_start() {}
@@ -109,10 +185,10 @@ static void gen_call() {
 
 static void gen_array(char *array, int size) {
 	int i = size;
-	char *tok = array;
+	char *str = array;
 	/* put token on stack */
 	for (; i >= 0; i-=2) {
-		gen_const((tok[i] << 8 | tok[i-1]));
+		gen_const((str[i] << 8 | str[i-1]));
 		gen_push();
 	}
 	/* put token address on stack */
@@ -120,9 +196,9 @@ static void gen_array(char *array, int size) {
 }
 
 
-static void gen_patch(uint8_t *op, int value) {
+static void gen_patch(int op, int value) {
 	char s[32];
 	sprintf(s, "%04x", value);
-	memcpy(op-5, s, 4);
+	memcpy(code_at(op-5), s, 4);
 }
 
@@ -0,0 +1,251 @@
+/*
+ * cucu-vm: runs the code of the dummy backend (cucu-dummy -c file).
+ *
+ * The code is a sequence of 8 byte lines.  They are decoded once into an
+ * array of opcodes with their operand, jump targets turned into indexes,
+ * and the opcodes then into the addresses of their handlers, so that each
+ * handler jumps straight to the next one.  The machine is the one of
+ * gen-dummy/cucu.py: registers A and B, 16-bit words stored little endian
+ * and a stack growing down from the top of the 64K memory.  Code addresses
+ * (jump targets, return addresses, functions) are byte offsets into the
+ * code, as the backend wrote them.
+ *
+ * usage: cucu-vm [-m n] [file]
+ *   prints the registers and the first n bytes of memory once the program
+ *   returned from main; the code is read from stdin if there is no file
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define MEMSZ 0x10000
+#define INSNSZ 8
+
+enum {
+	OP_HALT, OP_CONST, OP_SPADDR, OP_LOADSP, OP_LOAD, OP_LOAD8, OP_STORE,
+	OP_STORE8, OP_PUSH, OP_POPB, OP_MOVB, OP_POP, OP_ADD, OP_SUB, OP_SHL,
+	OP_SHR, OP_LESS, OP_LE, OP_EQ, OP_NE, OP_OR, OP_AND, OP_XOR, OP_MUL,
+	OP_DIV, OP_MOD, OP_JMP, OP_JZ, OP_JNZ, OP_CALL, OP_RET, OP_NOP
+};
+
+/* the lines without an operand */
+static struct {
+	char *line;
+	int op;
+} vm_ops[] = {
+	{"A:=m[A]", OP_LOAD8}, {"A:=M[A]", OP_LOAD}, {"m[B]:=A", OP_STORE8},
+	{"M[B]:=A", OP_STORE}, {"push A ", OP_PUSH}, {"pop B  ", OP_POPB},
+	{"B:=A   ", OP_MOVB}, {"A:=B+A ", OP_ADD}, {"A:=B-A ", OP_SUB},
+	{"A:=B<<A", OP_SHL}, {"A:=B>>A", OP_SHR}, {"A:=B<A ", OP_LESS},
+	{"A:=B<=A", OP_LE}, {"A:=B==A", OP_EQ}, {"A:=B!=A", OP_NE},
+	{"A:=B|A ", OP_OR}, {"A:=B&A ", OP_AND}, {"A:=B^A ", OP_XOR},
+	{"A:=B*A ", OP_MUL}, {"A:=B/A ", OP_DIV}, {"A:=B%A ", OP_MOD},
+	{"call A ", OP_CALL}, {"ret    ", OP_RET}, {NULL, 0}
+};
+
+/* the lines with a hex operand after their first three characters */
+static struct {
+	char *prefix;
+	int op;
+} vm_argops[] = {
+	{"A:=", OP_CONST}, {"sp@", OP_SPADDR}, {"lsp", OP_LOADSP}, {"pop", OP_POP},
+	{"jmp", OP_JMP}, {"jmz", OP_JZ}, {"jnz", OP_JNZ}, {NULL, 0}
+};
+
+struct insn {
+	void *handler;
+	int op;
+	unsigned arg;
+};
+
+static struct insn *prog;
+static int nprog;
+static unsigned char mem[MEMSZ + 1];
+static unsigned A, B, SP, PC;
+
+static void error(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	exit(1);
+}
+
+static unsigned getint(unsigned addr) {
+	addr &= 0xffff;
+	return mem[addr] | mem[addr + 1] << 8;
+}
+
+static void putint(unsigned addr, unsigned n) {
+	addr &= 0xffff;
+	mem[addr] = n & 0xff;
+	mem[addr + 1] = (n >> 8) & 0xff;
+}
+
+/* index of the line at code offset off */
+static int target(unsigned off) {
+	if (off % INSNSZ != 0 || off / INSNSZ > (unsigned) nprog) {
+		error("cucu-vm: bad code address 0x%x\n", off);
+	}
+	return off / INSNSZ;
+}
+
+static void decode(char *code, int len) {
+	int i, j;
+	if (len % INSNSZ != 0) {
+		error("cucu-vm: the code is not made of %d byte lines\n", INSNSZ);
+	}
+	nprog = len / INSNSZ;
+	prog = calloc(nprog + 1, sizeof(struct insn)); /* ends with OP_HALT */
+	if (prog == NULL) {
+		error("cucu-vm: out of memory\n");
+	}
+	for (i = 0; i < nprog; i++) {
+		char *s = code + i * INSNSZ;
+		struct insn *in = &prog[i];
+		if (s[INSNSZ - 1] != '\n') {
+			error("cucu-vm: bad line %d: '%.*s'\n", i, INSNSZ, s);
+		}
+		s[INSNSZ - 1] = '\0';
+		if (s[0] == ';') {
+			in->op = OP_NOP;
+			continue;
+		}
+		for (j = 0; vm_ops[j].line != NULL && strcmp(s, vm_ops[j].line) != 0; j++);
+		if (vm_ops[j].line != NULL) {
+			in->op = vm_ops[j].op;
+			continue;
+		}
+		for (j = 0; vm_argops[j].prefix != NULL && strncmp(s, vm_argops[j].prefix, 3) != 0; j++);
+		if (vm_argops[j].prefix == NULL) {
+			error("cucu-vm: unknown instruction '%s'\n", s);
+		}
+		in->op = vm_argops[j].op;
+		in->arg = strtoul(s + 3, NULL, 16);
+	}
+	for (i = 0; i < nprog; i++) {
+		if (prog[i].op == OP_JMP || prog[i].op == OP_JZ || prog[i].op == OP_JNZ) {
+			prog[i].arg = target(prog[i].arg);
+		}
+	}
+}
+
+/* run from the first line until main returns */
+static void run() {
+	static void *handlers[] = {
+		&&op_halt, &&op_const, &&op_spaddr, &&op_loadsp, &&op_load, &&op_load8,
+		&&op_store, &&op_store8, &&op_push, &&op_popb, &&op_movb, &&op_pop,
+		&&op_add, &&op_sub, &&op_shl, &&op_shr, &&op_less, &&op_le, &&op_eq,
+		&&op_ne, &&op_or, &&op_and, &&op_xor, &&op_mul, &&op_div, &&op_mod,
+		&&op_jmp, &&op_jz, &&op_jnz, &&op_call, &&op_ret, &&op_nop
+	};
+	struct insn *ip;
+	int i;
+
+	for (i = 0; i <= nprog; i++) {
+		prog[i].handler = handlers[prog[i].op];
+	}
+	SP = MEMSZ;
+	ip = prog;
+
+#define NEXT() do { ip++; goto *ip->handler; } while (0)
+#define JUMP(i) do { ip = &prog[i]; goto *ip->handler; } while (0)
+
+	goto *ip->handler;
+op_const:  A = ip->arg; NEXT();
+op_spaddr: A = SP + ip->arg * 2; NEXT();
+op_loadsp: A = getint(SP + ip->arg * 2); NEXT();
+op_load:   A = getint(A); NEXT();
+op_load8:  A = mem[A & 0xffff]; NEXT();
+op_store:  putint(B, A); NEXT();
+op_store8: mem[B & 0xffff] = A & 0xff; NEXT();
+op_push:   SP -= 2; putint(SP, A); NEXT();
+op_popb:   B = getint(SP); SP += 2; NEXT();
+op_movb:   B = A; NEXT();
+op_pop:    SP += ip->arg * 2; NEXT();
+op_add:    A = (B + A) & 0xffff; NEXT();
+op_sub:    A = (B - A) & 0xffff; NEXT();
+op_shl:    A = (A < 16) ? (B << A) & 0xffff : 0; NEXT();
+op_shr:    A = (A < 32) ? (B >> A) & 0xffff : 0; NEXT();
+op_less:   A = B < A; NEXT();
+op_le:     A = B <= A; NEXT();
+op_eq:     A = B == A; NEXT();
+op_ne:     A = B != A; NEXT();
+op_or:     A = (B | A) & 0xffff; NEXT();
+op_and:    A = (B & A) & 0xffff; NEXT();
+op_xor:    A = (B ^ A) & 0xffff; NEXT();
+op_mul:    A = (B * A) & 0xffff; NEXT();
+op_div:
+	if (A == 0) {
+		error("cucu-vm: division by zero at 0x%x\n", (int) (ip - prog) * INSNSZ);
+	}
+	A = (B / A) & 0xffff;
+	NEXT();
+op_mod:
+	if (A == 0) {
+		error("cucu-vm: division by zero at 0x%x\n", (int) (ip - prog) * INSNSZ);
+	}
+	A = (B % A) & 0xffff;
+	NEXT();
+op_jmp:    JUMP(ip->arg);
+op_jz:     if (A == 0) JUMP(ip->arg); NEXT();
+op_jnz:    if (A != 0) JUMP(ip->arg); NEXT();
+op_call:
+	SP -= 2;
+	putint(SP, (ip - prog + 1) * INSNSZ);
+	JUMP(target(A));
+op_ret:
+	if (SP >= MEMSZ) {
+		PC = ip - prog; /* main returned */
+		return;
+	}
+	i = getint(SP);
+	SP += 2;
+	JUMP(target(i));
+op_nop:    NEXT();
+op_halt:
+	PC = ip - prog;
+	return;
+}
+
+int main(int argc, char *argv[]) {
+	FILE *f = stdin;
+	char *code = NULL;
+	int i, len = 0, size = 0, n, dump = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			dump = atoi(argv[++i]);
+		} else if (f == stdin && strcmp(argv[i], "-") != 0) {
+			f = fopen(argv[i], "rb");
+			if (f == NULL) {
+				error("cucu-vm: cannot open %s\n", argv[i]);
+			}
+		} else {
+			error("usage: %s [-m n] [file]\n", argv[0]);
+		}
+	}
+	do {
+		if (len == size) {
+			size += 4096;
+			code = realloc(code, size);
+			if (code == NULL) {
+				error("cucu-vm: out of memory\n");
+			}
+		}
+		n = fread(code + len, 1, size - len, f);
+		len += n;
+	} while (n > 0);
+
+	decode(code, len);
+	run();
+
+	printf("A=%04x B=%04x PC=%x SP=%x\n", A, B, PC * INSNSZ, SP);
+	printf("mem");
+	for (i = 0; i < dump && i < MEMSZ; i++) {
+		printf(" %02x", mem[i]);
+	}
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,789 @@
+/*
+ * Assembler for the instructions the x86 backends emit, so that -c can
+ * write an ELF relocatable object without gas and --run can execute the
+ * code in memory.  The code is assembled as it is flushed.  Branches and
+ * calls to labels in .text are fixed up in place once everything is known;
+ * references to data, and absolute references to code, become relocations
+ * against the section symbols, or are applied when the code is mapped.
+ * The x86-64 backend defines ASM_64 to 1 before including this file.
+ */
+#include <elf.h>
+
+#ifndef ASM_64
+#define ASM_64 0
+#endif
+
+#define ASM_TEXT  0
+#define ASM_DATA  1
+#define ASM_NSECT 2
+#define ASMHASHSZ 1024 /* number of hash buckets, must be a power of 2 */
+
+/* growable byte buffer */
+struct asm_buf {
+	unsigned char *buf;
+	int len, size;
+};
+
+static __thread struct asm_buf asm_sect[ASM_NSECT];
+static __thread int asm_cur = ASM_TEXT;
+
+static __thread struct asm_label {
+	char *name;   /* interned */
+	int sect;     /* -1 until defined */
+	int off;
+	int global;
+	struct asm_label *next; /* next label in the same hash bucket */
+} *asm_labels[ASMHASHSZ];
+
+static __thread struct asm_fixup {
+	int sect, off;           /* 32-bit field holding the addend */
+	struct asm_label *label;
+	int pcrel;
+	int reloc;               /* left to the linker or the loader */
+} *asm_fixups = NULL;
+static __thread int asm_nfixups = 0;
+static __thread int asm_fixupsz = 0;
+
+static __thread struct asm_buf asm_line; /* incomplete last line */
+static __thread int asm_ripfield = -1;   /* %rip relative field of the current instruction */
+
+#define OP_REG 0
+#define OP_IMM 1
+#define OP_MEM 2
+#define ASM_RIP 16 /* base register of %rip relative addresses */
+struct asm_op {
+	int kind;
+	int reg;                 /* register, or base of OP_MEM (-1: absolute) */
+	int size;                /* of OP_REG, in bytes */
+	int val;                 /* immediate or displacement */
+	struct asm_label *sym;   /* added to val */
+	int star;                /* indirect call or jump */
+};
+
+static struct {
+	char *name;
+	int reg, size;
+} asm_regs[] = {
+	{"eax", 0, 4}, {"ecx", 1, 4}, {"edx", 2, 4}, {"ebx", 3, 4},
+	{"esp", 4, 4}, {"ebp", 5, 4}, {"esi", 6, 4}, {"edi", 7, 4},
+	{"al", 0, 1}, {"cl", 1, 1}, {"dl", 2, 1}, {"bl", 3, 1},
+	/* x86-64 only */
+	{"rax", 0, 8}, {"rcx", 1, 8}, {"rdx", 2, 8}, {"rbx", 3, 8},
+	{"rsp", 4, 8}, {"rbp", 5, 8}, {"rsi", 6, 8}, {"rdi", 7, 8},
+	{"r8", 8, 8}, {"r9", 9, 8}, {"r10", 10, 8}, {"r11", 11, 8},
+	{"r12", 12, 8}, {"r13", 13, 8}, {"r14", 14, 8}, {"r15", 15, 8},
+	{"rip", ASM_RIP, 8},
+	{NULL, 0, 0}
+};
+
+/* kinds up to I_TEST take two operands, I_BYTE none, the others one */
+enum {
+	I_ALU, I_MOV, I_MOVZB, I_IMUL, I_SHIFT, I_LEA, I_TEST, I_UNARY, I_SET,
+	I_JCC, I_JMP, I_CALL, I_PUSH, I_POP, I_BYTE
+};
+
+/* the operation is the /digit of group opcodes, the condition of setcc and
+   jcc, or the opcode of instructions without operands */
+static struct {
+	char *name;
+	int kind, op;
+} asm_insns[] = {
+	{"add", I_ALU, 0}, {"or", I_ALU, 1}, {"and", I_ALU, 4}, {"sub", I_ALU, 5},
+	{"xor", I_ALU, 6}, {"cmp", I_ALU, 7},
+	{"mov", I_MOV, 0}, {"movzx", I_MOVZB, 0}, {"movzb", I_MOVZB, 0},
+	{"imul", I_IMUL, 0}, {"shl", I_SHIFT, 4}, {"shr", I_SHIFT, 5}, {"sar", I_SHIFT, 7},
+	{"lea", I_LEA, 0},
+	{"not", I_UNARY, 2}, {"neg", I_UNARY, 3}, {"idiv", I_UNARY, 7}, {"test", I_TEST, 0},
+	{"setb", I_SET, 0x2}, {"setae", I_SET, 0x3}, {"sete", I_SET, 0x4}, {"setne", I_SET, 0x5},
+	{"setbe", I_SET, 0x6}, {"seta", I_SET, 0x7}, {"setl", I_SET, 0xc}, {"setge", I_SET, 0xd},
+	{"setle", I_SET, 0xe}, {"setg", I_SET, 0xf},
+	{"jb", I_JCC, 0x2}, {"jae", I_JCC, 0x3}, {"je", I_JCC, 0x4}, {"jne", I_JCC, 0x5},
+	{"jbe", I_JCC, 0x6}, {"ja", I_JCC, 0x7}, {"jl", I_JCC, 0xc}, {"jge", I_JCC, 0xd},
+	{"jle", I_JCC, 0xe}, {"jg", I_JCC, 0xf},
+	{"jmp", I_JMP, 0}, {"call", I_CALL, 0}, {"push", I_PUSH, 0}, {"pop", I_POP, 0},
+	{"cltd", I_BYTE, 0x99}, {"cqto", I_BYTE, 0x4899}, {"ret", I_BYTE, 0xc3},
+	{"nop", I_BYTE, 0x90},
+	{NULL, 0, 0}
+};
+
+static void asm_put(struct asm_buf *b, void *p, int len) {
+	if (b->len + len > b->size) {
+		while (b->len + len > b->size) {
+			b->size += CODECHUNKSZ;
+		}
+		b->buf = realloc(b->buf, b->size);
+		if (b->buf == NULL) {
+			error("Out of memory\n");
+		}
+	}
+	memcpy(b->buf + b->len, p, len);
+	b->len += len;
+}
+
+static void asm_b(int c) {
+	unsigned char u = c;
+	asm_put(&asm_sect[asm_cur], &u, 1);
+}
+
+static void asm_d(int v) {
+	asm_b(v);
+	asm_b(v >> 8);
+	asm_b(v >> 16);
+	asm_b(v >> 24);
+}
+
+static int asm_get(unsigned char *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned) p[3] << 24;
+}
+
+static void asm_set(unsigned char *p, int v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static struct asm_label *asm_label(char *name, int len) {
+	char *s = intern(name, len);
+	struct asm_label **bucket = &asm_labels[str_hash(s) & (ASMHASHSZ - 1)], *l;
+	for (l = *bucket; l != NULL; l = l->next) {
+		if (l->name == s) {
+			return l;
+		}
+	}
+	l = calloc(1, sizeof(*l));
+	if (l == NULL) {
+		error("Out of memory\n");
+	}
+	l->name = s;
+	l->sect = -1;
+	l->next = *bucket;
+	*bucket = l;
+	return l;
+}
+
+/* 32-bit field: v plus the address of label, if any */
+static void asm_field(int v, struct asm_label *label, int pcrel) {
+	if (label != NULL) {
+		if (asm_nfixups == asm_fixupsz) {
+			asm_fixupsz += 256;
+			asm_fixups = realloc(asm_fixups, asm_fixupsz * sizeof(*asm_fixups));
+			if (asm_fixups == NULL) {
+				error("Out of memory\n");
+			}
+		}
+		asm_fixups[asm_nfixups].sect = asm_cur;
+		asm_fixups[asm_nfixups].off = asm_sect[asm_cur].len;
+		asm_fixups[asm_nfixups].label = label;
+		asm_fixups[asm_nfixups].pcrel = pcrel;
+		asm_nfixups++;
+	}
+	asm_d(v);
+}
+
+static int asm_isname(int c) {
+	return isalnum(c) || c == '_' || c == '.';
+}
+
+static char *asm_skip(char *s) {
+	while (*s == ' ' || *s == '\t') {
+		s++;
+	}
+	return s;
+}
+
+/* parse an operand, s ends at its comma or at the end of the line */
+static void asm_operand(char *s, char *line, struct asm_op *op) {
+	char *e;
+	int i;
+	memset(op, 0, sizeof(*op));
+	s = asm_skip(s);
+	if (*s == '*') {
+		op->star = 1;
+		s++;
+	}
+	if (*s == '%') {
+		s++;
+		for (i = 0; asm_regs[i].name != NULL; i++) {
+			e = asm_regs[i].name;
+			if (strncmp(s, e, strlen(e)) == 0 && !asm_isname(s[strlen(e)]) &&
+			    (ASM_64 || asm_regs[i].size < 8)) {
+				op->kind = OP_REG;
+				op->reg = asm_regs[i].reg;
+				op->size = asm_regs[i].size;
+				return;
+			}
+		}
+		error("Error: bad register in '%s'\n", line);
+	}
+	op->kind = OP_MEM;
+	op->reg = -1;
+	if (*s == '$') {
+		op->kind = OP_IMM;
+		s++;
+	}
+	if (isdigit(*s) || *s == '-') {
+		op->val = strtol(s, &e, 0);
+		s = e;
+	} else if (asm_isname(*s)) {
+		for (e = s; asm_isname(*e); e++);
+		op->sym = asm_label(s, e - s);
+		s = e;
+	}
+	if (op->kind == OP_MEM && *s == '(') {
+		struct asm_op base;
+		asm_operand(s + 1, line, &base);
+		if (base.kind != OP_REG || base.size != (ASM_64 ? 8 : 4) ||
+		    (op->sym != NULL && base.reg != ASM_RIP)) {
+			error("Error: bad address in '%s'\n", line);
+		}
+		op->reg = base.reg;
+	}
+}
+
+/* ModRM byte (and SIB and displacement) for the register or memory rm */
+static void asm_modrm(struct asm_op *rm, int r) {
+	int mod, base = rm->reg & 7;
+	if (rm->kind == OP_REG) {
+		asm_b(0xc0 | r << 3 | base);
+		return;
+	}
+	if (rm->reg < 0 || rm->reg == ASM_RIP) {
+		if (rm->reg < 0 && ASM_64) {
+			error("Error: absolute address in 64-bit code\n");
+		}
+		asm_b(0x05 | r << 3);
+		if (rm->reg == ASM_RIP) {
+			asm_ripfield = asm_sect[asm_cur].len;
+			asm_field(rm->val - 4, rm->sym, 1);
+		} else {
+			asm_field(rm->val, rm->sym, 0);
+		}
+		return;
+	}
+	mod = (rm->val == 0 && base != 5) ? 0 : (rm->val >= -128 && rm->val < 128) ? 1 : 2;
+	asm_b(mod << 6 | r << 3 | base);
+	if (base == 4) {
+		asm_b(0x24); // %esp and %r12 need a SIB byte
+	}
+	if (mod == 1) {
+		asm_b(rm->val);
+	} else if (mod == 2) {
+		asm_d(rm->val);
+	}
+}
+
+/* the REX prefix, if needed, then the opcode (two bytes if above 0xff) */
+static void asm_opcode(int w, int r, int b, int opcode) {
+	int rex = 0x40 | w << 3 | (r & 8) >> 1 | (b & 8) >> 3;
+	if (rex != 0x40) {
+		asm_b(rex);
+	}
+	if (opcode > 0xff) {
+		asm_b(opcode >> 8);
+	}
+	asm_b(opcode);
+}
+
+/* instruction with a ModRM operand rm, r in the reg field */
+static void asm_rm(int w, int opcode, struct asm_op *rm, int r) {
+	asm_opcode(w, r, (rm->reg >= 0 && rm->reg != ASM_RIP) ? rm->reg : 0, opcode);
+	asm_modrm(rm, r & 7);
+}
+
+/* immediate of an instruction, 8 or 32 bits */
+static void asm_imm(struct asm_op *op, int imm8) {
+	if (imm8) {
+		asm_b(op->val);
+	} else {
+		asm_field(op->val, op->sym, 0);
+	}
+}
+
+static int asm_imm8(struct asm_op *op) {
+	return op->sym == NULL && op->val >= -128 && op->val < 128;
+}
+
+static void asm_directive(char *s, char *line) {
+	char *e;
+	int n;
+	if (strncmp(s, ".text", 5) == 0) {
+		asm_cur = ASM_TEXT;
+	} else if (strncmp(s, ".data", 5) == 0) {
+		asm_cur = ASM_DATA;
+	} else if (strncmp(s, ".globl", 6) == 0) {
+		s = asm_skip(s + 6);
+		for (e = s; asm_isname(*e); e++);
+		asm_label(s, e - s)->global = 1;
+	} else if (strncmp(s, ".align", 6) == 0) {
+		n = strtol(s + 6, NULL, 0);
+		while (n > 0 && asm_sect[asm_cur].len % n != 0) {
+			asm_b(asm_cur == ASM_TEXT ? 0x90 : 0);
+		}
+	} else if (strncmp(s, ".long", 5) == 0 || strncmp(s, ".quad", 5) == 0) {
+		struct asm_op op;
+		asm_operand(s + 5, line, &op);
+		if (s[1] == 'q' && op.sym != NULL) {
+			error("Error: cannot assemble '%s'\n", line);
+		}
+		asm_field(op.val, op.sym, 0);
+		if (s[1] == 'q') {
+			asm_d(op.val < 0 ? -1 : 0);
+		}
+	} else if (strncmp(s, ".section .note.GNU-stack", 24) == 0) {
+		// objects written here never ask for an executable stack
+	} else if (strncmp(s, ".string", 7) == 0) {
+		s = asm_skip(s + 7);
+		if (*s++ != '"') {
+			error("Error: bad string in '%s'\n", line);
+		}
+		while (*s != '"') {
+			if (*s == '\0') {
+				error("Error: bad string in '%s'\n", line);
+			}
+			if (*s != '\\') {
+				asm_b(*s++);
+			} else if (s[1] == 'x') {
+				asm_b(strtoul(s + 2, &s, 16));
+			} else if (s[1] >= '0' && s[1] <= '7') {
+				for (n = 0, s++; *s >= '0' && *s <= '7'; s++) {
+					n = n * 8 + *s - '0';
+				}
+				asm_b(n);
+			} else {
+				asm_b(s[1] == 'n' ? '\n' : s[1] == 't' ? '\t' : s[1]);
+				s += 2;
+			}
+		}
+		asm_b(0);
+	} else {
+		error("Error: cannot assemble '%s'\n", line);
+	}
+}
+
+/* index of the instruction s[0..len) in asm_insns, -1 if unknown */
+static int asm_find(char *s, int len) {
+	int i;
+	for (i = 0; asm_insns[i].name != NULL; i++) {
+		if (strncmp(asm_insns[i].name, s, len) == 0 && asm_insns[i].name[len] == '\0') {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void asm_insn(char *s, char *line) {
+	struct asm_op ops[2], *src = &ops[0], *dst = &ops[1];
+	char *e;
+	int i, n, w, op, size = 0;
+
+	for (e = s; isalnum(*e); e++);
+	i = asm_find(s, e - s);
+	if (i < 0 && e - s > 1 && (e[-1] == 'l' || e[-1] == 'b' || (ASM_64 && e[-1] == 'q'))) {
+		// operand size suffix
+		size = (e[-1] == 'b') ? 1 : (e[-1] == 'l') ? 4 : 8;
+		i = asm_find(s, e - s - 1);
+	}
+	if (i < 0) {
+		error("Error: cannot assemble '%s'\n", line);
+	}
+
+	for (n = 0, s = asm_skip(e); *s != '\0'; n++) {
+		if (n == 2) {
+			error("Error: too many operands in '%s'\n", line);
+		}
+		asm_operand(s, line, &ops[n]);
+		for (; *s != '\0' && *s != ','; s++);
+		if (*s == ',') {
+			s++;
+		}
+	}
+	if (n == 1) {
+		dst = src;
+	}
+	if (n != (asm_insns[i].kind <= I_TEST ? 2 : asm_insns[i].kind == I_BYTE ? 0 : 1) &&
+	    !(asm_insns[i].kind == I_IMUL && n == 1)) {
+		error("Error: wrong number of operands in '%s'\n", line);
+	}
+	if (size == 0) {
+		size = (dst->kind == OP_REG) ? dst->size : (src->kind == OP_REG) ? src->size : 4;
+	}
+	w = (size == 8);
+	op = asm_insns[i].op;
+
+	asm_ripfield = -1;
+	switch (asm_insns[i].kind) {
+	case I_ALU:
+		if (src->kind == OP_IMM) {
+			asm_rm(w, asm_imm8(src) ? 0x83 : 0x81, dst, op);
+			asm_imm(src, asm_imm8(src));
+		} else if (src->kind == OP_REG) {
+			asm_rm(w, op * 8 + 1, dst, src->reg);
+		} else if (dst->kind == OP_REG) {
+			asm_rm(w, op * 8 + 3, src, dst->reg);
+		} else {
+			error("Error: bad operands in '%s'\n", line);
+		}
+		break;
+	case I_MOV:
+		if (src->kind == OP_IMM && dst->kind == OP_REG && size == 4) {
+			asm_opcode(0, 0, dst->reg, 0xb8 + (dst->reg & 7));
+			asm_imm(src, 0);
+		} else if (src->kind == OP_IMM && size != 1) {
+			asm_rm(w, 0xc7, dst, 0);
+			asm_imm(src, 0);
+		} else if (src->kind == OP_REG) {
+			asm_rm(w, size == 1 ? 0x88 : 0x89, dst, src->reg);
+		} else if (src->kind == OP_MEM && dst->kind == OP_REG) {
+			asm_rm(w, size == 1 ? 0x8a : 0x8b, src, dst->reg);
+		} else {
+			error("Error: bad operands in '%s'\n", line);
+		}
+		break;
+	case I_MOVZB:
+	case I_LEA:
+		if (dst->kind != OP_REG || src->kind == OP_IMM ||
+		    (asm_insns[i].kind == I_LEA && src->kind != OP_MEM)) {
+			error("Error: bad operands in '%s'\n", line);
+		}
+		asm_rm(w, asm_insns[i].kind == I_LEA ? 0x8d : 0x0fb6, src, dst->reg);
+		break;
+	case I_IMUL:
+		if (n == 1) { // %edx:%eax = %eax * dst
+			asm_rm(w, 0xf7, dst, 5);
+			break;
+		}
+		if (dst->kind != OP_REG) {
+			error("Error: bad operands in '%s'\n", line);
+		}
+		if (src->kind == OP_IMM) {
+			asm_rm(w, asm_imm8(src) ? 0x6b : 0x69, dst, dst->reg);
+			asm_imm(src, asm_imm8(src));
+		} else {
+			asm_rm(w, 0x0faf, src, dst->reg);
+		}
+		break;
+	case I_SHIFT:
+		if (src->kind == OP_IMM) {
+			asm_rm(w, 0xc1, dst, op);
+			asm_b(src->val);
+		} else if (src->kind == OP_REG && src->reg == 1 && src->size == 1) {
+			asm_rm(w, 0xd3, dst, op);
+		} else {
+			error("Error: bad operands in '%s'\n", line);
+		}
+		break;
+	case I_UNARY:
+		asm_rm(w, 0xf7, dst, op);
+		break;
+	case I_TEST:
+		if (src->kind != OP_REG) {
+			error("Error: bad operands in '%s'\n", line);
+		}
+		asm_rm(w, 0x85, dst, src->reg);
+		break;
+	case I_SET:
+		asm_rm(0, 0x0f90 + op, dst, 0);
+		break;
+	case I_JCC:
+	case I_JMP:
+	case I_CALL:
+		if (dst->star) {
+			asm_rm(0, 0xff, dst, asm_insns[i].kind == I_CALL ? 2 : 4);
+			break;
+		}
+		if (dst->kind != OP_MEM || dst->reg >= 0) {
+			error("Error: bad target in '%s'\n", line);
+		}
+		if (asm_insns[i].kind == I_JCC) {
+			asm_opcode(0, 0, 0, 0x0f80 + op);
+		} else {
+			asm_b(asm_insns[i].kind == I_CALL ? 0xe8 : 0xe9);
+		}
+		asm_field(dst->val - 4, dst->sym, 1);
+		break;
+	case I_PUSH:
+		if (dst->kind == OP_REG) {
+			asm_opcode(0, 0, dst->reg, 0x50 + (dst->reg & 7));
+		} else if (dst->kind == OP_IMM) {
+			asm_b(asm_imm8(dst) ? 0x6a : 0x68);
+			asm_imm(dst, asm_imm8(dst));
+		} else {
+			asm_rm(0, 0xff, dst, 6);
+		}
+		break;
+	case I_POP:
+		if (dst->kind == OP_REG) {
+			asm_opcode(0, 0, dst->reg, 0x58 + (dst->reg & 7));
+		} else {
+			asm_rm(0, 0x8f, dst, 0);
+		}
+		break;
+	case I_BYTE:
+		asm_opcode(0, 0, 0, op);
+		break;
+	}
+
+	// %rip is the end of the instruction, past any immediate
+	if (asm_ripfield >= 0) {
+		unsigned char *p = asm_sect[asm_cur].buf + asm_ripfield;
+		asm_set(p, asm_get(p) - (asm_sect[asm_cur].len - (asm_ripfield + 4)));
+	}
+}
+
+static void asm_assemble(char *line) {
+	char *s = asm_skip(line), *e;
+	for (e = s + strlen(s); e > s && isspace(e[-1]); e--);
+	*e = '\0';
+	if (*s == '\0') {
+		return;
+	}
+	if (e[-1] == ':') {
+		struct asm_label *l = asm_label(s, e - 1 - s);
+		if (l->sect >= 0) {
+			error("Error: label '%s' defined twice\n", l->name);
+		}
+		l->sect = asm_cur;
+		l->off = asm_sect[asm_cur].len;
+	} else if (*s == '.') {
+		asm_directive(s, line);
+	} else {
+		asm_insn(s, line);
+	}
+}
+
+/* forget the last unit, keeping the buffers */
+static void asm_reset() {
+	int i;
+	for (i = 0; i < ASMHASHSZ; i++) {
+		while (asm_labels[i] != NULL) {
+			struct asm_label *l = asm_labels[i];
+			asm_labels[i] = l->next;
+			free(l);
+		}
+	}
+	for (i = 0; i < ASM_NSECT; i++) {
+		asm_sect[i].len = 0;
+	}
+	asm_cur = ASM_TEXT;
+	asm_nfixups = 0;
+	asm_line.len = 0;
+	asm_ripfield = -1;
+}
+
+/* code sink: assemble the complete lines */
+static void asm_code(char *s, size_t len) {
+	char *nl;
+	while ((nl = memchr(s, '\n', len)) != NULL) {
+		asm_put(&asm_line, s, nl - s + 1);
+		asm_line.buf[asm_line.len - 1] = '\0';
+		asm_assemble((char *) asm_line.buf);
+		asm_line.len = 0;
+		len -= nl - s + 1;
+		s = nl + 1;
+	}
+	asm_put(&asm_line, s, len);
+}
+
+#if defined(GEN_OBJECT) || defined(GEN_JIT)
+/* add the label offsets to the fixups and settle those relative to their
+   own section; the others are left as relocations */
+static void asm_resolve() {
+	int i;
+	for (i = 0; i < asm_nfixups; i++) {
+		struct asm_fixup *x = &asm_fixups[i];
+		unsigned char *p = asm_sect[x->sect].buf + x->off;
+		int v = asm_get(p) + x->label->off;
+		if (x->label->sect < 0) {
+			error("Error: undefined symbol '%s'\n", x->label->name);
+		}
+		x->reloc = !(x->pcrel && x->label->sect == x->sect);
+		asm_set(p, x->reloc ? v : v - x->off);
+	}
+}
+#endif
+
+#ifdef GEN_OBJECT
+/* index of name in the string table */
+static int asm_str(struct asm_buf *strtab, char *name) {
+	int off = strtab->len;
+	asm_put(strtab, name, strlen(name) + 1);
+	return off;
+}
+
+/* write the object, with symbols for the functions and globals */
+static void asm_write(const char *path) {
+	static char *names[] = {"", ".text", ".data", ".rel.text", ".rel.data", ".symtab", ".strtab",
+	                        ".shstrtab", ".note.GNU-stack"};
+	struct asm_buf rel[ASM_NSECT], symtab, strtab, shstrtab, file;
+	Elf32_Shdr sh[9];
+	Elf32_Ehdr eh;
+	Elf32_Sym es;
+	Elf32_Rel er;
+	int i, j, global, nlocal = 0;
+	FILE *f;
+
+	memset(rel, 0, sizeof(rel));
+	memset(&symtab, 0, sizeof(symtab));
+	memset(&strtab, 0, sizeof(strtab));
+	memset(&shstrtab, 0, sizeof(shstrtab));
+	memset(&file, 0, sizeof(file));
+	asm_str(&strtab, "");
+
+	// section symbols, then the local and the global symbols
+	memset(&es, 0, sizeof(es));
+	asm_put(&symtab, &es, sizeof(es));
+	for (j = 0; j < ASM_NSECT; j++) {
+		es.st_info = ELF32_ST_INFO(STB_LOCAL, STT_SECTION);
+		es.st_shndx = 1 + j;
+		asm_put(&symtab, &es, sizeof(es));
+	}
+	for (global = 0; global <= 1; global++) {
+		if (global) {
+			nlocal = symtab.len / sizeof(es);
+		}
+		for (i = 0; i < sympos; i++) {
+			struct asm_label *l;
+			if (syms[i].type != 'F' && syms[i].type != 'G') {
+				continue;
+			}
+			l = asm_label(syms[i].name, strlen(syms[i].name));
+			if (l->sect < 0 || l->global != global) {
+				continue;
+			}
+			es.st_name = asm_str(&strtab, l->name);
+			es.st_value = l->off;
+			es.st_size = (syms[i].type == 'G') ? TYPE_NUM_SIZE : 0;
+			es.st_info = ELF32_ST_INFO(global ? STB_GLOBAL : STB_LOCAL,
+			                           syms[i].type == 'F' ? STT_FUNC : STT_OBJECT);
+			es.st_shndx = 1 + l->sect;
+			asm_put(&symtab, &es, sizeof(es));
+		}
+	}
+
+	asm_resolve();
+	for (i = 0; i < asm_nfixups; i++) {
+		struct asm_fixup *x = &asm_fixups[i];
+		if (x->reloc) {
+			er.r_offset = x->off;
+			er.r_info = ELF32_R_INFO(1 + x->label->sect, x->pcrel ? R_386_PC32 : R_386_32);
+			asm_put(&rel[x->sect], &er, sizeof(er));
+		}
+	}
+
+	memset(sh, 0, sizeof(sh));
+	for (i = 0; i < 9; i++) {
+		sh[i].sh_name = asm_str(&shstrtab, names[i]);
+		sh[i].sh_addralign = (i == 0) ? 0 : (i == 8) ? 1 : 4;
+	}
+	sh[1].sh_type = SHT_PROGBITS;
+	sh[1].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+	sh[2].sh_type = SHT_PROGBITS;
+	sh[2].sh_flags = SHF_ALLOC | SHF_WRITE;
+	for (j = 0; j < ASM_NSECT; j++) {
+		sh[3 + j].sh_type = SHT_REL;
+		sh[3 + j].sh_link = 5;
+		sh[3 + j].sh_info = 1 + j;
+		sh[3 + j].sh_entsize = sizeof(er);
+	}
+	sh[5].sh_type = SHT_SYMTAB;
+	sh[5].sh_link = 6;
+	sh[5].sh_info = nlocal;
+	sh[5].sh_entsize = sizeof(es);
+	sh[6].sh_type = SHT_STRTAB;
+	sh[7].sh_type = SHT_STRTAB;
+	sh[8].sh_type = SHT_PROGBITS;
+
+	// the sections follow the header, the section headers come last
+	memset(&eh, 0, sizeof(eh));
+	asm_put(&file, &eh, sizeof(eh));
+	for (i = 1; i < 9; i++) {
+		struct asm_buf *b = (i <= 2) ? &asm_sect[i - 1] : (i <= 4) ? &rel[i - 3] :
+		                    (i == 5) ? &symtab : (i == 6) ? &strtab : (i == 7) ? &shstrtab : NULL;
+		while (file.len % 4 != 0) {
+			asm_put(&file, "", 1);
+		}
+		sh[i].sh_offset = file.len;
+		if (b != NULL) {
+			sh[i].sh_size = b->len;
+			asm_put(&file, b->buf, b->len);
+		}
+	}
+	while (file.len % 4 != 0) {
+		asm_put(&file, "", 1);
+	}
+	memcpy(eh.e_ident, ELFMAG, SELFMAG);
+	eh.e_ident[EI_CLASS] = ELFCLASS32;
+	eh.e_ident[EI_DATA] = ELFDATA2LSB;
+	eh.e_ident[EI_VERSION] = EV_CURRENT;
+	eh.e_type = ET_REL;
+	eh.e_machine = EM_386;
+	eh.e_version = EV_CURRENT;
+	eh.e_shoff = file.len;
+	eh.e_ehsize = sizeof(eh);
+	eh.e_shentsize = sizeof(sh[0]);
+	eh.e_shnum = 9;
+	eh.e_shstrndx = 7;
+	memcpy(file.buf, &eh, sizeof(eh));
+	asm_put(&file, sh, sizeof(sh));
+
+	f = fopen(path, "wb");
+	if (f == NULL || fwrite(file.buf, 1, file.len, f) != (size_t) file.len || fclose(f) != 0) {
+		error("Error: cannot write '%s'\n", path);
+	}
+	for (j = 0; j < ASM_NSECT; j++) {
+		free(rel[j].buf);
+	}
+	free(symtab.buf);
+	free(strtab.buf);
+	free(shstrtab.buf);
+	free(file.buf);
+}
+#endif
+
+#ifdef GEN_JIT
+/* map the code and the data, relocated for where they landed, and call
+   main; returns its result */
+static int asm_run() {
+	long page = sysconf(_SC_PAGESIZE);
+	int textsz = (asm_sect[ASM_TEXT].len + page - 1) / page * page;
+	int size = textsz + asm_sect[ASM_DATA].len;
+	struct asm_label *m = asm_label("main", 4);
+	unsigned char *base[ASM_NSECT];
+	int (*fn)(void);
+	int i, fd;
+
+	asm_resolve();
+	if (m->sect != ASM_TEXT) {
+		error("Error: no main function\n");
+	}
+	fd = open("/dev/zero", O_RDWR);
+	base[ASM_TEXT] = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (fd < 0 || base[ASM_TEXT] == MAP_FAILED) {
+		error("Error: cannot map the code\n");
+	}
+	close(fd);
+	base[ASM_DATA] = base[ASM_TEXT] + textsz;
+	for (i = 0; i < ASM_NSECT; i++) {
+		memcpy(base[i], asm_sect[i].buf, asm_sect[i].len);
+	}
+	for (i = 0; i < asm_nfixups; i++) {
+		struct asm_fixup *x = &asm_fixups[i];
+		unsigned char *p = base[x->sect] + x->off;
+		intptr_t v = asm_get(p) + (intptr_t) base[x->label->sect];
+		if (x->reloc) {
+			if (x->pcrel) {
+				v -= (intptr_t) p;
+			} else if (v != (int) v) {
+				error("Error: address of '%s' out of range\n", x->label->name);
+			}
+			asm_set(p, v);
+		}
+	}
+	if (mprotect(base[ASM_TEXT], textsz, PROT_READ | PROT_EXEC) != 0) {
+		error("Error: cannot map the code\n");
+	}
+	fn = (int (*)(void)) (base[ASM_TEXT] + m->off);
+	return fn();
+}
+#endif
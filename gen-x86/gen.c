@@ -24,6 +24,9 @@
 #define GEN_LESS  "pop %ebx\ncmp %eax, %ebx\nsetl %al\nmovzx %al, %eax\n"
 #define GEN_LESSSZ strlen(GEN_LESS)
 
+#define GEN_LE    "pop %ebx\ncmp %eax, %ebx\nsetle %al\nmovzx %al, %eax\n"
+#define GEN_LESZ strlen(GEN_LE)
+
 #define GEN_EQ "pop %ebx\ncmp %ebx, %eax\nsete %al\nmovzx %al, %eax\n"
 #define GEN_EQSZ strlen(GEN_EQ)
 #define GEN_NEQ  "pop %ebx\ncmp %ebx, %eax\nsetne %al\nmovzx %al, %eax\n"
@@ -33,6 +36,19 @@
 #define GEN_ORSZ strlen(GEN_OR)
 #define GEN_AND  "pop %ebx\nand %ebx, %eax \n"
 #define GEN_ANDSZ strlen(GEN_AND)
+#define GEN_XOR "pop %ebx\nxor %ebx, %eax\n"
+#define GEN_XORSZ strlen(GEN_XOR)
+
+#define GEN_MUL "pop %ebx\nimul %ebx, %eax\n"
+#define GEN_MULSZ strlen(GEN_MUL)
+#define GEN_DIV "mov %eax, %ebx\npop %eax\ncltd\nidiv %ebx\n"
+#define GEN_DIVSZ strlen(GEN_DIV)
+#define GEN_MOD "mov %eax, %ebx\npop %eax\ncltd\nidiv %ebx\nmov %edx, %eax\n"
+#define GEN_MODSZ strlen(GEN_MOD)
+#define GEN_SAR   "pop %ebx\nmov %al, %cl\nsar %cl, %ebx\nmov %ebx, %eax\n"
+#define GEN_SARSZ strlen(GEN_SAR)
+#define GEN_MULHI "pop %ebx\nimul %ebx\nmov %edx, %eax\n"
+#define GEN_MULHISZ strlen(GEN_MULHI)
 
 #define GEN_ASSIGN "pop %ebx\nmovl %eax, (%ebx)\n"
 #define GEN_ASSIGNSZ strlen(GEN_ASSIGN)
@@ -44,22 +60,89 @@
 
 #define GEN_JZ "cmp $0, %eax\nje                  \n"
 #define GEN_JZSZ strlen(GEN_JZ)
+#define GEN_JNZ "cmp $0, %eax\njne                 \n"
+#define GEN_JNZSZ strlen(GEN_JNZ)
+
+/* a comparison tested by a jump: GEN_CMP, then the jump taken when it is
+   false, or true (GEN_JLT, GEN_JLE) */
+#define GEN_CMP "pop %ebx\ncmp %eax, %ebx\n"
+#define GEN_CMPSZ strlen(GEN_CMP)
+#define GEN_JGE "jge                 \n"
+#define GEN_JGESZ strlen(GEN_JGE)
+#define GEN_JGT "jg                  \n"
+#define GEN_JGTSZ strlen(GEN_JGT)
+#define GEN_JLT "jl                  \n"
+#define GEN_JLTSZ strlen(GEN_JLT)
+#define GEN_JLE "jle                 \n"
+#define GEN_JLESZ strlen(GEN_JLE)
+#define GEN_JNE "jne                 \n"
+#define GEN_JNESZ strlen(GEN_JNE)
+#define GEN_JEQ "je                  \n"
+#define GEN_JEQSZ strlen(GEN_JEQ)
+
+/* jump table entries, see gen_jtab() */
+#define GEN_JTAB ".long                \n"
+#define GEN_JTABSZ strlen(GEN_JTAB)
+
+static struct rewrite gen_peephole[] = {
+	/* keep a left operand in %ebx instead of the stack */
+	{"push %eax\nmov $\1, %eax\npop %ebx\n", "mov %eax, %ebx\nmov $\1, %eax\n"},
+	{"push %eax\npop %ebx\n",                "mov %eax, %ebx\n"},
+	/* operations with a constant */
+	{"mov %eax, %ebx\nmov $\1, %eax\nadd %ebx, %eax\n",           "add $\1, %eax\n"},
+	{"mov %eax, %ebx\nmov $\1, %eax\nsub %ebx, %eax\nneg %eax\n", "sub $\1, %eax\n"},
+	{"mov %eax, %ebx\nmov $\1, %eax\nor %ebx, %eax \n",           "or $\1, %eax\n"},
+	{"mov %eax, %ebx\nmov $\1, %eax\nand %ebx, %eax \n",          "and $\1, %eax\n"},
+	/* stack slots */
+	{"mov %esp, %eax\nadd $0x0, %eax\n",                     "mov %esp, %eax\n"},
+	{"mov %esp, %eax\nadd $\1, %eax\nmov (%eax), %eax\n",   "mov \1(%esp), %eax\n"},
+	{"mov %esp, %eax\nmov (%eax), %eax\n",                   "mov (%esp), %eax\n"},
+	{NULL, NULL}
+};
+
+/* cycles, roughly */
+static struct cost gen_cost = {1, 1, 1, 3, 4, 26};
+
+#define GEN_OBJECT
+#if defined(__i386__) && !defined(CUCU_LIB) /* the library does not run code */
+#define GEN_JIT
+#endif
+#include "asm.c"
+
+static __thread int array_index = 0;
+
+static void gen_reset() {
+	array_index = 0;
+	asm_reset();
+}
 
 static void gen_start() {
+	if (objpath != NULL || runjit) {
+		code_sink = asm_code;
+	}
 	emits(".align 4\n.globl main\n");
 }
 
 static void gen_finish() {
 	int i;
-	printf("%s", code);
-	printf(".data\n");
+	emits(".data\n");
 	for (i = 0; i < sympos; i++) {
-		if (sym[i].type == 'G') {
-			printf("%s:\n.long 0\n", sym[i].name);
+		if (syms[i].type == 'G') {
+			emitf("%s:\n.long 0\n", syms[i].name);
 		}
 	}
+	code_flush();
+	if (objpath != NULL) {
+		asm_write(objpath);
+	}
 }
 
+#ifdef GEN_JIT
+static int gen_run() {
+	return asm_run();
+}
+#endif
+
 /* put constant to primary register */
 static void gen_const(int n) {
 	emitf("mov $0x%x, %%eax\n", n);
@@ -89,12 +172,21 @@ static void gen_unref(int type) {
 	}
 }
 
+static void gen_preamble(int n) {
+	(void) n;
+}
+
 /* Call function by address stored in primary register */
 /* no, call doesn't increase current stack size?????!!! XXX  */
 static void gen_call() {
 	emits("call *%eax\n");
 }
 
+/* arguments are removed by the caller */
+static void gen_call_cleanup(int n) {
+	(void) n;
+}
+
 /* return from function (return address is stored on the stack) */
 static void gen_ret() {
 	emits("ret\n");
@@ -112,30 +204,530 @@ static void gen_loop_start() {
 	emitf("___ifelse%04x:\n", codepos);
 }
 
+/* jump to entry %eax of the n GEN_JTAB entries that follow */
+static void gen_jtab(int n) {
+	(void) n;
+	emitf("shl $2, %%eax\nadd $___jtab%04x, %%eax\njmp *(%%eax)\n___jtab%04x:\n", codepos, codepos);
+}
+
 static void gen_sym_addr(struct sym *sym) {
 	emitf("mov $%s, %%eax\n", sym->name);
 }
 
-static int array_index = 0;
-static void gen_array(char *array, int size) {
+/* put the string into the data section, returns its number */
+static int gen_string(char *array, int size) {
 	int i;
 	emitf(".data\n___s%d:\n.string \"", array_index);
 	for (i = 0; i < size; i++) {
 		emitf("\\x%02x", array[i]);
 	}
 	emits("\"\n.text\n");
-	emitf("mov $___s%d, %%eax\n", array_index);
-	array_index++;
+	return array_index++;
+}
+
+static void gen_array(char *array, int size) {
+	emitf("mov $___s%d, %%eax\n", gen_string(array, size));
 }
 
 /* patch jump address */
-static void gen_patch(uint8_t *op, int value) {
+static void gen_patch(int op, int value) {
 	char s[32];
 	sprintf(s, "___ifelse%04x", value);
 	if (value >= codepos) {
 		emits(s);
 		emits(":\n");
 	}
-	memcpy(op-strlen(s)-1, s, strlen(s));
+	memcpy(code_at(op-strlen(s)-1), s, strlen(s));
+}
+
+/*
+ * Register lowering, used from -O1 on.  %eax is the scratch register, the
+ * allocator hands out the others.  Functions save the preserved registers
+ * they use, so values only live across calls in those.
+ */
+#define GEN_NREGS 5
+#define GEN_CALLEE_SAVED 0x19 /* %ebx, %esi, %edi */
+#define GEN_FLAGS /* a comparison tested by a jump sets the flags alone */
+#define REG_ECX 1
+#define REG_EDX 2
+static char *gen_regs[GEN_NREGS] = {"%ebx", "%ecx", "%edx", "%esi", "%edi"};
+
+/* the value t stands for, skipping copies */
+static int x86_value(int t) {
+	while (ir[t].loc == LOC_ALIAS) {
+		t = ir[t].a;
+	}
+	return t;
+}
+
+static char *x86_var(struct sym *s, char *buf) {
+	if (s->reg >= 0) {
+		return gen_regs[s->reg];
+	}
+	if (s->type != 'L') {
+		return s->name;
+	}
+	sprintf(buf, "%d(%%esp)", (stack_pos - s->addr - 1) * TYPE_NUM_SIZE);
+	return buf;
+}
+
+/* a constant, an address or a variable as an operand */
+static char *x86_src(struct insn *i, char *buf) {
+	switch (i->op) {
+	case IR_CONST:
+		sprintf(buf, "$0x%x", i->k);
+		break;
+	case IR_ADDR:
+		if (i->sym->type == 'L') {
+			error("Error: local '%s' called\n", i->sym->name);
+		}
+		sprintf(buf, "$%s", i->sym->name);
+		break;
+	case IR_STR:
+		sprintf(buf, "$___s%d", i->pos);
+		break;
+	case IR_LOADVAR:
+		return x86_var(i->sym, buf);
+	}
+	return buf;
+}
+
+/* operand reading the value t */
+static char *x86_op(int t) {
+	static __thread char bufs[4][64];
+	static __thread int n = 0;
+	char *buf = bufs[n++ % 4];
+	struct insn *i = &ir[x86_value(t)];
+	if (i->loc == LOC_REG) {
+		return gen_regs[i->reg];
+	}
+	if (i->loc == LOC_STACK) {
+		sprintf(buf, "%d(%%esp)", (stack_pos - i->spill) * TYPE_NUM_SIZE);
+		return buf;
+	}
+	return x86_src(i, buf);
+}
+
+static int x86_spilled(int t) {
+	return t >= 0 && ir[x86_value(t)].loc == LOC_STACK;
+}
+
+/* number of operands of t waiting on the stack */
+static int x86_npop(int t) {
+	struct insn *i = &ir[t];
+	int n = x86_spilled(i->a), arg;
+	if (i->op == IR_BIN || i->op == IR_STORE || i->op == IR_JOIN) {
+		n += x86_spilled(i->b);
+	} else if (i->op == IR_CALL) {
+		for (arg = i->b; arg >= 0; arg = ir[arg].next) {
+			n += x86_spilled(arg);
+		}
+	}
+	return n;
+}
+
+/* move the result from %eax to where t is kept, popping the npop spilled
+   operands; a spilled result takes the place of the first */
+static void x86_result(int t, int npop) {
+	struct insn *i = &ir[t];
+	if (i->loc == LOC_STACK && npop > 0) {
+		emitf("movl %%eax, %d(%%esp)\n", (npop - 1) * TYPE_NUM_SIZE);
+		gen_pop(npop - 1);
+		i->spill = stack_pos;
+		return;
+	}
+	gen_pop(npop);
+	if (i->loc == LOC_STACK) {
+		emits("pushl %eax\n");
+		stack_pos++;
+		i->spill = stack_pos;
+	} else if (i->loc == LOC_REG) {
+		emitf("movl %%eax, %s\n", gen_regs[i->reg]);
+	}
+}
+
+/* save register r around an instruction needing it, if it holds a value */
+static int x86_save(int t, int r) {
+	if (ir[t].live & (1 << r)) {
+		emitf("pushl %s\n", gen_regs[r]);
+		stack_pos++;
+		return 1;
+	}
+	return 0;
+}
+
+static void x86_restore(int r, int saved) {
+	if (saved) {
+		emitf("popl %s\n", gen_regs[r]);
+		stack_pos--;
+	}
+}
+
+/* condition code of the comparison op, or of its opposite */
+static char *x86_cc(int op, int opposite) {
+	switch (op) {
+	case '<':  return opposite ? "ge" : "l";
+	case T_LE: return opposite ? "g" : "le";
+	case T_EQ: return opposite ? "ne" : "e";
+	case T_NE: return opposite ? "e" : "ne";
+	}
+	return NULL;
+}
+
+static void x86_bin(int t) {
+	struct insn *i = &ir[t];
+	char *a = x86_op(i->a), *b = x86_op(i->b), *tmp;
+	char *d = (i->loc == LOC_REG) ? gen_regs[i->reg] : NULL;
+	char *ins = NULL, *cc = NULL, count[16];
+	int npop = x86_npop(t), saved;
+
+	switch (i->k) {
+	case '+':   ins = "addl"; break;
+	case '-':   ins = "subl"; break;
+	case '&':   ins = "andl"; break;
+	case '|':   ins = "orl"; break;
+	case '^':   ins = "xorl"; break;
+	case '*':   ins = "imull"; break;
+	case T_SHL: ins = "shll"; break;
+	case T_SHR: ins = "shrl"; break;
+	case T_SAR: ins = "sarl"; break;
+	default:    cc = x86_cc(i->k, 0); break;
+	}
+	if (cc != NULL) {
+		if (a[0] == '$' || (a[0] != '%' && b[0] != '%' && b[0] != '$')) {
+			emitf("movl %s, %%eax\n", a);
+			a = "%eax";
+		}
+		emitf("cmpl %s, %s\n", b, a);
+		if (i->loc == LOC_FLAGS) {
+			if (npop > 0) { // add would change the flags
+				emitf("leal %d(%%esp), %%esp\n", npop * TYPE_NUM_SIZE);
+				stack_pos -= npop;
+			}
+			return;
+		}
+		emitf("set%s %%al\n", cc);
+		if (d != NULL) {
+			emitf("movzbl %%al, %s\n", d);
+			gen_pop(npop);
+			return;
+		}
+		emits("movzbl %al, %eax\n");
+	} else if ((i->k == T_SHL || i->k == T_SHR || i->k == T_SAR) && b[0] != '$') {
+		// the count goes in %cl
+		emitf("movl %s, %%eax\n", a);
+		saved = x86_save(t, REG_ECX);
+		b = x86_op(i->b);
+		if (strcmp(b, "%ecx") != 0) {
+			emitf("movl %s, %%ecx\n", b);
+		}
+		emitf("%s %%cl, %%eax\n", ins);
+		x86_restore(REG_ECX, saved);
+	} else if (i->k == '/' || i->k == '%' || i->k == T_MULHI) {
+		// %edx:%eax is the dividend or the product
+		ins = (i->k == T_MULHI) ? "imull" : "cltd\nidivl";
+		emitf("movl %s, %%eax\n", a);
+		saved = x86_save(t, REG_EDX);
+		b = x86_op(i->b);
+		if (b[0] == '$' || strcmp(b, "%edx") == 0) {
+			emitf("pushl %s\n%s (%%esp)\n", b, ins);
+			stack_pos++;
+			gen_pop(1);
+		} else {
+			emitf("%s %s\n", ins, b);
+		}
+		if (i->k == '%' || i->k == T_MULHI) {
+			emits("movl %edx, %eax\n");
+		}
+		x86_restore(REG_EDX, saved);
+	} else if (ins != NULL) {
+		if (i->k == T_SHL || i->k == T_SHR || i->k == T_SAR) {
+			sprintf(count, "$%d", ir[x86_value(i->b)].k & 31);
+			b = count;
+		}
+		if (d != NULL && strcmp(d, b) == 0 && i->k != '-') {
+			tmp = a;
+			a = b;
+			b = tmp;
+		}
+		if (d != NULL && strcmp(d, b) != 0) {
+			if (strcmp(d, a) != 0) {
+				emitf("movl %s, %s\n", a, d);
+			}
+			emitf("%s %s, %s\n", ins, b, d);
+			gen_pop(npop);
+			return;
+		}
+		emitf("movl %s, %%eax\n%s %s, %%eax\n", a, ins, b);
+	}
+	x86_result(t, npop);
+}
+
+static void x86_load(int t) {
+	struct insn *i = &ir[t];
+	char *a = x86_op(i->a);
+	char *mov = (i->k == TYPE_CHARVAR) ? "movzbl" : "movl";
+	int npop = x86_npop(t);
+	if (a[0] != '%') {
+		emitf("movl %s, %%eax\n", a);
+		a = "%eax";
+	}
+	if (i->loc == LOC_REG) {
+		emitf("%s (%s), %s\n", mov, a, gen_regs[i->reg]);
+		gen_pop(npop);
+		return;
+	}
+	emitf("%s (%s), %%eax\n", mov, a);
+	x86_result(t, npop);
+}
+
+static void x86_store(int t) {
+	struct insn *i = &ir[t];
+	char *a = x86_op(i->a);
+	char *st = (i->k == TYPE_CHARVAR) ? "movb %%al, (%s)\n" : "movl %%eax, (%s)\n";
+	int npop = x86_npop(t), saved;
+	emitf("movl %s, %%eax\n", x86_op(i->b));
+	if (a[0] == '%') {
+		emitf(st, a);
+	} else {
+		saved = x86_save(t, REG_EDX);
+		emitf("movl %s, %%edx\n", x86_op(i->a));
+		emitf(st, "%edx");
+		x86_restore(REG_EDX, saved);
+	}
+	x86_result(t, npop);
+}
+
+static void x86_storevar(int t) {
+	struct insn *i = &ir[t];
+	char var[64];
+	char *a = x86_op(i->a), *x = x86_var(i->sym, var);
+	int npop = x86_npop(t);
+	if (i->user < 0 && (a[0] == '%' || a[0] == '$' || x[0] == '%')) {
+		if (strcmp(a, x) != 0) {
+			emitf("movl %s, %s\n", a, x);
+		}
+		gen_pop(npop);
+		return;
+	}
+	emitf("movl %s, %%eax\nmovl %%eax, %s\n", a, x);
+	x86_result(t, npop);
+}
+
+static void x86_call(int t) {
+	struct insn *i = &ir[t];
+	struct insn *f = &ir[x86_value(i->a)];
+	char *a;
+	int npop = x86_npop(t);
+	if (f->op == IR_ADDR) {
+		emitf("call %s\n", f->sym->name);
+	} else {
+		a = x86_op(i->a);
+		if (a[0] == '$') {
+			emitf("movl %s, %%eax\n", a);
+			a = "%eax";
+		}
+		emitf("call *%s\n", a);
+	}
+	x86_result(t, npop);
+}
+
+static void x86_ret(int t, int nsaved) {
+	struct insn *i = &ir[t];
+	int r;
+	if (i->a >= 0 && ir[x86_value(i->a)].loc != LOC_NONE) {
+		emitf("movl %s, %%eax\n", x86_op(i->a));
+	}
+	if (stack_pos > nsaved) {
+		emitf("add $0x%04x, %%esp\n", (stack_pos - nsaved) * TYPE_NUM_SIZE);
+	}
+	for (r = GEN_NREGS - 1; r >= 0; r--) {
+		if (regsused & GEN_CALLEE_SAVED & (1 << r)) {
+			emitf("popl %s\n", gen_regs[r]);
+		}
+	}
+	emits("ret\n");
+	stack_pos -= x86_spilled(i->a);
+}
+
+/* the jump of the IR_JZ, IR_JNZ or IR_TEST t, taken if its operand is not
+   zero (nz) or zero (!nz); an IR_TEST leaves nz in %eax for its IR_JOIN */
+static void x86_jump(int t, int nz) {
+	struct insn *i = &ir[t], *v = &ir[x86_value(i->a)];
+	char *a, *cc = nz ? "ne" : "e";
+
+	if (v->loc == LOC_FLAGS) {
+		cc = x86_cc(v->k, !nz);
+	} else {
+		a = x86_op(i->a);
+		if (a[0] == '$') {
+			if ((v->op != IR_CONST || v->k != 0) != nz) {
+				return; // never taken
+			}
+			cc = NULL;
+		} else {
+			if (x86_spilled(i->a)) {
+				emits("popl %eax\n");
+				stack_pos--;
+				a = "%eax";
+			}
+			if (a[0] == '%') {
+				emitf("test %s, %s\n", a, a);
+			} else {
+				emitf("cmpl $0, %s\n", a);
+			}
+		}
+	}
+	if (i->op == IR_TEST) {
+		emitf("movl $%d, %%eax\n", nz); // leaves the flags alone
+	}
+	if (cc == NULL) {
+		emitf("jmp ___label%04x_%d\n", currFunction->addr, i->k);
+	} else {
+		emitf("j%s ___label%04x_%d\n", cc, currFunction->addr, i->k);
+	}
+}
+
+/* the IR_JOIN t: its operand b as 0 or 1, or what the IR_TEST jumping to
+   it left in %eax */
+static void x86_join(int t) {
+	struct insn *i = &ir[t];
+	char *b = (ir[x86_value(i->b)].loc == LOC_NONE) ? "%eax" : x86_op(i->b);
+	if (b[0] == '$' || ir_bool(i->b)) {
+		if (strcmp(b, "%eax") != 0) {
+			emitf("movl %s, %%eax\n", b);
+		}
+		b = "%eax";
+	}
+	if (!ir_bool(i->b)) {
+		if (b[0] == '%') {
+			emitf("test %s, %s\n", b, b);
+		} else {
+			emitf("cmpl $0, %s\n", b);
+		}
+		emits("setne %al\nmovzbl %al, %eax\n");
+	}
+	gen_pop(x86_npop(t));
+	emitf("___label%04x_%d:\n", currFunction->addr, i->k);
+	x86_result(t, 0);
+}
+
+/* the IR_JTAB t: an indirect jump through the table that follows it */
+static void x86_jtab(int t) {
+	struct insn *i = &ir[t];
+	int j, fn = currFunction->addr;
+	if (x86_spilled(i->a)) {
+		emits("popl %eax\n");
+		stack_pos--;
+	} else if (ir[x86_value(i->a)].loc != LOC_NONE) {
+		emitf("movl %s, %%eax\n", x86_op(i->a));
+	}
+	emitf("shl $2, %%eax\nadd $___jtab%04x_%d, %%eax\njmp *(%%eax)\n", fn, t);
+	emitf("___jtab%04x_%d:\n", fn, t);
+	for (j = 1; j <= jtab[i->k]; j++) {
+		emitf(".long ___label%04x_%d\n", fn, jtab[i->k + j]);
+	}
 }
 
+static void gen_function() {
+	struct sym *s;
+	char src[64], *a;
+	int t, r, nsaved, fn = currFunction->addr;
+
+	for (r = 0; r < GEN_NREGS; r++) {
+		if (regsused & GEN_CALLEE_SAVED & (1 << r)) {
+			emitf("pushl %s\n", gen_regs[r]);
+			stack_pos++;
+		}
+	}
+	nsaved = stack_pos;
+	for (s = currFunction + 1; s < syms + sympos; s++) {
+		if (s->addr < 0 && s->reg >= 0) { // parameter
+			emitf("movl %d(%%esp), %s\n", (stack_pos - s->addr - 1) * TYPE_NUM_SIZE,
+			      gen_regs[s->reg]);
+		}
+	}
+	for (t = 0; t < irpos; t++) {
+		struct insn *i = &ir[t];
+		switch (i->op) {
+		case IR_STR:
+			i->pos = gen_string(i->str, i->k);
+			// fall through
+		case IR_CONST:
+		case IR_ADDR:
+		case IR_LOADVAR:
+			if (i->loc == LOC_STACK) {
+				emitf("pushl %s\n", x86_src(i, src));
+				stack_pos++;
+				i->spill = stack_pos;
+			} else if (i->loc == LOC_REG) {
+				emitf("movl %s, %s\n", x86_src(i, src), gen_regs[i->reg]);
+			}
+			break;
+		case IR_BIN:
+			x86_bin(t);
+			break;
+		case IR_LOAD:
+			x86_load(t);
+			break;
+		case IR_STORE:
+			x86_store(t);
+			break;
+		case IR_STOREVAR:
+			x86_storevar(t);
+			break;
+		case IR_CALL:
+			x86_call(t);
+			break;
+		case IR_PUSH:
+			s = i->sym;
+			if (s->reg >= 0) {
+				if (i->a >= 0) {
+					a = x86_op(i->a);
+					if (strcmp(a, gen_regs[s->reg]) != 0) {
+						emitf("movl %s, %s\n", a, gen_regs[s->reg]);
+					}
+					gen_pop(x86_npop(t));
+				}
+			} else if (i->a >= 0 && x86_spilled(i->a)) {
+				s->addr = stack_pos - 1; // the value already is on top of the stack
+			} else {
+				emitf("pushl %s\n", (i->a >= 0) ? x86_op(i->a) : "%eax");
+				stack_pos++;
+				s->addr = stack_pos - 1;
+			}
+			break;
+		case IR_JZ:
+		case IR_JNZ:
+			x86_jump(t, i->op == IR_JNZ);
+			break;
+		case IR_TEST:
+			x86_jump(t, i->b);
+			break;
+		case IR_JOIN:
+			x86_join(t);
+			break;
+		case IR_JTAB:
+			x86_jtab(t);
+			break;
+		case IR_JMP:
+			emitf("jmp ___label%04x_%d\n", fn, i->k);
+			break;
+		case IR_LABEL:
+			emitf("___label%04x_%d:\n", fn, i->k);
+			break;
+		case IR_RET:
+			x86_ret(t, nsaved);
+			break;
+		case IR_MARK:
+			marks[i->k] = stack_pos;
+			break;
+		case IR_RESTORE:
+			gen_pop(stack_pos - marks[i->k]);
+			break;
+		case IR_SETSP:
+			stack_pos = marks[i->k];
+			break;
+		}
+	}
+}
@@ -0,0 +1,590 @@
+/* some helper macros to emit text */
+#define emits(s) emit(s, strlen(s))
+#define emitf(fmt, ...) \
+	do { \
+		char buf[128]; \
+		snprintf(buf, sizeof(buf)-1, fmt, __VA_ARGS__); \
+		emits(buf); \
+	} while (0)
+
+#define TYPE_NUM_SIZE 8
+
+/*
+ * x86-64, System V ABI.  There is no stack machine here: every function is
+ * lowered from the IR, with no registers at -O0.  %rax, %rcx and %rdx are
+ * scratch, the allocator hands out the others that carry no arguments.
+ * Arguments go in %rdi, %rsi, %rdx, %rcx, %r8, %r9 and then on the stack,
+ * which is 16-byte aligned at calls.  Globals and strings are addressed
+ * relative to %rip, so the code links into position independent binaries.
+ */
+#define GEN_REGS_ONLY
+#define GEN_NREGS 7
+#define GEN_CALLEE_SAVED 0x1f /* %rbx, %r12-%r15 */
+#define GEN_FLAGS /* a comparison tested by a jump sets the flags alone */
+static char *gen_regs[GEN_NREGS] = {"%rbx", "%r12", "%r13", "%r14", "%r15", "%r10", "%r11"};
+
+#define NARGREGS 6
+static char *arg_regs[NARGREGS] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
+
+static struct rewrite gen_peephole[] = {
+	{NULL, NULL}
+};
+
+/* cycles, roughly; no T_MULHI, which is for 32-bit words */
+static struct cost gen_cost = {1, 1, 1, 3, 0, 40};
+
+#define ASM_64 1
+#if defined(__x86_64__) && !defined(CUCU_LIB) /* the library does not run code */
+#define GEN_JIT
+#endif
+#include "../gen-x86/asm.c"
+
+static __thread int array_index = 0;
+
+static void gen_reset() {
+	array_index = 0;
+	asm_reset();
+}
+
+static void gen_start() {
+	if (runjit) {
+		code_sink = asm_code;
+	}
+	emits(".text\n.globl main\n");
+}
+
+static void gen_finish() {
+	int i;
+	emits(".data\n");
+	for (i = 0; i < sympos; i++) {
+		if (syms[i].type == 'G') {
+			emitf("%s:\n.quad 0\n", syms[i].name);
+		}
+	}
+	emits(".section .note.GNU-stack,\"\",@progbits\n");
+	code_flush();
+}
+
+#ifdef GEN_JIT
+static int gen_run() {
+	return asm_run();
+}
+#endif
+
+static void gen_sym(struct sym *sym) {
+	if (sym->type == 'F') {
+		emits(sym->name);
+		emits(":\n");
+	}
+}
+
+static void gen_pop(int n) {
+	if (n > 0) {
+		emitf("addq $%d, %%rsp\n", n * TYPE_NUM_SIZE);
+		stack_pos = stack_pos - n;
+	}
+}
+
+/* put the string into the data section, returns its number */
+static int gen_string(char *array, int size) {
+	int i;
+	emitf(".data\n___s%d:\n.string \"", array_index);
+	for (i = 0; i < size; i++) {
+		emitf("\\x%02x", array[i]);
+	}
+	emits("\"\n.text\n");
+	return array_index++;
+}
+
+/* the value t stands for, skipping copies */
+static int x64_value(int t) {
+	while (ir[t].loc == LOC_ALIAS) {
+		t = ir[t].a;
+	}
+	return t;
+}
+
+static char *x64_var(struct sym *s, char *buf) {
+	if (s->reg >= 0) {
+		return gen_regs[s->reg];
+	}
+	if (s->type != 'L') {
+		sprintf(buf, "%s(%%rip)", s->name);
+	} else {
+		sprintf(buf, "%d(%%rsp)", (stack_pos - s->addr - 1) * TYPE_NUM_SIZE);
+	}
+	return buf;
+}
+
+/* a constant, an address or a variable as an operand; addresses have no
+   immediate form and are loaded into the scratch register */
+static char *x64_src(struct insn *i, char *buf, char *scratch) {
+	switch (i->op) {
+	case IR_CONST:
+		sprintf(buf, "$%d", i->k);
+		break;
+	case IR_ADDR:
+		if (i->sym->type == 'L') {
+			error("Error: local '%s' called\n", i->sym->name);
+		}
+		emitf("leaq %s(%%rip), %s\n", i->sym->name, scratch);
+		return scratch;
+	case IR_STR:
+		emitf("leaq ___s%d(%%rip), %s\n", i->pos, scratch);
+		return scratch;
+	case IR_LOADVAR:
+		return x64_var(i->sym, buf);
+	}
+	return buf;
+}
+
+/* operand reading the value t */
+static char *x64_op(int t, char *scratch) {
+	static __thread char bufs[4][64];
+	static __thread int n = 0;
+	char *buf = bufs[n++ % 4];
+	struct insn *i = &ir[x64_value(t)];
+	if (i->loc == LOC_REG) {
+		return gen_regs[i->reg];
+	}
+	if (i->loc == LOC_STACK) {
+		sprintf(buf, "%d(%%rsp)", (stack_pos - i->spill) * TYPE_NUM_SIZE);
+		return buf;
+	}
+	return x64_src(i, buf, scratch);
+}
+
+/* like x64_op, but always a register */
+static char *x64_reg(int t, char *scratch) {
+	char *a = x64_op(t, scratch);
+	if (a[0] != '%') {
+		emitf("movq %s, %s\n", a, scratch);
+		a = scratch;
+	}
+	return a;
+}
+
+static int x64_spilled(int t) {
+	return t >= 0 && ir[x64_value(t)].loc == LOC_STACK;
+}
+
+/* number of operands of t waiting on the stack */
+static int x64_npop(int t) {
+	struct insn *i = &ir[t];
+	int n = x64_spilled(i->a), arg;
+	if (i->op == IR_BIN || i->op == IR_STORE || i->op == IR_JOIN) {
+		n += x64_spilled(i->b);
+	} else if (i->op == IR_CALL) {
+		for (arg = i->b; arg >= 0; arg = ir[arg].next) {
+			n += x64_spilled(arg);
+		}
+	}
+	return n;
+}
+
+/* move the result from %rax to where t is kept, popping the npop spilled
+   operands; a spilled result takes the place of the first */
+static void x64_result(int t, int npop) {
+	struct insn *i = &ir[t];
+	if (i->loc == LOC_STACK && npop > 0) {
+		emitf("movq %%rax, %d(%%rsp)\n", (npop - 1) * TYPE_NUM_SIZE);
+		gen_pop(npop - 1);
+		i->spill = stack_pos;
+		return;
+	}
+	gen_pop(npop);
+	if (i->loc == LOC_STACK) {
+		emits("pushq %rax\n");
+		stack_pos++;
+		i->spill = stack_pos;
+	} else if (i->loc == LOC_REG) {
+		emitf("movq %%rax, %s\n", gen_regs[i->reg]);
+	}
+}
+
+/* condition code of the comparison op, or of its opposite */
+static char *x64_cc(int op, int opposite) {
+	switch (op) {
+	case '<':  return opposite ? "ge" : "l";
+	case T_LE: return opposite ? "g" : "le";
+	case T_EQ: return opposite ? "ne" : "e";
+	case T_NE: return opposite ? "e" : "ne";
+	}
+	return NULL;
+}
+
+static void x64_bin(int t) {
+	struct insn *i = &ir[t];
+	char *a = x64_op(i->a, "%rax"), *b = x64_op(i->b, "%rcx"), *tmp;
+	char *d = (i->loc == LOC_REG) ? gen_regs[i->reg] : NULL;
+	char *ins = NULL, *cc = NULL, count[16];
+	int npop = x64_npop(t);
+
+	switch (i->k) {
+	case '+':   ins = "addq"; break;
+	case '-':   ins = "subq"; break;
+	case '&':   ins = "andq"; break;
+	case '|':   ins = "orq"; break;
+	case '^':   ins = "xorq"; break;
+	case '*':   ins = "imulq"; break;
+	case T_SHL: ins = "shlq"; break;
+	case T_SHR: ins = "shrq"; break;
+	case T_SAR: ins = "sarq"; break;
+	default:    cc = x64_cc(i->k, 0); break;
+	}
+	if (cc != NULL) {
+		if (a[0] == '$' || (a[0] != '%' && b[0] != '%' && b[0] != '$')) {
+			emitf("movq %s, %%rax\n", a);
+			a = "%rax";
+		}
+		emitf("cmpq %s, %s\n", b, a);
+		if (i->loc == LOC_FLAGS) {
+			if (npop > 0) { // add would change the flags
+				emitf("leaq %d(%%rsp), %%rsp\n", npop * TYPE_NUM_SIZE);
+				stack_pos -= npop;
+			}
+			return;
+		}
+		emitf("set%s %%al\n", cc);
+		if (d != NULL) {
+			emitf("movzbq %%al, %s\n", d);
+			gen_pop(npop);
+			return;
+		}
+		emits("movzbq %al, %rax\n");
+	} else if (i->k == '/' || i->k == '%') {
+		if (b[0] == '$') {
+			emitf("movq %s, %%rcx\n", b);
+			b = "%rcx";
+		}
+		if (strcmp(a, "%rax") != 0) {
+			emitf("movq %s, %%rax\n", a);
+		}
+		emitf("cqto\nidivq %s\n", b);
+		if (i->k == '%') {
+			emits("movq %rdx, %rax\n");
+		}
+	} else if (ins != NULL) {
+		if (i->k == T_SHL || i->k == T_SHR || i->k == T_SAR) {
+			// the count is a constant or goes in %cl
+			if (b[0] == '$') {
+				sprintf(count, "$%d", ir[x64_value(i->b)].k & 63);
+			} else {
+				if (strcmp(b, "%rcx") != 0) {
+					emitf("movq %s, %%rcx\n", b);
+				}
+				strcpy(count, "%cl");
+			}
+			b = count;
+		}
+		if (d != NULL && strcmp(d, b) == 0 && i->k != '-') {
+			tmp = a;
+			a = b;
+			b = tmp;
+		}
+		if (d != NULL && strcmp(d, b) != 0) {
+			if (strcmp(d, a) != 0) {
+				emitf("movq %s, %s\n", a, d);
+			}
+			emitf("%s %s, %s\n", ins, b, d);
+			gen_pop(npop);
+			return;
+		}
+		if (strcmp(a, "%rax") != 0) {
+			emitf("movq %s, %%rax\n", a);
+		}
+		emitf("%s %s, %%rax\n", ins, b);
+	}
+	x64_result(t, npop);
+}
+
+static void x64_load(int t) {
+	struct insn *i = &ir[t];
+	char *a = x64_reg(i->a, "%rax");
+	char *mov = (i->k == TYPE_CHARVAR) ? "movzbq" : "movq";
+	int npop = x64_npop(t);
+	if (i->loc == LOC_REG) {
+		emitf("%s (%s), %s\n", mov, a, gen_regs[i->reg]);
+		gen_pop(npop);
+		return;
+	}
+	emitf("%s (%s), %%rax\n", mov, a);
+	x64_result(t, npop);
+}
+
+static void x64_store(int t) {
+	struct insn *i = &ir[t];
+	char *b = x64_op(i->b, "%rax"), *a;
+	int npop = x64_npop(t);
+	if (strcmp(b, "%rax") != 0) {
+		emitf("movq %s, %%rax\n", b);
+	}
+	a = x64_reg(i->a, "%rcx");
+	if (i->k == TYPE_CHARVAR) {
+		emitf("movb %%al, (%s)\n", a);
+	} else {
+		emitf("movq %%rax, (%s)\n", a);
+	}
+	x64_result(t, npop);
+}
+
+static void x64_storevar(int t) {
+	struct insn *i = &ir[t];
+	char var[64];
+	char *a = x64_op(i->a, "%rax"), *x = x64_var(i->sym, var);
+	int npop = x64_npop(t);
+	if (i->user < 0 && (a[0] == '%' || a[0] == '$' || x[0] == '%')) {
+		if (strcmp(a, x) != 0) {
+			emitf("movq %s, %s\n", a, x);
+		}
+		gen_pop(npop);
+		return;
+	}
+	if (strcmp(a, "%rax") != 0) {
+		emitf("movq %s, %%rax\n", a);
+	}
+	emitf("movq %%rax, %s\n", x);
+	x64_result(t, npop);
+}
+
+/* the arguments wait on the stack: the first six are loaded into their
+   registers, the others pushed again in reverse order above the padding
+   keeping the stack aligned */
+static void x64_call(int t) {
+	struct insn *i = &ir[t];
+	struct insn *f = &ir[x64_value(i->a)];
+	int args[64];
+	int n = 0, k, pad, npop = x64_npop(t);
+	char *a;
+
+	for (k = i->b; k >= 0; k = ir[k].next) {
+		if (n == 64) {
+			error("Error: too many arguments\n");
+		}
+		args[n++] = k;
+	}
+	for (k = 0; k < n && k < NARGREGS; k++) {
+		a = x64_op(args[k], arg_regs[k]);
+		if (strcmp(a, arg_regs[k]) != 0) {
+			emitf("movq %s, %s\n", a, arg_regs[k]);
+		}
+	}
+	// on entry %rsp is 8 past a multiple of 16, and every slot since is 8
+	pad = ((stack_pos + (n > NARGREGS ? n - NARGREGS : 0)) % 2 == 0);
+	if (pad) {
+		emits("subq $8, %rsp\n");
+		stack_pos++;
+	}
+	for (k = n - 1; k >= NARGREGS; k--) {
+		emitf("pushq %s\n", x64_op(args[k], "%rax"));
+		stack_pos++;
+	}
+	if (f->op == IR_ADDR && f->loc != LOC_REG && f->loc != LOC_STACK) {
+		emitf("call %s\n", f->sym->name);
+	} else {
+		a = x64_op(i->a, "%rax");
+		if (a[0] == '$') {
+			emitf("movq %s, %%rax\n", a);
+			a = "%rax";
+		}
+		emitf("call *%s\n", a);
+	}
+	x64_result(t, npop + pad + (n > NARGREGS ? n - NARGREGS : 0));
+}
+
+static void x64_ret(int t, int nsaved) {
+	struct insn *i = &ir[t];
+	int r, pos = stack_pos;
+	char *a;
+	if (i->a >= 0 && ir[x64_value(i->a)].loc != LOC_NONE) {
+		a = x64_op(i->a, "%rax");
+		if (strcmp(a, "%rax") != 0) {
+			emitf("movq %s, %%rax\n", a);
+		}
+	}
+	gen_pop(stack_pos - nsaved);
+	for (r = GEN_NREGS - 1; r >= 0; r--) {
+		if (regsused & GEN_CALLEE_SAVED & (1 << r)) {
+			emitf("popq %s\n", gen_regs[r]);
+		}
+	}
+	emits("ret\n");
+	stack_pos = pos - x64_spilled(i->a);
+}
+
+/* the jump of the IR_JZ, IR_JNZ or IR_TEST t, taken if its operand is not
+   zero (nz) or zero (!nz); an IR_TEST leaves nz in %rax for its IR_JOIN */
+static void x64_jump(int t, int nz) {
+	struct insn *i = &ir[t], *v = &ir[x64_value(i->a)];
+	char *a, *cc = nz ? "ne" : "e";
+
+	if (v->loc == LOC_FLAGS) {
+		cc = x64_cc(v->k, !nz);
+	} else {
+		a = x64_op(i->a, "%rax");
+		if (a[0] == '$') {
+			if ((v->k != 0) != nz) {
+				return; // never taken
+			}
+			cc = NULL;
+		} else {
+			if (x64_spilled(i->a)) {
+				emits("popq %rax\n");
+				stack_pos--;
+				a = "%rax";
+			}
+			if (a[0] == '%') {
+				emitf("testq %s, %s\n", a, a);
+			} else {
+				emitf("cmpq $0, %s\n", a);
+			}
+		}
+	}
+	if (i->op == IR_TEST) {
+		emitf("movl $%d, %%eax\n", nz); // leaves the flags alone
+	}
+	if (cc == NULL) {
+		emitf("jmp ___label%04x_%d\n", currFunction->addr, i->k);
+	} else {
+		emitf("j%s ___label%04x_%d\n", cc, currFunction->addr, i->k);
+	}
+}
+
+/* the IR_JOIN t: its operand b as 0 or 1, or what the IR_TEST jumping to
+   it left in %rax */
+static void x64_join(int t) {
+	struct insn *i = &ir[t];
+	char *b = (ir[x64_value(i->b)].loc == LOC_NONE) ? "%rax" : x64_op(i->b, "%rax");
+	if (b[0] == '$' || ir_bool(i->b)) {
+		if (strcmp(b, "%rax") != 0) {
+			emitf("movq %s, %%rax\n", b);
+		}
+		b = "%rax";
+	}
+	if (!ir_bool(i->b)) {
+		if (b[0] == '%') {
+			emitf("testq %s, %s\n", b, b);
+		} else {
+			emitf("cmpq $0, %s\n", b);
+		}
+		emits("setne %al\nmovzbq %al, %rax\n");
+	}
+	gen_pop(x64_npop(t));
+	emitf("___label%04x_%d:\n", currFunction->addr, i->k);
+	x64_result(t, 0);
+}
+
+static void gen_function() {
+	struct sym *s;
+	char src[64], *a;
+	int t, r, k, nsaved, fn = currFunction->addr;
+
+	for (r = 0; r < GEN_NREGS; r++) {
+		if (regsused & GEN_CALLEE_SAVED & (1 << r)) {
+			emitf("pushq %s\n", gen_regs[r]);
+			stack_pos++;
+		}
+	}
+	nsaved = stack_pos;
+	// parameter k comes in a register, or from the 7th on in the stack past
+	// the return address; those kept in memory get a slot
+	for (s = currFunction + 1; s < syms + sympos && s->addr < 0; s++) {
+		k = -s->addr - 2;
+		if (k >= NARGREGS) {
+			s->addr = -(k - NARGREGS) - 2;
+			if (s->reg >= 0) {
+				emitf("movq %d(%%rsp), %s\n", (stack_pos - s->addr - 1) * TYPE_NUM_SIZE,
+				      gen_regs[s->reg]);
+			}
+		} else if (s->reg >= 0) {
+			emitf("movq %s, %s\n", arg_regs[k], gen_regs[s->reg]);
+		} else {
+			emitf("pushq %s\n", arg_regs[k]);
+			stack_pos++;
+			s->addr = stack_pos - 1;
+		}
+	}
+	for (t = 0; t < irpos; t++) {
+		struct insn *i = &ir[t];
+		switch (i->op) {
+		case IR_STR:
+			i->pos = gen_string(i->str, i->k);
+			// fall through
+		case IR_CONST:
+		case IR_ADDR:
+		case IR_LOADVAR:
+			if (i->loc == LOC_STACK) {
+				emitf("pushq %s\n", x64_src(i, src, "%rax"));
+				stack_pos++;
+				i->spill = stack_pos;
+			} else if (i->loc == LOC_REG) {
+				a = x64_src(i, src, gen_regs[i->reg]);
+				if (strcmp(a, gen_regs[i->reg]) != 0) {
+					emitf("movq %s, %s\n", a, gen_regs[i->reg]);
+				}
+			}
+			break;
+		case IR_BIN:
+			x64_bin(t);
+			break;
+		case IR_LOAD:
+			x64_load(t);
+			break;
+		case IR_STORE:
+			x64_store(t);
+			break;
+		case IR_STOREVAR:
+			x64_storevar(t);
+			break;
+		case IR_CALL:
+			x64_call(t);
+			break;
+		case IR_PUSH:
+			s = i->sym;
+			if (s->reg >= 0) {
+				if (i->a >= 0) {
+					a = x64_op(i->a, gen_regs[s->reg]);
+					if (strcmp(a, gen_regs[s->reg]) != 0) {
+						emitf("movq %s, %s\n", a, gen_regs[s->reg]);
+					}
+					gen_pop(x64_npop(t));
+				}
+			} else if (i->a >= 0 && x64_spilled(i->a)) {
+				s->addr = stack_pos - 1; // the value already is on top of the stack
+			} else {
+				emitf("pushq %s\n", (i->a >= 0) ? x64_op(i->a, "%rax") : "%rax");
+				stack_pos++;
+				s->addr = stack_pos - 1;
+			}
+			break;
+		case IR_JZ:
+		case IR_JNZ:
+			x64_jump(t, i->op == IR_JNZ);
+			break;
+		case IR_TEST:
+			x64_jump(t, i->b);
+			break;
+		case IR_JOIN:
+			x64_join(t);
+			break;
+		case IR_JMP:
+			emitf("jmp ___label%04x_%d\n", fn, i->k);
+			break;
+		case IR_LABEL:
+			emitf("___label%04x_%d:\n", fn, i->k);
+			break;
+		case IR_RET:
+			x64_ret(t, nsaved);
+			break;
+		case IR_MARK:
+			marks[i->k] = stack_pos;
+			break;
+		case IR_RESTORE:
+			gen_pop(stack_pos - marks[i->k]);
+			break;
+		case IR_SETSP:
+			stack_pos = marks[i->k];
+			break;
+		}
+	}
+}
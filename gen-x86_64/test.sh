@@ -0,0 +1,131 @@
+CUCUCC="./cucu-x86_64"
+
+# every case is run in memory with everything in memory (-O0) and with
+# registers, and once more assembled and linked by gcc
+testcucu() {
+	retval=$1
+	f=`mktemp`
+	printf "%s\n" "$2" > $f
+	for opt in -O0 -O1 -O2 gcc; do
+		if [ $opt = gcc ]; then
+			$CUCUCC -O2 < $f > $f.S
+			if [ "x$3" != "x" ]; then cat $f.S ; fi
+			gcc -s $f.S -o $f.elf
+			$f.elf
+			testval=$?
+			rm $f.S
+			rm $f.elf
+		else
+			$CUCUCC $opt --run < $f > /dev/null
+			testval=$?
+		fi
+		if [ $retval -ne $testval ]; then
+			echo "E$retval?$testval($opt)"
+			exit 1
+		else
+			echo -n "."
+		fi
+	done
+	rm $f
+}
+
+# Simple return values
+testcucu 0 'int main() { return 0; }'
+testcucu 5 'int main() { return 5; }'
+testcucu 7 'int main() { return 5+2; }'
+testcucu 3 'int main() { return 5-2; }'
+testcucu 12 'int main() { return 3 << 2; }'
+testcucu 4 'int main() { return 9 >> 1; }'
+testcucu 3 'int main() { return 1 | 2; }'
+testcucu 1 'int main() { return 5 & 3; }'
+testcucu 0 'int main() { return 1 == 2; }'
+testcucu 1 'int main() { return 2 == 2; }'
+testcucu 1 'int main() { return 1 + 3 == 2 + 2; }'
+testcucu 1 'int main() { return 1+3 != 1+2; }'
+testcucu 1 'int main() { return 1 < 2; }'
+testcucu 0 'int main() { return 2 < 2; }'
+testcucu 1 'int main() { return 3 > 2; }'
+testcucu 1 'int main() { return 2 <= 2; }'
+testcucu 0 'int main() { return 1 >= 2; }'
+testcucu 2 'int main() { int a = 2; return (a > 1) + (a > 2) + (a <= 2) + (a <= 1) + (a >= 3); }'
+testcucu 8 'int main() { int a = 2; int n = 0; if (a <= 2) n = n + 1; if (a >= 2) n = n + 2; if (a > 2) n = n + 4; while (a < 5) a = a + 1; return n + a; }'
+testcucu 14 'int main() { int a = 2; int b = 0; return (a && b) + (2 * (a || b)) + (4 * (b || a)) + (8 * !b) + (16 * !a); }'
+testcucu 12 'int n; int f(int x) { n = n + 1; return x; } int main() { int r = f(0) && f(1); r = r + (f(1) || f(1)); return (r * 10) + n; }'
+testcucu 21 'int main() { int i = 0; int s = 0; while (i < 10 && s < 20 || i == 3) { if (!(i&&!s) || i == 1) s = s + i; i = i + 1; } return s; }'
+# Locals
+testcucu 7 "int main() { int i; i = 7; return i; }"
+#testcucu 1000 "int main() { int i; i = 1000; return i; }" # fails because of exit status
+testcucu 5 "int main() { int i; int j; i = 5; j = 7; return i; }"
+testcucu 5 "int main() { int i; int j; i = 5; j = i; i = 3; return j; }"
+testcucu 3 "int main() { int i; int j; i = 5; j = i; j = 3; return j; }"
+testcucu 5 "int main() { int i; int j; i = 5; j = i; j = 3; return i; }"
+testcucu 8 "int main() { int i; int j = 5; i = 3; int k = j+i; return k; }"
+testcucu 15 "int main() { int i; int j; int k = j = i = 5; return k + j + i; }"
+testcucu 10 "int main() { int i; int j; int k = j = i = 5; return k + j; }"
+testcucu 5  "int main() { int i; int j; int k = j = i = 5; return k; }"
+# Globals
+testcucu 7 "int i; int main() { i = 7; return i; }"
+testcucu 5 "int i; int j; int main() { i = 5; j = 7; return i; }"
+testcucu 7 "int i; int j; int main() { i = 5; j = 7; return j; }"
+# Arrays
+testcucu 0  "int main() { char *s = \"\x00\x00\"; return 0; }"
+testcucu 5  "int main() { char *s = \"\x05\x07\"; return s[0]; }"
+testcucu 7  "int main() { char *s = \"\x05\x07\"; return s[1]; }"
+testcucu 3  "int main() { char *s = \"\x05\x07\"; s[0] = 3; return s[0]; }"
+testcucu 8  "int main() { char *s = \"\x00\x00\"; s[0]=3; s[1]=5; return s[0]+s[1]; }"
+testcucu 3 "int main() { char *s = \"\x00\x00\x00\x00\"; s[0]=257; s[2]=258; return s[0]+s[1]+s[2]+s[3]; }"
+testcucu 6 "char *s; int main() { s=\"\x00\x00\"; s[0]=5; s[1]=257; return s[0]+s[1];}"
+# Functions
+testcucu 0 "int f() { } int main() { f(); return 0; }"
+testcucu 8 "int f() { return 8; } int main() { int i; i = 3; return f(); }"
+testcucu 8 "int f() { int j; j = 8; return j; } int main() { int i; i = 3; return f(); }"
+testcucu 18 "int f1() { int j = 8; return j; } int f2() { return 7; } int main() { int i; i = 3; return i+f1()+f2(); }"
+testcucu 3 "int f1() { int i = 8; } int f2() { int i; i = 7; } int main() { int i; i = 3; f1(); f2(); return i; }"
+testcucu 7 "int add(int x,int y){return x+y;} int main() { return add(3,4); }"
+# Branches
+testcucu 3 "int main() { if (1) { return 3; } return 5; }"
+testcucu 3 "int main() { if (1) { return 3; } else { return 5; }}"
+testcucu 5 "int main(){if (0) { return 3;} else {return 5;}}"
+testcucu 3 "int main(){ if (4) { if (3-3) return 2; else return 3;} else {return 5;}}"
+testcucu 2 "int main(){ int i; i = 3; if (i) i=2; else return i;return i;}"
+# Loops
+testcucu 3 "int main() { while (0) return 5; return 3; }"
+testcucu 5 "int main() { while (1) return 5; return 3; }"
+testcucu 5 "int main() { int i = 3; while (i != 5) i = i + 1; return i; }"
+testcucu 17 "int main() { int i;int j; i=j=3; while (i != 5) { j = 0; while (j < 10) j=j+3; i=i+1;} return i+j; }"
+testcucu 15 "int main() { int i; int s = 0; for (i = 0; i < 5; i = i + 1) s = s + i; for (;;) return s + i; }"
+testcucu 12 "int main() { int i = 7; do i = i + 1; while (i < 3); do i = i + 2; while (i < 12); return i; }"
+testcucu 10 "int main() { int i = 3; int j = 1; while (i < 5) return i + 7; do return j; while (i); return i; }"
+testcucu 11 "int main() { int i; int s = 0; for (i = 0; i < 10; i = i + 1) { int j = i; if (j == 2) continue; if (j == 6) break; do { int k = 1; if (s > 9) break; s = s + k; continue; } while (0); } return s + i; }"
+# a long step expression makes the IR buffer grow while the loop is built
+step="(i - i)"
+for n in 1 2 3 4 5 6 7; do step="$step + $step"; done
+testcucu 15 "int main() { int i; int s = 0; for (i = 0; i < 5; i = i + 1 + ($step)) s = s + i; return s + i; }"
+# Switch
+testcucu 73 "int f(int x) { int r = 0; switch (x) { case 1: r = 10; break; case 2: r = 20; case 3: r = r + 3; break; case 5: { int q = 7; r = q; break; } case 6: case 7: r = 67; break; default: r = 99; } return r; } int main() { int i; int s = 0; for (i = 0; i < 9; i = i + 1) s = s + (f(i) * (i + 1)); return s & 255; }"
+testcucu 65 "int g(int x) { switch (x) { case 100: return 1; case 3000: return 2; case 7: return 3; case 5: return 4; case 42: return 5; case 900: return 6; } return 0; } int main() { return g(100) + (g(3000) * 2) + (g(7) * 4) + (g(5) * 8) + (g(42) * 16) + (g(900) * 32) + (g(8) * 64) + g(0) - 256; }"
+testcucu 116 "int main() { int i; int n = 0; for (i = 0; i < 20; i = i + 1) switch (i & 7) { case 0: case 2: n = n + 1; continue; case 5: if (i > 8) break; n = n + 10; default: switch (i) { case 3: n = n + 100; } } return n; }"
+# Constant operands
+testcucu 120 "int main() { int a = 0 - 7; int b = 0 - 100; return (a / 2) + (a % 4) + (b / 3) + (b % 8) + (b / (0 - 8)) + (a * (0 - 3)) + (a * 10) + 200; }"
+testcucu 244 "int main() { int i = 100; char *s = \"\x2a\"; return ((i / 8) + (i % 16) + (i * 10) + (i / 7) + (i % 7) + (i * 3) + (s[0] / 4) + (s[0] % 4)) - 1100; }"
+testcucu 63 "int main() { int x = 0 - 2147483647; int y = x - 1; return ((y / 2) == (0 - 1073741824)) + (((y / 3) == (0 - 715827882)) * 2) + (((y % 3) == (0 - 2)) * 4) + (((x / 7) == (0 - 306783378)) * 8) + (((y / 1024) == (0 - 2097152)) * 16) + (((y % 1024) == 0) * 32); }"
+# Folding in the word size: each constant expression and the same on a variable
+testcucu 1 'int main() { return ((65536 * 65536) >> 32); }'
+testcucu 1 'int main() { int a = 65536; return ((a * 65536) >> 32); }'
+testcucu 1 'int main() { return (2147483647 + 1) > 0; }'
+testcucu 1 'int main() { int a = 2147483647; return (a + 1) > 0; }'
+testcucu 4 'int main() { return (1 << 40) >> 38; }'
+testcucu 4 'int main() { int a = 1; return (a << 40) >> 38; }'
+testcucu 1 'int main() { return ((0 - 2147483647 - 1) / (0 - 1)) > 0; }'
+testcucu 1 'int main() { int a = 0 - 2147483647 - 1; return (a / (0 - 1)) > 0; }'
+# Arguments
+testcucu 7 "int sub(int x,int y){return x-y;} int main() { return sub(9,2); }"
+testcucu 29 "int f(int a,int b,int c,int d,int e,int f,int g,int h){return (a-b)+(c*d)+(e^f)+(g-h);} int main() { return f(9,2,3,4,5,6,8,1); }"
+testcucu 3 "int f(int a,int b,int c,int d,int e,int f,int g){return g;} int g(int a,int b,int c,int d,int e,int f,int g,int h){return f(a,b,c,d,e,f,h)-g;} int main() { return g(1,2,3,4,5,6,7,10); }"
+# Registers
+testcucu 45 "int main() { int a=1; int b=2; int c=3; int d=4; int e=5; int f=6; int g=7; int h=8; int i=9; return a+b+c+d+e+f+g+h+i; }"
+testcucu 86 "int main() { int a=1; int b=2; int c=3; int d=4; int e=5; int f=6; int g=7; int h=8; int i=0; while (i < 2) { a=a+b; b=c+d; c=e*f; d=g-h; i=i+1; } return a+b+c+d+(e^f)+(g|h); }"
+testcucu 129 "int sq(int x) { return x*x; } int main() { int a=1; int b=2; int c=3; return a+sq(b+sq(c))+b+c-(sq(a)-c); }"
+testcucu 25 "int main() { int a=3; int b=40; int c=2; int d=7; return ((b/c) + (b%d) - (a<<c) + (b>>a) + (d<<1)) - ((b/d) + c); }"
+testcucu 9 "int f(int n) { if (n < 2) return n; return f(n-1) + f(n-2); } int main() { int a = 1; return a + f(6) + (a - 1); }"
+testcucu 9 "int main() { char *s = \"\x01\x02\x03\x04\"; int i = 0; int t = 0; while (i < 4) { s[i] = s[i] + i; t = t + s[i]; i = i + 1; } return t - 7; }"
@@ -0,0 +1,483 @@
+/*
+ * Assembler for the stack machine code of the zpu backend.  The code is
+ * collected as it is flushed and translated into ZPU instructions once the
+ * program is complete.  Constants and addresses are loaded with the
+ * shortest IM sequence and jumps are relative to the branch, so how long an
+ * IM sequence is depends on where the code lands: they all start with one
+ * IM and grow until no address moves any more.  The image is loaded at 0,
+ * the data follows the code, jump tables included.  -c writes the image,
+ * else a listing is printed.
+ *
+ * A is kept on top of the ZPU stack, the stack machine's stack below it,
+ * and "pop B" leaves B under A for the operation that uses it.  Emulated
+ * instructions (sub, call, eqbranch...) must be implemented by the core.
+ */
+
+/* opcodes, operands of the stack relative ones are in bytes */
+#define ZPU_BREAKPOINT 0x00
+#define ZPU_PUSHSP     0x02
+#define ZPU_POPPC      0x04
+#define ZPU_ADD        0x05
+#define ZPU_AND        0x06
+#define ZPU_OR         0x07
+#define ZPU_LOAD       0x08
+#define ZPU_NOP        0x0b
+#define ZPU_STORE      0x0c
+#define ZPU_POPSP      0x0d
+#define ZPU_LESSTHAN   0x24
+#define ZPU_LESSTHANOREQUAL 0x25
+#define ZPU_MULT       0x29
+#define ZPU_LSHIFTRIGHT 0x2a
+#define ZPU_ASHIFTLEFT 0x2b
+#define ZPU_ASHIFTRIGHT 0x2c
+#define ZPU_CALL       0x2d
+#define ZPU_EQ         0x2e
+#define ZPU_NEQ        0x2f
+#define ZPU_SUB        0x31
+#define ZPU_XOR        0x32
+#define ZPU_LOADB      0x33
+#define ZPU_STOREB     0x34
+#define ZPU_DIV        0x35
+#define ZPU_MOD        0x36
+#define ZPU_EQBRANCH   0x37
+#define ZPU_NEQBRANCH  0x38
+#define ZPU_POPPCREL   0x39
+#define ZPU_STORESP(n) (0x40 | (((n) / 4) ^ 0x10))
+#define ZPU_LOADSP(n)  (0x60 | (((n) / 4) ^ 0x10))
+#define ZPU_IM1        0x81
+#define ZPU_SPMAX      124 /* farthest slot loadsp and storesp reach */
+
+/* swap the two words on top */
+#define ZPU_SWAP ZPU_LOADSP(4), ZPU_LOADSP(4), ZPU_STORESP(12), ZPU_STORESP(4)
+
+/* the lines translated to fixed code; b is what they do to B: 1 put it
+   under A, -1 use it up */
+static struct {
+  char *line;
+  unsigned char ops[6];
+  int len;
+  int b;
+} zpu_ops[] = {
+  {"pop B  ", {0}, 0, 1},
+  {"B:=A   ", {ZPU_LOADSP(0)}, 1, 1},
+  {"A:=B+A ", {ZPU_ADD}, 1, -1},
+  {"A:=B-A ", {ZPU_SUB}, 1, -1},  /* NOS - TOS */
+  {"A:=B<<A", {ZPU_ASHIFTLEFT}, 1, -1},
+  {"A:=B>>A", {ZPU_LSHIFTRIGHT}, 1, -1},
+  {"A:=B~>A", {ZPU_ASHIFTRIGHT}, 1, -1},
+  {"A:=B<A ", {ZPU_LESSTHANOREQUAL, ZPU_IM1, ZPU_XOR}, 3, -1}, /* !(TOS <= NOS) */
+  {"A:=B<=A", {ZPU_LESSTHAN, ZPU_IM1, ZPU_XOR}, 3, -1},        /* !(TOS < NOS) */
+  {"A:=B==A", {ZPU_EQ}, 1, -1},
+  {"A:=B!=A", {ZPU_NEQ}, 1, -1},
+  {"A:=B|A ", {ZPU_OR}, 1, -1},
+  {"A:=B&A ", {ZPU_AND}, 1, -1},
+  {"A:=B^A ", {ZPU_XOR}, 1, -1},
+  {"A:=B*A ", {ZPU_MULT}, 1, -1},
+  {"A:=B/A ", {ZPU_SWAP, ZPU_DIV}, 5, -1}, /* TOS / NOS */
+  {"A:=B%A ", {ZPU_SWAP, ZPU_MOD}, 5, -1},
+  {"M[B]:=A", {ZPU_LOADSP(0), ZPU_LOADSP(8), ZPU_STORE, ZPU_STORESP(4)}, 4, -1},
+  {"m[B]:=A", {ZPU_LOADSP(0), ZPU_LOADSP(8), ZPU_STOREB, ZPU_STORESP(4)}, 4, -1},
+  {"A:=M[A]", {ZPU_LOAD}, 1, 0},
+  {"A:=m[A]", {ZPU_LOADB}, 1, 0},
+  {"call A ", {ZPU_CALL}, 1, 0},
+  {"enter  ", {ZPU_LOADSP(0)}, 1, 0}, /* room for A over the return address */
+  {"ret    ", {ZPU_SWAP, ZPU_POPPC}, 5, 0},
+  {"halt   ", {ZPU_BREAKPOINT}, 1, 0},
+  {NULL, {0}, 0, 0}
+};
+
+/* the jumps on B compared with A, taken if op leaves a non-zero word
+   (branch is ZPU_NEQBRANCH) or zero (ZPU_EQBRANCH) */
+static struct {
+  char *line;
+  int op, branch;
+} zpu_jumps[] = {
+  {"jge", ZPU_LESSTHANOREQUAL, ZPU_NEQBRANCH}, /* TOS <= NOS */
+  {"jgt", ZPU_LESSTHAN, ZPU_NEQBRANCH},        /* TOS < NOS */
+  {"jlt", ZPU_LESSTHANOREQUAL, ZPU_EQBRANCH},
+  {"jle", ZPU_LESSTHAN, ZPU_EQBRANCH},
+  {"jne", ZPU_NEQ, ZPU_NEQBRANCH},
+  {"jeq", ZPU_EQ, ZPU_NEQBRANCH},
+  {NULL, 0, 0}
+};
+
+/* growable byte buffer */
+struct zpu_buf {
+  char *buf;
+  int len, size;
+};
+
+static __thread struct zpu_buf zpu_text;  /* the code as the backend wrote it */
+static __thread struct zpu_buf zpu_data;  /* globals, then strings and jump tables */
+static __thread struct zpu_buf zpu_tabs;  /* jump table entries: data and code offset */
+
+#define ZPU_OP   0 /* just op */
+#define ZPU_IM   1 /* IM of the constant v */
+#define ZPU_CODE 2 /* IM of the address of the code at offset v */
+#define ZPU_DATA 3 /* IM of the address of data byte v */
+#define ZPU_JUMP 4 /* IM of the distance from op to the code at offset v */
+static __thread struct zpu_insn {
+  int kind, v;
+  int op;    /* opcode after the IM sequence, -1 if none */
+  int nim;   /* length of the IM sequence */
+  int addr;
+} *zpu_insns = NULL;
+static __thread int zpu_ninsns = 0;
+static __thread int zpu_insnsz = 0;
+
+static __thread int *zpu_at = NULL;    /* first instruction of the line at each offset */
+static __thread char *zpu_target = NULL; /* the line at the offset is jumped to */
+static __thread int zpu_pending = 0;   /* "push A" not translated yet */
+static __thread int zpu_b = 0;         /* B is under A */
+static __thread int zpu_codesz = 0;
+
+static void zpu_put(struct zpu_buf *b, void *p, int len) {
+  if (b->len + len > b->size) {
+    while (b->len + len > b->size) {
+      b->size += CODECHUNKSZ;
+    }
+    b->buf = realloc(b->buf, b->size);
+    if (b->buf == NULL) {
+      error("Out of memory\n");
+    }
+  }
+  memcpy(b->buf + b->len, p, len);
+  b->len += len;
+}
+
+/* forget the last unit, keeping the buffers */
+static void zpu_reset() {
+  zpu_text.len = 0;
+  zpu_data.len = 0;
+  zpu_tabs.len = 0;
+  zpu_ninsns = 0;
+  free(zpu_at);
+  free(zpu_target);
+  zpu_at = NULL;
+  zpu_target = NULL;
+  zpu_pending = 0;
+  zpu_b = 0;
+  zpu_codesz = 0;
+}
+
+/* code sink: keep everything until the program is complete */
+static void zpu_code(char *s, size_t len) {
+  zpu_put(&zpu_text, s, len);
+}
+
+/* put the string into the data, returns its data offset */
+static int zpu_string(char *s, int len) {
+  int off;
+  while (zpu_data.len < mem_pos) {
+    zpu_put(&zpu_data, "", 1);
+  }
+  off = zpu_data.len;
+  zpu_put(&zpu_data, s, len);
+  zpu_put(&zpu_data, "", 1);
+  return off;
+}
+
+static void zpu_op(int op);
+
+static void zpu_insn(int kind, int v, int op) {
+  struct zpu_insn *x;
+  if (kind != ZPU_OP && zpu_ninsns > 0 && zpu_insns[zpu_ninsns - 1].kind != ZPU_OP &&
+      zpu_insns[zpu_ninsns - 1].op < 0) {
+    zpu_op(ZPU_NOP); // an IM right after another one would add to its value
+  }
+  if (zpu_ninsns == zpu_insnsz) {
+    zpu_insnsz += 256;
+    zpu_insns = realloc(zpu_insns, zpu_insnsz * sizeof(struct zpu_insn));
+    if (zpu_insns == NULL) {
+      error("Out of memory\n");
+    }
+  }
+  x = &zpu_insns[zpu_ninsns++];
+  x->kind = kind;
+  x->v = v;
+  x->op = op;
+  x->nim = (kind == ZPU_OP) ? 0 : (kind == ZPU_IM) ? _load_immediate(v).nImm : 1;
+  x->addr = 0;
+}
+
+static void zpu_op(int op) {
+  zpu_insn(ZPU_OP, 0, op);
+}
+
+/* translate the "push A" left over */
+static void zpu_push() {
+  if (zpu_pending) {
+    zpu_op(ZPU_LOADSP(0));
+    zpu_pending = 0;
+  }
+}
+
+/* address of stack machine slot n into A; with a "push A" pending A is
+   slot 0 and the address is pushed, else it replaces A */
+static void zpu_slot(int n, int load) {
+  int off = 4 * (n + (zpu_pending ? 0 : 1 + zpu_b));
+  if (load && off <= ZPU_SPMAX) {
+    zpu_op(ZPU_LOADSP(off));
+  } else {
+    zpu_op(ZPU_PUSHSP);
+    if (off != 0) {
+      zpu_insn(ZPU_IM, off, ZPU_ADD);
+    }
+    if (load) {
+      zpu_op(ZPU_LOAD);
+    }
+  }
+}
+
+/* drop the n stack machine slots under A */
+static void zpu_pop(int n) {
+  if (n <= 4) {
+    while (n-- > 0) {
+      zpu_op(ZPU_STORESP(4));
+    }
+    return;
+  }
+  if (4 * n <= ZPU_SPMAX) {
+    zpu_op(ZPU_STORESP(4 * n));
+  } else {
+    zpu_op(ZPU_PUSHSP);
+    zpu_insn(ZPU_IM, 4 * n, ZPU_ADD);
+    zpu_op(ZPU_STORE);
+  }
+  zpu_op(ZPU_PUSHSP);
+  zpu_insn(ZPU_IM, 4 * (n - 1), ZPU_ADD);
+  zpu_op(ZPU_POPSP);
+}
+
+/* translate the line at offset off */
+static void zpu_line(int off) {
+  char *s = zpu_text.buf + off;
+  int i, v = strtoul(s + 3, NULL, 16);
+  int load = s[0] == 'A' && s[1] == ':' && s[2] == '=' && s[3] != 'B' && s[3] != 'M' &&
+             s[3] != 'm';
+  if (strncmp(s, "sp@", 3) == 0 || strncmp(s, "lsp", 3) == 0) {
+    load = 1;
+  }
+  if (!load || zpu_target[off]) {
+    zpu_push();
+  }
+  if (zpu_target[off] && zpu_b) {
+    error("Error: B is live at a label\n");
+  }
+  zpu_at[off] = zpu_ninsns;
+  for (i = 0; zpu_ops[i].line != NULL; i++) {
+    if (strcmp(s, zpu_ops[i].line) == 0) {
+      int j;
+      if ((zpu_ops[i].b < 0) != zpu_b) {
+        error("Error: B %s at '%s'\n", zpu_b ? "is lost" : "is not set", s);
+      }
+      for (j = 0; j < zpu_ops[i].len; j++) {
+        zpu_op(zpu_ops[i].ops[j]);
+      }
+      zpu_b += zpu_ops[i].b;
+      return;
+    }
+  }
+  for (i = 0; zpu_jumps[i].line != NULL; i++) {
+    if (strncmp(s, zpu_jumps[i].line, 3) == 0) {
+      if (!zpu_b) {
+        error("Error: B is not set at '%s'\n", s);
+      }
+      zpu_op(zpu_jumps[i].op); // the comparison replaces B and A
+      zpu_op(ZPU_LOADSP(0));
+      zpu_insn(ZPU_JUMP, v, zpu_jumps[i].branch);
+      zpu_b = 0;
+      return;
+    }
+  }
+  if (zpu_b && !load) {
+    error("Error: B is lost at '%s'\n", s);
+  }
+  if (strncmp(s, "push A", 6) == 0) {
+    zpu_pending = 1;
+  } else if (strncmp(s, "pop", 3) == 0) {
+    zpu_pop(v);
+  } else if (strncmp(s, "jmp", 3) == 0) {
+    zpu_insn(ZPU_JUMP, v, ZPU_POPPCREL);
+  } else if (strncmp(s, "jmz", 3) == 0) {
+    zpu_op(ZPU_LOADSP(0));
+    zpu_insn(ZPU_JUMP, v, ZPU_EQBRANCH);
+  } else if (strncmp(s, "jnz", 3) == 0) {
+    zpu_op(ZPU_LOADSP(0));
+    zpu_insn(ZPU_JUMP, v, ZPU_NEQBRANCH);
+  } else if (strncmp(s, "case A", 6) == 0) {
+    // the "tab" lines after it are the table, a word each in the data
+    while (zpu_data.len < mem_pos || zpu_data.len % 4 != 0) {
+      zpu_put(&zpu_data, "", 1);
+    }
+    zpu_op(ZPU_LOADSP(0));
+    zpu_insn(ZPU_IM, 2, ZPU_ASHIFTLEFT);
+    zpu_insn(ZPU_DATA, zpu_data.len, ZPU_ADD);
+    zpu_op(ZPU_LOAD);
+    zpu_op(ZPU_POPPC);
+  } else if (strncmp(s, "tab", 3) == 0) {
+    int tab[2] = {zpu_data.len, v};
+    zpu_put(&zpu_tabs, tab, sizeof(tab));
+    zpu_put(&zpu_data, "\0\0\0", 4);
+  } else if (load) {
+    if (strncmp(s, "sp@", 3) == 0) {
+      zpu_slot(v, 0);
+    } else if (strncmp(s, "lsp", 3) == 0) {
+      zpu_slot(v, 1);
+    } else if (s[3] == 'P') {
+      zpu_insn(ZPU_CODE, strtoul(s + 4, NULL, 16), -1);
+    } else if (s[3] == 'G') {
+      zpu_insn(ZPU_DATA, strtoul(s + 4, NULL, 16), -1);
+    } else {
+      zpu_insn(ZPU_IM, v, -1);
+    }
+    if (zpu_pending) {
+      zpu_pending = 0;
+    } else {
+      zpu_op(ZPU_STORESP(4)); // replace A
+    }
+  } else {
+    error("Error: unknown instruction '%s'\n", s);
+  }
+}
+
+/* address of the code at offset off */
+static int zpu_addr(int off) {
+  int i = zpu_at[off];
+  return (i < zpu_ninsns) ? zpu_insns[i].addr : zpu_codesz;
+}
+
+static int zpu_value(struct zpu_insn *x) {
+  switch (x->kind) {
+  case ZPU_CODE:
+    return zpu_addr(x->v);
+  case ZPU_DATA:
+    return ((zpu_codesz + 3) & ~3) + x->v;
+  case ZPU_JUMP:
+    return zpu_addr(x->v) - (x->addr + x->nim);
+  }
+  return x->v;
+}
+
+/* lay out the code, growing the IM sequences until they all fit */
+static void zpu_relax() {
+  int i, n, changed;
+  do {
+    changed = 0;
+    zpu_codesz = 0;
+    for (i = 0; i < zpu_ninsns; i++) {
+      zpu_insns[i].addr = zpu_codesz;
+      zpu_codesz += zpu_insns[i].nim + (zpu_insns[i].op >= 0);
+    }
+    for (i = 0; i < zpu_ninsns; i++) {
+      struct zpu_insn *x = &zpu_insns[i];
+      if (x->kind != ZPU_OP) {
+        n = _load_immediate(zpu_value(x)).nImm;
+        if (n > x->nim) {
+          x->nim = n;
+          changed = 1;
+        }
+      }
+    }
+  } while (changed);
+}
+
+/* the bytes of x at p, returns how many */
+static int zpu_encode(struct zpu_insn *x, unsigned char *p) {
+  int i, n = 0;
+  if (x->nim > 0) {
+    int v = zpu_value(x);
+    struct _imm_struct im = _load_immediate(v);
+    for (i = im.nImm; i < x->nim; i++) {
+      p[n++] = (v < 0) ? 0xff : 0x80; // a grown sequence keeps the value
+    }
+    for (i = 0; i < im.nImm; i++) {
+      p[n++] = im.v[i];
+    }
+  }
+  if (x->op >= 0) {
+    p[n++] = x->op;
+  }
+  return n;
+}
+
+static void zpu_assemble() {
+  int off, next;
+  zpu_target = calloc(zpu_text.len + 1, 1);
+  zpu_at = calloc(zpu_text.len + 1, sizeof(int));
+  if (zpu_target == NULL || zpu_at == NULL) {
+    error("Out of memory\n");
+  }
+  for (off = 0; off < zpu_text.len; off = next) {
+    char *s = zpu_text.buf + off;
+    char *nl = memchr(s, '\n', zpu_text.len - off);
+    if (nl == NULL) {
+      error("Error: incomplete line '%.*s'\n", zpu_text.len - off, s);
+    }
+    *nl = '\0';
+    next = nl + 1 - zpu_text.buf;
+    if (s[0] == 'j' || strncmp(s, "tab", 3) == 0 || strncmp(s, "A:=P", 4) == 0) { // every jump
+      int t = strtoul(s + (s[0] == 'A' ? 4 : 3), NULL, 16);
+      if (t < 0 || t > zpu_text.len) {
+        error("Error: target out of the code at '%s'\n", s);
+      }
+      zpu_target[t] = 1;
+    }
+  }
+  for (off = 0; off < zpu_text.len; off += strlen(zpu_text.buf + off) + 1) {
+    zpu_line(off);
+  }
+  zpu_push();
+  zpu_at[zpu_text.len] = zpu_ninsns;
+  while (zpu_data.len < mem_pos) {
+    zpu_put(&zpu_data, "", 1);
+  }
+  zpu_relax();
+}
+
+/* the raw image: code, then data at the next word */
+static void zpu_write(const char *path) {
+  int i, n = (zpu_codesz + 3) & ~3;
+  unsigned char *image = calloc(n + zpu_data.len + 1, 1);
+  FILE *f;
+  if (image == NULL) {
+    error("Out of memory\n");
+  }
+  for (i = 0; i < zpu_ninsns; i++) {
+    zpu_encode(&zpu_insns[i], image + zpu_insns[i].addr);
+  }
+  memcpy(image + n, zpu_data.buf, zpu_data.len);
+  for (i = 0; i < zpu_tabs.len; i += 2 * sizeof(int)) {
+    int *tab = (int *) (zpu_tabs.buf + i), a = zpu_addr(tab[1]);
+    unsigned char *p = image + n + tab[0];
+    p[0] = a >> 24; // big-endian
+    p[1] = a >> 16;
+    p[2] = a >> 8;
+    p[3] = a;
+  }
+  f = fopen(path, "wb");
+  if (f == NULL || fwrite(image, 1, n + zpu_data.len, f) != (size_t) (n + zpu_data.len) ||
+      fclose(f) != 0) {
+    error("Error: cannot write %s\n", path);
+  }
+  free(image);
+}
+
+/* every line with its address and bytes */
+static void zpu_list() {
+  int off, end, i, j, n;
+  unsigned char p[8];
+  for (off = 0; off < zpu_text.len; off = end) {
+    end = off + strlen(zpu_text.buf + off) + 1;
+    fprintf(out, "%06x ", zpu_addr(off));
+    for (i = zpu_at[off], n = 0; i < zpu_at[end]; i++) {
+      int len = zpu_encode(&zpu_insns[i], p);
+      for (j = 0; j < len; j++) {
+        fprintf(out, " %02x", p[j]);
+      }
+      n += len;
+    }
+    fprintf(out, "%*s  %s\n", (n < 12) ? 3 * (12 - n) : 0, "", zpu_text.buf + off);
+  }
+  fprintf(out, "%06x  data %d bytes\n", (zpu_codesz + 3) & ~3, zpu_data.len);
+}
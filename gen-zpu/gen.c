@@ -1,8 +1,8 @@
 #define emits(s) emit(s, strlen(s))
 static void error(const char *fmt, ...);
 
-#define TYPE_NUM_SIZE 2
-static int mem_pos = 0;
+#define TYPE_NUM_SIZE 4
+static __thread int mem_pos = 0;
 
 #define GEN_ADD   "pop B  \nA:=B+A \n"
 #define GEN_ADDSZ strlen(GEN_ADD)
@@ -19,6 +19,9 @@ static int mem_pos = 0;
 #define GEN_LESS  "pop B  \nA:=B<A \n"
 #define GEN_LESSSZ strlen(GEN_LESS)
 
+#define GEN_LE    "pop B  \nA:=B<=A\n"
+#define GEN_LESZ strlen(GEN_LE)
+
 #define GEN_EQ "pop B  \nA:=B==A\n"
 #define GEN_EQSZ strlen(GEN_EQ)
 #define GEN_NEQ  "pop B  \nA:=B!=A\n"
@@ -36,17 +39,56 @@ static int mem_pos = 0;
 #define GEN_MULSZ strlen(GEN_MUL)
 #define GEN_MOD "pop B  \nA:=B%A \n"
 #define GEN_MODSZ strlen(GEN_MOD)
+#define GEN_SAR "pop B  \nA:=B~>A\n" /* arithmetic >> */
+#define GEN_SARSZ strlen(GEN_SAR)
 
 #define GEN_ASSIGN "pop B  \nM[B]:=A\n"
 #define GEN_ASSIGNSZ strlen(GEN_ASSIGN)
 #define GEN_ASSIGN8 "pop B  \nm[B]:=A\n"
 #define GEN_ASSIGN8SZ strlen(GEN_ASSIGN8)
 
-#define GEN_JMP "jmp....\n"
+/* jump targets are code offsets, patched into the dots */
+#define GEN_JMP "jmp......\n"
 #define GEN_JMPSZ strlen(GEN_JMP)
 
-#define GEN_JZ "jmz....\n"
+#define GEN_JZ "jmz......\n"
 #define GEN_JZSZ strlen(GEN_JZ)
+#define GEN_JNZ "jnz......\n"
+#define GEN_JNZSZ strlen(GEN_JNZ)
+
+/* a comparison tested by a jump: GEN_CMP, then the jump taken when it is
+   false, or true (GEN_JLT, GEN_JLE), which compares B with A (see asm.c) */
+#define GEN_CMP "pop B  \n"
+#define GEN_CMPSZ strlen(GEN_CMP)
+#define GEN_JGE "jge......\n"
+#define GEN_JGESZ strlen(GEN_JGE)
+#define GEN_JGT "jgt......\n"
+#define GEN_JGTSZ strlen(GEN_JGT)
+#define GEN_JLT "jlt......\n"
+#define GEN_JLTSZ strlen(GEN_JLT)
+#define GEN_JLE "jle......\n"
+#define GEN_JLESZ strlen(GEN_JLE)
+#define GEN_JNE "jne......\n"
+#define GEN_JNESZ strlen(GEN_JNE)
+#define GEN_JEQ "jeq......\n"
+#define GEN_JEQSZ strlen(GEN_JEQ)
+
+/* jump table entries, see gen_jtab() */
+#define GEN_JTAB "tab......\n"
+#define GEN_JTABSZ strlen(GEN_JTAB)
+
+/* B:=A keeps a left operand off the stack, lspNNNN loads stack slot NNNN;
+   "push A" followed by a load of A needs no rule, the assembler pushes the
+   new value instead of replacing A */
+static struct rewrite gen_peephole[] = {
+  {"push A \npop B  \n",         "B:=A   \n"},
+  {"sp@\1\nA:=M[A]\n",           "lsp\1\n"},
+  {NULL, NULL}
+};
+
+/* the small ZPU core traps to software for shifts, multiplies and
+   divides; the software loops over the bits */
+static struct cost gen_cost = {1, 8, 8, 40, 0, 80};
 
 
 struct _imm_struct {
@@ -54,56 +96,52 @@ struct _imm_struct {
   int v[5];
 };
 
-int fixme_offset = 0;
-int addrCnt = 0;
-
 static struct _imm_struct _load_immediate( int32_t v );
 
-static void gen_start(int nGlobalVars) {
-  char buf[100];
-  sprintf(buf,"GLOBALS %d\n", nGlobalVars);
-  strcat(buf,"---\n");
-  fixme_offset = strlen(buf) + 1 + 3;
-  strcat(buf,"JMP xxxx\n");
-  strcat(buf,"---\n");
-  emits(buf);
+#define GEN_OBJECT /* -c writes the image */
+#include "asm.c"
+
+static __thread int main_addr = 0;
+
+static void gen_reset() {
+  mem_pos = 0;
+  main_addr = 0;
+  zpu_reset();
+}
+
+static void gen_start() {
+  code_sink = zpu_code;
+  // reset: call main, stop with its result on the stack
+  emits("push A \nA:=P");
+  main_addr = codepos;
+  codehold = main_addr; // keep the entry call until main is known
+  emits("......\ncall A \nhalt   \n");
 }
 
 static void gen_finish() {
-  struct sym *funcmain = sym_find("_main");
-  char s[32];
-  if (NULL==funcmain) {
+  struct sym *funcmain = sym_find(intern("main", 4));
+  if (NULL==funcmain || funcmain->type != 'F') {
     error("ERROR: could not find main function\n");
   }
-  sprintf(s, "%04x", funcmain->addr);
-  memcpy(code+fixme_offset, s, 4);
-  printf("%s", code);
+  code_flush();
+  zpu_assemble();
+  if (objpath != NULL) {
+    zpu_write(objpath);
+  } else {
+    zpu_list();
+  }
 }
 
-// generate function pre-amble
-// nVars: number of variables to save in the stack frame
 static void gen_preamble(int nVars) {
-  char buf[100];
-  sprintf(buf,"PREAMB %d\n",nVars);
-  emits(buf);
-  stack_pos = stack_pos + 1;
-}
-
-static void gen_postamble(int nVars) {
-  char buf[100];
-  sprintf(buf,"POSTAMB %d\n",nVars);
-  emits(buf);
-  stack_pos = stack_pos + 1;
+  (void) nVars;
 }
 
 static void gen_call_cleanup(int nVars) {
-  char buf[100];
-  sprintf(buf,"DO CLEAN %d\n",nVars);
-  emits(buf);
+  (void) nVars;
 }
 
 static void gen_ret(int nVars) {
-  gen_postamble(nVars);
+  (void) nVars;
   emits("ret    \n");
   stack_pos = stack_pos - 1;
 }
@@ -119,12 +157,34 @@ static void gen_sym(struct sym *sym) {
     sym->addr = mem_pos;
     mem_pos = mem_pos + TYPE_NUM_SIZE;
   }
+  if (sym->type == 'F') {
+    emits("enter  \n"); // the called function finds no A on the stack
+  }
+  if (sym->type == 'F' && sym->name == intern("main", 4)) {
+    char s[32];
+    sprintf(s, "%06x", sym->addr);
+    memcpy(code_at(main_addr), s, 6);
+    codehold = -1;
+  }
 }
 
 static void gen_loop_start() {}
 
+/* jump to entry A of the n GEN_JTAB entries that follow */
+static void gen_jtab(int n) {
+  (void) n;
+  emits("case A \n");
+}
+
+/* functions are at code offsets, globals at data offsets */
 static void gen_sym_addr(struct sym *sym) {
-  gen_const(sym->addr);
+  char s[32];
+  if (sym->type == 'F') {
+    sprintf(s, "A:=P%06x\n", sym->addr);
+  } else {
+    sprintf(s, "A:=G%04x\n", sym->addr);
+  }
+  emits(s);
 }
 
 static void gen_push() {
@@ -159,25 +219,22 @@ static void gen_call() {
   emits("call A \n");
 }
 
+/* strings live in the data after the globals */
 static void gen_array(char *array, int size) {
-  int i = size;
-  char *tok = array;
-  /* put token on stack */
-  for (; i >= 0; i-=2) {
-    gen_const((tok[i] << 8 | tok[i-1]));
-    gen_push();
-  }
-  /* put token address on stack */
-  gen_stack_addr(0);
+  char s[32];
+  sprintf(s, "A:=G%04x\n", zpu_string(array, size));
+  emits(s);
 }
 
 
-static void gen_patch(uint8_t *op, int value) {
+static void gen_patch(int op, int value) {
   char s[32];
-  sprintf(s, "%04x", value);
-  memcpy(op-5, s, 4);
+  sprintf(s, "%06x", value);
+  memcpy(code_at(op-7), s, 6);
 }
 
+/* the shortest IM sequence loading v: the first IM sign extends its 7 bits,
+   each further one shifts them left and adds 7 more */
 static struct _imm_struct _load_immediate( int32_t v ) {
   int      flag  = (v<0) ? 1 : 0;
   uint32_t tmp   = v;
@@ -202,12 +259,11 @@ static struct _imm_struct _load_immediate( int32_t v ) {
     if ( (nOnes>=19) && (nOnes<=25) ) nImm = 2;
     if ( (nOnes>=26) && (nOnes<=32) ) nImm = 1;
   } else {
-    while (1) {
-      if (0==tmp) break;
-      tmp >>= 7;
+    // the sign bit of the first IM must stay clear
+    nImm = 1;
+    while (nImm < 5 && (tmp >> (7*nImm - 1)) != 0) {
       nImm++;
     }
-    if (0==nImm) nImm++;
   }
   tmp = v;
   for (ii=0; ii<nImm; ii++) {
@@ -218,7 +274,6 @@ static struct _imm_struct _load_immediate( int32_t v ) {
   _ret.nImm = nImm;
   for (ii=0; ii<nImm; ii++) {
     _ret.v[ii] = 0x80 | vals[nImm-ii-1];
-    //printf("0x%02x IM %d\n", 0x80 | vals[nImm-ii-1], vals[nImm-ii-1]);
   }
+  return _ret;
 }
-
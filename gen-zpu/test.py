@@ -1,5 +1,7 @@
+import subprocess
 import unittest
 from cucu import CucuVM
+from zpu import ZpuVM
 
 #
 #
@@ -188,6 +190,37 @@ class TestLoops(unittest.TestCase):
 		c = CucuVM("int main() { int i;int j; i=j=3; "+
 				"while (i != 5) { j = 0; while (j < 10) j=j+3; i=i+1;} return i+j; }")
 		self.assertEquals(c.A, 17)
+	def test_for_loop(self):
+		c = CucuVM("int main() { int i; int s = 0; for (i = 0; i < 5; i = i + 1) s = s + i; for (;;) return s + i; }")
+		self.assertEquals(c.A, 15)
+	def test_do_while(self):
+		c = CucuVM("int main() { int i = 7; do i = i + 1; while (i < 3); do i = i + 2; while (i < 12); return i; }")
+		self.assertEquals(c.A, 12)
+	def test_loop_return(self):
+		c = CucuVM("int main() { int i = 3; int j = 1; while (i < 5) return i + 7; do return j; while (i); return i; }")
+		self.assertEquals(c.A, 10)
+	def test_long_step(self):
+		step = " + ".join(["(i - i)"] * 80) # grows the IR while the loop is built
+		c = CucuVM("int main() { int i; int s = 0; for (i = 0; i < 5; i = i + 1 + (%s)) s = s + i; return s + i; }" % step)
+		self.assertEquals(c.A, 15)
+	def test_break_continue(self):
+		c = CucuVM("int main() { int i; int s = 0; for (i = 0; i < 10; i = i + 1) { int j = i; "+
+				"if (j == 2) continue; if (j == 6) break; do { int k = 1; if (s > 9) break; s = s + k; continue; } while (0); } return s + i; }")
+		self.assertEquals(c.A, 11)
+
+#
+#
+#
+class TestSwitch(unittest.TestCase):
+	def test_dense(self):
+		c = CucuVM("int f(int x) { int r = 0; switch (x) { case 1: r = 10; break; case 2: r = 20; case 3: r = r + 3; break; case 5: { int q = 7; r = q; break; } case 6: case 7: r = 67; break; default: r = 99; } return r; } int main() { int i; int s = 0; for (i = 0; i < 9; i = i + 1) s = s + (f(i) * (i + 1)); return s & 255; }")
+		self.assertEquals(c.A, 73)
+	def test_sparse(self):
+		c = CucuVM("int g(int x) { switch (x) { case 100: return 1; case 3000: return 2; case 7: return 3; case 5: return 4; case 42: return 5; case 900: return 6; } return 0; } int main() { return g(100) + (g(3000) * 2) + (g(7) * 4) + (g(5) * 8) + (g(42) * 16) + (g(900) * 32) + (g(8) * 64) + g(0) - 256; }")
+		self.assertEquals(c.A, 65)
+	def test_break_continue(self):
+		c = CucuVM("int main() { int i; int n = 0; for (i = 0; i < 20; i = i + 1) switch (i & 7) { case 0: case 2: n = n + 1; continue; case 5: if (i > 8) break; n = n + 10; default: switch (i) { case 3: n = n + 100; } } return n; }")
+		self.assertEquals(c.A, 116)
 
 #
 #
@@ -255,7 +288,109 @@ class TestMath(unittest.TestCase):
 		self.assertEquals(c.A, 1)
 		c = CucuVM("int main() { return 2 < 2;}")
 		self.assertEquals(c.A, 0)
+		c = CucuVM("int main() { int a = 2; return (a > 1) + (a > 2) + (a <= 2) + (a <= 1) + (a >= 3);}")
+		self.assertEquals(c.A, 2)
+		c = CucuVM("int main() { int a = 2; int n = 0; if (a <= 2) n = n + 1; if (a >= 2) n = n + 2; if (a > 2) n = n + 4; while (a < 5) a = a + 1; return n + a;}")
+		self.assertEquals(c.A, 8)
+	def test_logic(self):
+		c = CucuVM("int main() { int a = 2; int b = 0; return (a && b) + (2 * (a || b)) + (4 * (b || a)) + (8 * !b) + (16 * !a);}")
+		self.assertEquals(c.A, 14)
+		c = CucuVM("int n; int f(int x) { n = n + 1; return x; } int main() { int r = f(0) && f(1); r = r + (f(1) || f(1)); return (r * 10) + n;}")
+		self.assertEquals(c.A, 12)
+		c = CucuVM("int main() { int i = 0; int s = 0; while (i < 10 && s < 20 || i == 3) { if (!(i&&!s) || i == 1) s = s + i; i = i + 1; } return s;}")
+		self.assertEquals(c.A, 21)
+	def test_constant_folding(self):
+		c = CucuVM("int main() { return (2 + 3) << 2;}")
+		self.assertEquals(c.A, 20)
+		c = CucuVM("int main() { return 3 - 5 + 4;}")
+		self.assertEquals(c.A, 2)
+	def test_constant_folding_word(self):
+		# words are 16-bit unsigned: folded and computed at runtime alike
+		for folded, computed, result in (("(0 - 1) < 0", "(x - 1) < 0", 0),
+				("(65535 + 1) == 0", "(x + 65535 + 1) == 0", 1), ("(0 - 2) / 2", "(x - 2) / 2", 32767),
+				("(0 - 1) % 10", "(x - 1) % 10", 5), ("(1 << 16) + 3", "((x + 1) << 16) + 3", 3)):
+			c = CucuVM("int main() { return %s;}" % folded)
+			self.assertEquals(c.A, result)
+			c = CucuVM("int main() { int x = 0; return %s;}" % computed)
+			self.assertEquals(c.A, result)
+	def test_simplify(self):
+		c = CucuVM("int main() { int i = 7; return 0 + i * 1;}")
+		self.assertEquals(c.A, 7)
+		c = CucuVM("int main() { int i = 7; return (i & 0) + (i << 0);}")
+		self.assertEquals(c.A, 7)
+		c = CucuVM("int i; int f() { i = 3; return 1; } int main() { return (f() & 0) + i;}")
+		self.assertEquals(c.A, 3)
+	def test_constant_operands(self):
+		c = CucuVM("int main() { int i = 100; char *s = \"\\x2a\"; return (i / 8) + (i % 16) + (i * 10) + (i / 7) + (i % 7) + (i * 3) + (s[0] / 4) + (s[0] % 4);}")
+		self.assertEquals(c.A, 1344)
+	def test_parenthesized_var(self):
+		c = CucuVM("int main() { int i = 7; return (i) + 1;}")
+		self.assertEquals(c.A, 8)
 
+#
+#
+#
+class TestOptimizer(unittest.TestCase):
+	def smaller(self, src, result):
+		for opt in (1, 2):
+			c = CucuVM(src, opt=opt)
+			self.assertEquals(c.A, result)
+			self.assertTrue(len(c.code) < len(CucuVM(src).code))
+	def test_copy_propagation(self):
+		self.smaller("int main() { int i; int j; i = 5; j = i; i = 3; return j; }", 5)
+		self.smaller("int i; int main() { int j = 4; i = j; return i + j; }", 8)
+	def test_dead_stores(self):
+		self.smaller("int main() { int i; i = 3; i = 4; return i; }", 4)
+		self.smaller("int i; int main() { i = 3; i = 4; return i; }", 4)
+	def test_globals_clobbered(self):
+		c = CucuVM("int i; int f() { i = 2; } int main() { i = 1; f(); return i; }", opt=2)
+		self.assertEquals(c.A, 2)
+		c = CucuVM("char *s; int main() { s = 3; s[0] = 5; s[0] = 6; return s[0]; }", opt=2)
+		self.assertEquals(c.A, 6)
+	def test_common_subexpressions(self):
+		src = "int a; int b; int f() { int x = a - b; int y = a - b; return x + y; }"+ \
+			"int main() { a = 9; b = 2; return f(); }"
+		self.assertEquals(CucuVM(src, opt=2).A, 14)
+		self.assertTrue(len(CucuVM(src, opt=2).code) < len(CucuVM(src, opt=1).code))
+		src = "int a; int b; int f() { int x = a - b; a = 1; return x + (a - b); }"+ \
+			"int main() { a = 9; b = 2; return f(); }"
+		self.assertEquals(CucuVM(src, opt=2).A, 6)
+	def test_peephole(self):
+		self.smaller("int f(int a) { return a + 1; } int main() { return f(4); }", 5)
+		self.smaller("int main() { char *s = \"\\x05\\x07\"; return s[0] + s[1]; }", 12)
+	def test_scopes(self):
+		c = CucuVM("int main() { int i = 1; { int j = i; i = j + 1; } return i; }", opt=2)
+		self.assertEquals(c.A, 2)
+		c = CucuVM("int main() { int i = 1; while (i < 4) { int j = i; i = j + 1; } return i; }", opt=2)
+		self.assertEquals(c.A, 4)
+	def test_redefinition(self):
+		# a parameter and a local of the function's outermost block clash
+		for src, ok in (("int f(int x) { int x; x = 3; return x; } int main() { return f(1); }", False),
+				("int f(int x) { int y; int y; return x; } int main() { return f(1); }", False),
+				("int f(int x) { { int x; x = 3; } return x; } int main() { return f(1); }", True),
+				("int x; int f(int x) { return x; } int main() { return f(1); }", True)):
+			p = subprocess.run([CucuVM.CUCU_PATH], input=src.encode('ascii'),
+					stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+			self.assertEqual(p.returncode == 0, ok, src)
+
+#
+# The ZPU code itself, run by zpu.py
+#
+class TestImage(unittest.TestCase):
+	def run_all(self, src, result):
+		for opt in (0, 1, 2):
+			self.assertEquals(ZpuVM(src, opt=opt).A, result)
+	def test_loops(self):
+		self.run_all("int main() { int i; int s = 0; for (i = 0; i < 10; i = i + 1) { if (i == 2) continue; if (i == 6) break; s = s + i; } do s = s + 1; while (s < 20); return s; }", 20)
+	def test_jump_table(self):
+		src = "int f(int x) { int r = 0; switch (x) { case 1: r = 10; break; case 2: r = 20; case 3: r = r + 3; break; case 5: { int q = 7; r = q; break; } case 6: case 7: r = 67; break; default: r = 99; } return r; } int main() { int i; int s = 0; for (i = 0 - 2; i < 10; i = i + 1) s = s + (f(i) * (i + 3)); return s; }"
+		code = subprocess.run([ZpuVM.CUCU_PATH], input=src.encode('ascii'), stdout=subprocess.PIPE).stdout
+		self.assertTrue(b'case A' in code) # dispatched through a table
+		self.run_all(src, 5066)
+	def test_sparse_switch(self):
+		self.run_all("int g(int x) { switch (x) { case 100: return 1; case 3000: return 2; case 7: return 3; case 5: return 4; case 42: return 5; case 900: return 6; } return 0; } int main() { return g(100) + (g(3000) * 2) + (g(7) * 4) + (g(5) * 8) + (g(42) * 16) + (g(900) * 32) + (g(8) * 64) + g(0) - 256; }", 65)
+	def test_constant_operands(self):
+		self.run_all("int main() { int a = 0 - 7; int b = 0 - 100; return (a / 2) + (a % 4) + (b / 3) + (b % 8) + (b / (0 - 8)) + (a * (0 - 3)) + (a * 10) + 200; }", 120)
 
 if __name__ == '__main__':
 	unittest.main()
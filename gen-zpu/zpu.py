@@ -0,0 +1,130 @@
+import struct
+import subprocess
+import tempfile
+
+#
+# Run the image cucu-zpu writes with -c: a ZPU with the image at address 0
+# and the stack at the top of memory.  Emulated opcodes are executed
+# directly instead of trapping to software.
+#
+class ZpuVM:
+	CUCU_PATH='./cucu-zpu'
+	MEMSZ = 1 << 20
+	MAXSTEPS = 1000000
+	def __init__(self, src, opt=0):
+		with tempfile.NamedTemporaryFile() as f:
+			p = subprocess.Popen([self.CUCU_PATH, '-O%d' % opt, '-c', f.name],
+					stdout=subprocess.DEVNULL, stdin=subprocess.PIPE)
+			p.communicate(src.encode('ascii'))
+			if p.returncode != 0:
+				raise Exception('cucu-zpu failed')
+			self.image = f.read()
+		self.mem = bytearray(self.MEMSZ)
+		self.mem[:len(self.image)] = self.image
+		self.SP = self.MEMSZ - 4
+		self.PC = 0
+		self.A = self.run()
+
+	def load(self, addr):
+		return struct.unpack('>I', self.mem[addr:addr+4])[0]
+	def store(self, addr, v):
+		self.mem[addr:addr+4] = struct.pack('>I', v & 0xffffffff)
+	def push(self, v):
+		self.SP -= 4
+		self.store(self.SP, v)
+	def pop(self):
+		v = self.load(self.SP)
+		self.SP += 4
+		return v
+
+	# the value on top of the stack at the breakpoint, as a signed int
+	def run(self):
+		im = False
+		for step in range(self.MAXSTEPS):
+			op = self.mem[self.PC]
+			self.PC += 1
+			if op & 0x80:
+				if im:
+					self.push((self.pop() << 7) | (op & 0x7f))
+				else:
+					self.push((op & 0x7f) - (0x80 if op & 0x40 else 0))
+				im = True
+				continue
+			im = False
+			if op & 0xe0 == 0x60: # loadsp
+				self.push(self.load(self.SP + ((op & 0x1f) ^ 0x10) * 4))
+			elif op & 0xe0 == 0x40: # storesp
+				addr = self.SP + ((op & 0x1f) ^ 0x10) * 4
+				self.store(addr, self.pop())
+			elif op & 0xf0 == 0x10: # addsp
+				self.store(self.SP, self.load(self.SP) + self.load(self.SP + (op & 0xf) * 4))
+			elif op == 0x00:
+				v = self.load(self.SP)
+				return v - (1 << 32) if v & 0x80000000 else v
+			elif op == 0x02:
+				self.push(self.SP)
+			elif op == 0x04:
+				self.PC = self.pop()
+			elif op == 0x08:
+				self.push(self.load(self.pop()))
+			elif op == 0x09:
+				self.push(~self.pop())
+			elif op == 0x0b:
+				pass
+			elif op == 0x0c:
+				addr = self.pop()
+				self.store(addr, self.pop())
+			elif op == 0x0d:
+				self.SP = self.pop()
+			elif op == 0x2d: # call
+				addr = self.pop()
+				self.push(self.PC)
+				self.PC = addr
+			elif op == 0x33:
+				self.push(self.mem[self.pop()])
+			elif op == 0x34:
+				addr = self.pop()
+				self.mem[addr] = self.pop() & 0xff
+			elif op in (0x37, 0x38, 0x39): # eqbranch, neqbranch, poppcrel
+				off = self.signed(self.pop())
+				taken = op == 0x39 or (self.pop() == 0) == (op == 0x37)
+				if taken:
+					self.PC += off - 1
+			elif op in self.binops:
+				a = self.pop()
+				b = self.pop()
+				self.push(self.binops[op](a, b))
+			else:
+				raise Exception('bad opcode %02x at %x' % (op, self.PC - 1))
+		raise Exception('too many steps')
+
+	@staticmethod
+	def signed(v):
+		v &= 0xffffffff
+		return v - (1 << 32) if v & 0x80000000 else v
+
+	@staticmethod
+	def div(a, b, mod):
+		a = ZpuVM.signed(a)
+		b = ZpuVM.signed(b)
+		q = abs(a) // abs(b) * (1 if (a < 0) == (b < 0) else -1)
+		return a - q * b if mod else q
+
+	# a is the top of the stack, b the word under it
+	binops = {
+		0x05: lambda a, b: a + b,
+		0x06: lambda a, b: a & b,
+		0x07: lambda a, b: a | b,
+		0x24: lambda a, b: int(ZpuVM.signed(a) < ZpuVM.signed(b)),
+		0x25: lambda a, b: int(ZpuVM.signed(a) <= ZpuVM.signed(b)),
+		0x29: lambda a, b: a * b,
+		0x2a: lambda a, b: (b & 0xffffffff) >> (a & 0x3f),
+		0x2b: lambda a, b: b << (a & 0x3f),
+		0x2c: lambda a, b: ZpuVM.signed(b) >> (a & 0x3f),
+		0x2e: lambda a, b: int(a & 0xffffffff == b & 0xffffffff),
+		0x2f: lambda a, b: int(a & 0xffffffff != b & 0xffffffff),
+		0x31: lambda a, b: b - a,
+		0x32: lambda a, b: a ^ b,
+		0x35: lambda a, b: ZpuVM.div(a, b, False),
+		0x36: lambda a, b: ZpuVM.div(a, b, True),
+	}
@@ -0,0 +1,218 @@
+//
+// BLOCK SCANNERS
+//
+// The lexer spends most of its time skipping indentation, comment bodies
+// and name characters.  These helpers find the end of such runs, either a
+// byte at a time or 16/32 bytes at a time with SSE2/AVX2.  The best
+// implementation supported by the CPU is selected at runtime by scan_init().
+//
+// All scanners stop at the terminating NUL of the input.  The SIMD versions
+// only use aligned loads, so they never touch a page past the one holding
+// that NUL.
+
+/* character classes */
+#define C_SPACE 0x01
+#define C_NAME  0x02  /* letters, digits and '_' */
+#define C_OP    0x04  /* chars grouped into multi-char operators */
+static unsigned char cclass[256];
+
+#define SCAN_SCALAR 0
+#define SCAN_SSE2   1
+#define SCAN_AVX2   2
+
+static char *(*scan_space)(char *p);   /* first non-space char at or after p */
+static char *(*scan_name)(char *p);    /* first non-name char at or after p */
+static char *(*scan_comment)(char *p); /* the "*" of the next "*" "/", or the NUL */
+
+static char *scan_space_scalar(char *p) {
+  while (cclass[(unsigned char) *p] & C_SPACE) p++;
+  return p;
+}
+
+static char *scan_name_scalar(char *p) {
+  while (cclass[(unsigned char) *p] & C_NAME) p++;
+  return p;
+}
+
+static char *scan_comment_scalar(char *p) {
+  while (*p && !(p[0] == '*' && p[1] == '/')) p++;
+  return p;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_SCAN_SIMD
+
+/* most runs between tokens are a char or two long: settle those without
+   paying for the vector setup */
+#define SHORT_RUN(p, cls) \
+  do { \
+    if (!(cclass[(unsigned char) (p)[0]] & (cls))) return (p); \
+    if (!(cclass[(unsigned char) (p)[1]] & (cls))) return (p) + 1; \
+  } while (0)
+
+/* bit i set if v[i] is ' ', '\t', '\n', '\v', '\f' or '\r' */
+__attribute__((target("sse2")))
+static unsigned space_mask_sse2(__m128i v) {
+  __m128i t = _mm_sub_epi8(v, _mm_set1_epi8(9));
+  __m128i ws = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t);
+  return _mm_movemask_epi8(_mm_or_si128(ws, _mm_cmpeq_epi8(v, _mm_set1_epi8(' '))));
+}
+
+/* bit i set if v[i] is a letter, a digit or '_' */
+__attribute__((target("sse2")))
+static unsigned name_mask_sse2(__m128i v) {
+  __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+  __m128i a = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+  __m128i r = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+  r = _mm_or_si128(r, _mm_cmpeq_epi8(_mm_min_epu8(a, _mm_set1_epi8(25)), a));
+  r = _mm_or_si128(r, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+  return _mm_movemask_epi8(r);
+}
+
+__attribute__((target("sse2")))
+static char *scan_space_sse2(char *p) {
+  char *b;
+  SHORT_RUN(p, C_SPACE);
+  b = (char *) ((uintptr_t) p & ~(uintptr_t) 15);
+  unsigned m = ~space_mask_sse2(_mm_load_si128((__m128i *) b)) & (0xffffu << (p - b)) & 0xffffu;
+  while (m == 0) {
+    b += 16;
+    m = ~space_mask_sse2(_mm_load_si128((__m128i *) b)) & 0xffffu;
+  }
+  return b + __builtin_ctz(m);
+}
+
+__attribute__((target("sse2")))
+static char *scan_name_sse2(char *p) {
+  char *b;
+  SHORT_RUN(p, C_NAME);
+  b = (char *) ((uintptr_t) p & ~(uintptr_t) 15);
+  unsigned m = ~name_mask_sse2(_mm_load_si128((__m128i *) b)) & (0xffffu << (p - b)) & 0xffffu;
+  while (m == 0) {
+    b += 16;
+    m = ~name_mask_sse2(_mm_load_si128((__m128i *) b)) & 0xffffu;
+  }
+  return b + __builtin_ctz(m);
+}
+
+__attribute__((target("sse2")))
+static char *scan_comment_sse2(char *p) {
+  char *b = (char *) ((uintptr_t) p & ~(uintptr_t) 15);
+  unsigned first = 0xffffu << (p - b);
+  for (;;) {
+    __m128i v = _mm_load_si128((__m128i *) b);
+    unsigned star = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('*')));
+    unsigned slash = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+    unsigned nul = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & first;
+    unsigned m = (star & (slash >> 1)) | nul;
+    // a '*' in the last byte is followed by the first byte of the next block,
+    // which is only there if this block does not end the buffer
+    if (!nul && (star & 0x8000) && b[16] == '/') {
+      m |= 0x8000;
+    }
+    m &= first;
+    if (m) {
+      return b + __builtin_ctz(m);
+    }
+    first = 0xffffu;
+    b += 16;
+  }
+}
+
+__attribute__((target("avx2")))
+static unsigned space_mask_avx2(__m256i v) {
+  __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8(9));
+  __m256i ws = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(4)), t);
+  return _mm256_movemask_epi8(_mm256_or_si256(ws, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '))));
+}
+
+__attribute__((target("avx2")))
+static unsigned name_mask_avx2(__m256i v) {
+  __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+  __m256i a = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+  __m256i r = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+  r = _mm256_or_si256(r, _mm256_cmpeq_epi8(_mm256_min_epu8(a, _mm256_set1_epi8(25)), a));
+  r = _mm256_or_si256(r, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+  return _mm256_movemask_epi8(r);
+}
+
+__attribute__((target("avx2")))
+static char *scan_space_avx2(char *p) {
+  char *b;
+  SHORT_RUN(p, C_SPACE);
+  b = (char *) ((uintptr_t) p & ~(uintptr_t) 31);
+  unsigned m = ~space_mask_avx2(_mm256_load_si256((__m256i *) b)) & (0xffffffffu << (p - b));
+  while (m == 0) {
+    b += 32;
+    m = ~space_mask_avx2(_mm256_load_si256((__m256i *) b));
+  }
+  return b + __builtin_ctz(m);
+}
+
+__attribute__((target("avx2")))
+static char *scan_name_avx2(char *p) {
+  char *b;
+  SHORT_RUN(p, C_NAME);
+  b = (char *) ((uintptr_t) p & ~(uintptr_t) 31);
+  unsigned m = ~name_mask_avx2(_mm256_load_si256((__m256i *) b)) & (0xffffffffu << (p - b));
+  while (m == 0) {
+    b += 32;
+    m = ~name_mask_avx2(_mm256_load_si256((__m256i *) b));
+  }
+  return b + __builtin_ctz(m);
+}
+
+__attribute__((target("avx2")))
+static char *scan_comment_avx2(char *p) {
+  char *b = (char *) ((uintptr_t) p & ~(uintptr_t) 31);
+  unsigned first = 0xffffffffu << (p - b);
+  for (;;) {
+    __m256i v = _mm256_load_si256((__m256i *) b);
+    unsigned star = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')));
+    unsigned slash = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+    unsigned nul = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256())) & first;
+    unsigned m = (star & (slash >> 1)) | nul;
+    // a '*' in the last byte is followed by the first byte of the next block,
+    // which is only there if this block does not end the buffer
+    if (!nul && (star & 0x80000000u) && b[32] == '/') {
+      m |= 0x80000000u;
+    }
+    m &= first;
+    if (m) {
+      return b + __builtin_ctz(m);
+    }
+    first = 0xffffffffu;
+    b += 32;
+  }
+}
+#endif
+
+/* build the class table and select the scanners, using at most the given
+   SCAN_xxx level; returns the level actually selected */
+static int scan_init(int level) {
+  int i;
+  for (i = 0; i < 256; i++) {
+    cclass[i] = (isspace(i) ? C_SPACE : 0) | (isalnum(i) || i == '_' ? C_NAME : 0) |
+                (i && strchr("<=>!&|", i) ? C_OP : 0);
+  }
+#ifdef HAVE_SCAN_SIMD
+  __builtin_cpu_init();
+  if (level >= SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+    scan_space = scan_space_avx2;
+    scan_name = scan_name_avx2;
+    scan_comment = scan_comment_avx2;
+    return SCAN_AVX2;
+  }
+  if (level >= SCAN_SSE2 && __builtin_cpu_supports("sse2")) {
+    scan_space = scan_space_sse2;
+    scan_name = scan_name_sse2;
+    scan_comment = scan_comment_sse2;
+    return SCAN_SSE2;
+  }
+#endif
+  scan_space = scan_space_scalar;
+  scan_name = scan_name_scalar;
+  scan_comment = scan_comment_scalar;
+  return SCAN_SCALAR;
+}